@@ -30,7 +30,7 @@ void FFmpegPlugin::release(QMediaService *service)
 QMediaServiceProviderHint::Features FFmpegPlugin::supportedFeatures(const QByteArray &service) const
 {
     if (service == Q_MEDIASERVICE_MEDIAPLAYER)
-        return QMediaServiceProviderHint::VideoSurface; //QMediaServiceProviderHint::StreamPlayback
+        return QMediaServiceProviderHint::VideoSurface | QMediaServiceProviderHint::StreamPlayback;
 
     return QMediaServiceProviderHint::Features();
 }
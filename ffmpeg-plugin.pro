@@ -64,8 +64,8 @@ HEADERS += \
     ffmpeg-plugin.h
 
 qtHaveModule(widgets) {
-    SOURCES += videowidgetcontrol.cpp
-    HEADERS += videowidgetcontrol.h
+    SOURCES += videowidgetcontrol.cpp glyuvrenderer.cpp
+    HEADERS += videowidgetcontrol.h glyuvrenderer.h
 }
 
 OTHER_FILES += ffmpeg-plugin.json
@@ -1,8 +1,31 @@
 SOURCES += \
-    $$PWD/ffmpegprovider.cpp
+    $$PWD/ffmpegprovider.cpp \
+    $$PWD/framehistory.cpp \
+    $$PWD/framepool.cpp \
+    $$PWD/goprefill.cpp \
+    $$PWD/keyframeindex.cpp \
+    $$PWD/mediacache.cpp \
+    $$PWD/mediaopener.cpp \
+    $$PWD/probecache.cpp \
+    $$PWD/qiodeviceavio.cpp \
+    $$PWD/readaheadavio.cpp \
+    $$PWD/swsbandconverter.cpp \
+    $$PWD/timestretch.cpp
 
 HEADERS += \
-    $$PWD/ffmpegprovider.h
+    $$PWD/ffmpegprovider.h \
+    $$PWD/framehistory.h \
+    $$PWD/framepool.h \
+    $$PWD/goprefill.h \
+    $$PWD/keyframeindex.h \
+    $$PWD/mediacache.h \
+    $$PWD/mediaopener.h \
+    $$PWD/probecache.h \
+    $$PWD/qiodeviceavio.h \
+    $$PWD/readaheadavio.h \
+    $$PWD/spscring.h \
+    $$PWD/swsbandconverter.h \
+    $$PWD/timestretch.h
 
 INCLUDEPATH += ffmpeg
 
@@ -10,29 +10,85 @@
 
 #include "ffmpegprovider.h"
 #include "mediaplayercontrol.h"
-
-//#define VIDEO_FORMAT AV_PIX_FMT_RGB24
-#define VIDEO_FORMAT AV_PIX_FMT_RGB32
+#include "spscring.h"
+#include "timestretch.h"
+#include "swsbandconverter.h"
+#include "framepool.h"
+#include "framehistory.h"
+#include "goprefill.h"
+#include "mediaopener.h"
+#include "keyframeindex.h"
+#include "qiodeviceavio.h"
+#include "readaheadavio.h"
 
 #define SEEK_BEGIN -98765
 #define SEEK_CONTINUE -99223
 
 #define AUDIO_THRESHOLD_EXTRA_MS 200
 #define AUDIO_MAX_OFF_MS 300
+#define AUDIO_SYNC_THRESHOLD_MS 10          // averaged drift that makes the clock follow the audio device
+#define AUDIO_SYNC_AVG_SAMPLES 20
+
+#define MIN_PLAYBACK_RATE 0.5
+#define MAX_PLAYBACK_RATE 4.0
+#define VIDEO_SKIP_NONREF_RATE 2.0          // faster than this, non reference frames aren't decoded
+
+#define VIDEO_MAX_CONSECUTIVE_DROPS 8       // late frames dropped in a row before one is shown anyway
+#define VIDEO_LATE_WINDOW 25                // frames over which lateness is judged
+#define VIDEO_LATE_ESCALATE_FRACTION 0.25   // late fraction of a window that makes the decoder skip more
+#define VIDEO_RECOVER_WINDOWS 4             // windows without late frames before it skips less
+#define VIDEO_MAX_SKIP_LEVEL 2              // 1: no loop filter, 2: also no non reference frames
+#define AUDIO_QUEUE_MAX_MS 2000
+
+#define SDL_RING_MS 3000                    // audio ring size, in the negotiated device format
+#define SDL_MAX_CHANNELS 8
+
+#define PACKET_QUEUE_MAX_BYTES (15 * 1024 * 1024)
+#define PACKET_QUEUE_MIN_PACKETS 25
+
+#define MAX_AUTO_DECODER_THREADS 16
+
+#define VIDEO_QUEUE_TARGET_MS 1000              // buffered video per player
+#define VIDEO_QUEUE_PLAYER_MB 256               // memory budget per player
+#define VIDEO_QUEUE_PROCESS_MB 1024             // memory budget of all players together
+#define VIDEO_QUEUE_MIN_FRAMES 2                // always allowed, so a player never starves
+#define VIDEO_QUEUE_RESUME_FILL 0.5             // resume decoding when the queue is below this part of its budget
+#define VIDEO_QUEUE_PROCESS_POLL_MS 50
+
+#define FRAME_HISTORY_REFILL_FRAMES 8       // fewer frames before the playhead start decoding the previous GOP
+
+#define READ_AHEAD_MB 32                    // network read ahead per player, http(s) urls
+#define READ_AHEAD_MS 30000                 // but not more than this much of the media
+#define READ_AHEAD_LOW_MS 2000              // less buffered ahead is buffering, a stall resumes with this much
+#define READ_AHEAD_LOW_FILL 10              // the same, in percent of the budget, when the byte rate isn't known
+#define BUFFER_POLL_MS 250
+
+#define IMAGE_RING_SIZE 128
+#define AUDIO_RING_SIZE 256
 
 #include <QDebug>
 #include <QUrl>
 #include <QThread>
 #include <QMutex>
+#include <QWaitCondition>
 #include <QImage>
 #include <QRegularExpression>
 #include <QFile>
 #include <QElapsedTimer>
+#include <QTimer>
 #include <QQueue>
+#include <QVector>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QVariantMap>
 #include <QLibrary>
 #include <QProcessEnvironment>
 #include <QAudioOutput>
+#include <QAudioDeviceInfo>
+#include <QSysInfo>
 #include <QAbstractVideoBuffer>
+#include <QVideoSurfaceFormat>
 
 #include <QPainter>
 #include <QOpenGLPaintDevice>
@@ -43,6 +99,7 @@ extern "C" {
 #include <libavutil/avutil.h>
 #include <libavdevice/avdevice.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
 }
@@ -78,12 +135,25 @@ extern "C" {
 #define AUDIO_S16LSB    0x8010  /**< Signed 16-bit samples */
 #define AUDIO_S16MSB    0x9010  /**< As above, but big-endian byte order */
 
+#define AUDIO_S32LSB    0x8020  /**< 32-bit integer samples */
+#define AUDIO_S32MSB    0x9020  /**< As above, but big-endian byte order */
+#define AUDIO_F32LSB    0x8120  /**< 32-bit floating point samples */
+#define AUDIO_F32MSB    0x9120  /**< As above, but big-endian byte order */
+
 #if SDL_BYTEORDER == SDL_LIL_ENDIAN
 #define AUDIO_S16SYS    AUDIO_S16LSB
+#define AUDIO_S32SYS    AUDIO_S32LSB
+#define AUDIO_F32SYS    AUDIO_F32LSB
 #else
 #define AUDIO_S16SYS    AUDIO_S16MSB
+#define AUDIO_S32SYS    AUDIO_S32MSB
+#define AUDIO_F32SYS    AUDIO_F32MSB
 #endif
 
+#define SDL_AUDIO_ALLOW_FREQUENCY_CHANGE    0x00000001
+#define SDL_AUDIO_ALLOW_FORMAT_CHANGE       0x00000002
+#define SDL_AUDIO_ALLOW_CHANNELS_CHANGE     0x00000004
+
 typedef uint8_t Uint8;
 typedef uint16_t Uint16;
 typedef uint32_t Uint32;
@@ -130,6 +200,7 @@ extern "C" {
 }
 
 static LibSdl *loadSdl();
+static qint64 monotonicMs();
 
 /*******************************************************************************
  * Some General Defines
@@ -152,6 +223,33 @@ static LibSdl *loadSdl();
 static bool initialized = false;
 static bool _can_render = false;
 static LibSdl *lib_sdl = nullptr;
+static QAtomicInt active_providers;     // providers with running decoder threads
+static QAtomicInteger<qint64> process_image_bytes;  // bytes in the image queues of all players
+
+struct VideoQueuePolicy
+{
+    int     target_ms;
+    qint64  player_bytes;
+    qint64  process_bytes;
+};
+
+// FFMPEG_PLUGIN_VIDEO_QUEUE_MS, FFMPEG_PLUGIN_VIDEO_QUEUE_MB and FFMPEG_PLUGIN_VIDEO_QUEUE_TOTAL_MB
+static const VideoQueuePolicy &videoQueuePolicy()
+{
+    static VideoQueuePolicy policy = []() {
+        auto env = [](const char *var, int def) {
+            bool ok = false;
+            int v = qEnvironmentVariable(var).toInt(&ok);
+            return (ok && v > 0) ? v : def;
+        };
+        VideoQueuePolicy p;
+        p.target_ms = env("FFMPEG_PLUGIN_VIDEO_QUEUE_MS", VIDEO_QUEUE_TARGET_MS);
+        p.player_bytes = static_cast<qint64>(env("FFMPEG_PLUGIN_VIDEO_QUEUE_MB", VIDEO_QUEUE_PLAYER_MB)) * 1024 * 1024;
+        p.process_bytes = static_cast<qint64>(env("FFMPEG_PLUGIN_VIDEO_QUEUE_TOTAL_MB", VIDEO_QUEUE_PROCESS_MB)) * 1024 * 1024;
+        return p;
+    }();
+    return policy;
+}
 
 /*******************************************************************************
  * Initialization, Internal structures and types
@@ -167,25 +265,187 @@ static void initffmpeg()
 }
 
 typedef struct {
-    QImage      image;
+    AVFrame    *frame;          // decoded frame in its native pixel format, owned by the image_queue
+    QImage      image;          // frame converted to RGB32, when it is presented
+    int         bytes;          // size of frame
     int         position_in_ms;
+    int         serial;
 } FFmpegImage;
 
 typedef struct {
     QByteArray  audio;
     int         position_in_ms;
-    bool        clear;
+    int         serial;         // a new serial means: clear the audio device buffer first
 } FFmpegAudio;
 
+typedef struct {
+    AVPacket   *pkt;            // nullptr = flush marker, the decoder must flush its codec
+    int         serial;
+    int         seek_target_ms; // flush marker: frames before it are decoded but not shown, -1 = none
+    bool        snap_clock;     // flush marker: the clock starts at the first frame (keyframe seek)
+    bool        scrub;          // flush marker: the next packet is a scrub preview, decode only that one
+} FFmpegPacket;
+
+/*
+ * An auto reset event. A wake() that arrives before wait() is not lost,
+ * so a thread can check its conditions and then sleep until something changes.
+ */
+class WakeEvent
+{
+private:
+    QMutex               _mutex;
+    QWaitCondition       _cond;
+    bool                 _signalled;
+
+public:
+    WakeEvent();
+
+public:
+    void wake();
+    void wait(int timeout_ms = -1);
+};
+
+/*
+ * A bounded packet queue between the demuxer and one decoder stage.
+ * get() blocks until a packet is available or the queue is aborted.
+ */
+class PacketQueue
+{
+private:
+    QQueue<FFmpegPacket> _queue;
+    QMutex               _mutex;
+    QWaitCondition       _cond;
+    int                  _bytes;
+    bool                 _aborted;
+    WakeEvent           *_space;      // woken when a packet has been taken
+
+public:
+    PacketQueue();
+   ~PacketQueue();
+
+public:
+    void setSpaceEvent(WakeEvent *e);
+    void put(AVPacket *pkt, int serial);
+    void putFlush(int serial, int seek_target_ms = -1, bool snap_clock = false, bool scrub = false);
+    bool get(FFmpegPacket &p);
+    void flush();
+    void abort();
+    void start();
+
+public:
+    bool isAborted();
+    int  size();
+    int  bytes();
+};
+
+struct ConversionStats
+{
+    qint64  frames = 0;
+    qint64  total_ns = 0;
+    qint64  max_ns = 0;
+    int     bands = 0;
+};
+
+struct SeekStats
+{
+    qint64  seeks = 0;          // seeks of which the first frame has been shown
+    qint64  total_ms = 0;       // request to display
+    qint64  max_ms = 0;
+    qint64  last_ms = 0;
+};
+
+struct RenderStats
+{
+    qint64  frames = 0;
+    qint64  total_ns = 0;       // cpu time of a paint, including conversion or upload
+    qint64  max_ns = 0;
+    qint64  upload_ns = 0;
+};
+
+/*
+ * Hands a decoded frame to a QAbstractVideoSurface without copying or
+ * converting it. The buffer holds a reference to the frame until the
+ * surface releases the QVideoFrame.
+ */
+class AVFrameVideoBuffer : public QAbstractVideoBuffer
+{
+private:
+    AVFrame             *_frame;
+    MapMode              _mode;
+
+public:
+    AVFrameVideoBuffer(AVFrame *frame);
+   ~AVFrameVideoBuffer() override;
+
+public:
+    virtual MapMode mapMode() const override;
+    virtual uchar *map(MapMode mode, int *numBytes, int *bytesPerLine) override;
+    virtual int mapPlanes(MapMode mode, int *numBytes, int bytesPerLine[4], uchar *data[4]) override;
+    virtual void unmap() override;
+};
+
+/*
+ * The PCM format the audio stage delivers, negotiated with the audio device
+ * in setMedia() before the decoder threads start. Always packed (interleaved),
+ * with the default channel order for the number of channels.
+ */
+class AudioOutFormat
+{
+public:
+    int            sample_rate = 44100;
+    int            channels = 2;
+    int64_t        channel_layout = AV_CH_LAYOUT_STEREO;
+    AVSampleFormat sample_fmt = AV_SAMPLE_FMT_S16;
+    bool           passthrough = false;     // the decoder output matches, no resampling needed
+
+public:
+    int frameBytes() const { return channels * av_get_bytes_per_sample(sample_fmt); }
+    int bytesToMs(qint64 bytes) const { return static_cast<int>((bytes / frameBytes()) * 1000 / sample_rate); }
+};
 
+/*
+ * Shared with the SDL audio callback, which runs on a realtime thread and
+ * must not allocate or block.
+ */
 class SdlBuf
 {
 public:
     SDL_AudioFormat format;
-    QByteArray      audiobuf;
-    int             volume_percent;
-    bool            muted;
-    QMutex          mutex;
+    SpscByteRing    audiobuf;       // GUI thread -> audio callback
+    QAtomicInt      volume;         // SDL mix volume, 0 - SDL_MIX_MAXVOLUME, see sdlVolume()
+    QAtomicInteger<qint64> callback_ms; // monotonicMs() of the last callback
+
+public:
+    // The ring is sized with audiobuf.resize() once the device format is known
+    SdlBuf() : audiobuf(1) {}
+};
+
+/*
+ * The audio device clock: the position of the sample the device is playing,
+ * derived from the pts at the end of the audio written to the device, minus
+ * what the device hasn't consumed yet and its output latency. The playback
+ * clock (FFmpeg::currentTimeMs()) is steered towards it, so video follows
+ * the audio device instead of the system clock. GUI thread only.
+ */
+class AudioClock
+{
+public:
+    bool    valid = false;          // audio has been written since the last clear
+    int     end_pts_ms = 0;         // pts of the end of the last written audio
+    qreal   rate = 1.0;             // playback rate it was stretched to
+    qint64  written_bytes = 0;      // Qt backend, bytes written since QAudioOutput::start()
+    int     period_ms = 0;          // device buffer
+    int     latency_ms = 0;         // device output latency
+
+    // drift of the playback clock against the audio device, averaged
+    double  drift_avg_ms = 0.0;
+    int     drift_samples = 0;
+
+    // statistics, under FFmpeg::stats_mutex
+    double  last_drift_ms = 0.0;
+    double  max_drift_ms = 0.0;
+    qint64  corrections = 0;
+    qint64  corrected_ms = 0;
 };
 
 class FFmpeg
@@ -196,32 +456,162 @@ public:
     AVCodec             *pVideoCodec;
     AVCodecContext      *pVideoCtx;
     AVCodecContext      *pAudioCtx;
-    QList<AVPacket *>    packetQueue;
-    AVFrame             *pFrame;
-    AVFrame             *pFrameRGB;
-    uint8_t             *buffer;
-    QMutex               mutex;
+    PacketQueue          audio_packets;
+    PacketQueue          video_packets;
+    QAtomicInt           serial;
+    WakeEvent            demux_wake;    // state/seek requests, packet queue space, queues drained
+    WakeEvent            audio_wake;    // audio ring space, seek, abort
+    WakeEvent            video_wake;    // image ring space, seek, abort
+    QMutex               mutex;         // protects the clock (pos_offset_in_ms, elapsed, playback_rate, pause_offset_ms) and the seek request
     int                  audio_stream_index;
     int                  video_stream_index;
     int                  duration_in_ms;
-    int                  position_in_ms;
     int                  pos_offset_in_ms;
+    int                  pause_offset_ms;   // the clock while paused, -1 when not paused
     QElapsedTimer        elapsed;
-    QQueue<FFmpegImage>  image_queue;
-    QQueue<FFmpegAudio>  audio_queue;
+    qreal                playback_rate;
+    SpscRing<FFmpegImage> image_queue;  // video stage -> GUI thread, use pushImage/popImage/clearImages
+    SwsBandConverter     converter;     // GUI thread, converts the presented frame
+    QAtomicInteger<qint64> image_bytes; // bytes in image_queue
+    QAtomicInt           frame_duration_ms;
+    qint64               zero_copy_frames;  // GUI thread only
+    QAtomicInt           clock_running;     // playing, set by the demuxer
+    QAtomicInteger<qint64> late_decoded;    // late frames dropped by the video stage
+    QAtomicInteger<qint64> late_presented;  // late frames dropped by the GUI thread
+    QAtomicInt           skip_level;        // decoder skip escalation of the video stage
+    QAtomicInteger<qint64> skip_escalations;
+    SpscRing<FFmpegAudio> audio_queue;  // audio stage -> GUI thread
+    int                  audio_serial;  // GUI thread only
+    int                  image_serial;  // GUI thread only, of the last presented image
+    QAtomicInt           image_signal_pending;
+    QAtomicInt           pcm_signal_pending;
     qint64               seek_frame;
-    int                  volume_percent;
-    bool                 muted;
+    bool                 seek_precise;      // show the frame at seek_frame, otherwise the keyframe near it
+    bool                 seek_scrub;        // only the keyframe near seek_frame is decoded, playback holds
+    qint64               seek_request_ms;   // monotonic time of the seek_frame request
+    QAtomicInt           seek_pending;      // seek_frame hasn't been taken by the demuxer, work in progress is stale
+    int                  shown_serial;      // the serial of the seek below, -1 when it has been shown
+    qint64               shown_request_ms;  // request time of the seek that the demuxer has taken
+    const char          *shown_mode;
+    QAtomicInt           pushed_serial;     // of the last image queued by the video stage
+    QAtomicInteger<qint64> seek_requests;
+    QAtomicInteger<qint64> seek_coalesced;  // requests replaced by a newer one before the demuxer took them
+    QAtomicInteger<qint64> seek_aborted;    // packets dropped because a newer seek was pending
+    QAtomicInteger<qint64> scrub_previews;
+    KeyframeIndex       *keyframe_index;    // set before the threads start, nullptr when not indexed
+    QString              media_file;        // as opened, for the helper threads
+    QIODeviceAVIO       *avio;              // stream playback, nullptr for files and urls
+    ReadAheadAVIO       *read_ahead;        // http(s) urls, nullptr otherwise
+    MediaOpener         *opener;            // GUI thread, opens the media set last, nullptr when done
+    int                  open_serial;       // GUI thread
+    bool                 open_cancelled;    // GUI thread, stopped while loading, play() opens the media again
+    qint64               open_start_ms;     // GUI thread, monotonic time of setMedia()
+    qint64               play_request_ms;   // GUI thread, of the first play or pause after setMedia(), -1 before
+    qint64               open_ms;           // GUI thread, as measured by the MediaOpener, -1 when not opened
+    qint64               probe_ms;
+    bool                 probe_cached;
+    qint64               loaded_ms;         // GUI thread, setMedia() till the media was loaded, -1 before
+    qint64               first_frame_ms;    // GUI thread, requested till the first frame was shown or played, -1 before
+    qint64               byte_rate;         // of the media, 0 when unknown
+    bool                 clock_held;        // stalled, the clock doesn't run. Under mutex
+    bool                 stalled;           // GUI thread
+    QElapsedTimer        stall_timer;       // GUI thread
+    qint64               stalls;            // GUI thread
+    qint64               stalled_ms;        // GUI thread
+    FrameHistory         history;
+    GopRefill           *gop_refill;        // GUI thread, started by the first backward step
+    FFmpegImage          step_image;        // GUI thread, a frame from the history shown instead of the image_queue
+    int                  shown_position_ms; // GUI thread, of the last presented frame
+    bool                 step_resync;       // GUI thread, frames were stepped, the decoder must seek when playing
+    qint64               steps;             // GUI thread
+    qint64               step_hits;         // GUI thread, steps served from the history or the image_queue
+    QAtomicInt           volume_percent;
+    QAtomicInt           muted;
     bool                 sdl;
     SDL_AudioDeviceID    sdl_id;
     SDL_AudioFormat      sdl_format;
     SdlBuf              *sdl_buf;
     QAudioOutput        *audio_out;
     QIODevice           *audio_io;
+    AudioOutFormat       audio_format;  // set before the threads start, read only afterwards
+    AudioClock           audio_clock;
+    TimeStretch          stretch;       // GUI thread only
+    QMutex               stats_mutex;   // protects the statistics below
+    QHash<QString, ConversionStats> conversion_stats;     // per resolution "wxh"
+    QHash<QString, RenderStats> render_stats;             // per render path, "painter" or "gl"
+    QHash<QString, SeekStats> seek_stats;                 // per seek mode, "precise", "keyframe" or "scrub"
 public:
     FFmpeg();
+
+public:
+    int currentTimeMs();
+    int currentTimeMsLocked() const;
+    void adjustClock(int delta_ms);
+    void snapClock(int position_in_ms);
+    void holdClock(bool yes);
+    void seekShown(int serial);
+    void startupShown();
+    qreal playbackRate();
+    void setPlaybackRate(qreal rate);
+
+public:
+    bool pushImage(const FFmpegImage &img);
+    bool convertImage(FFmpegImage *img, const QSize &surface_size);
+    FFmpegImage *frontImage();
+    void popImage();
+    void clearImages();
+};
+
+/*
+ * The decoding pipeline consists of three stages:
+ *
+ * - DecoderThread demuxes the input with av_read_frame, handles play state
+ *   and seek requests and feeds the per-stream packet queues.
+ * - AudioDecoderThread decodes and resamples audio packets into the audio_queue.
+ * - VideoDecoderThread decodes video packets into the image_queue. The frames
+ *   stay in their native pixel format, they are converted when presented.
+ *
+ * Each stage applies its own backpressure, so a slow video frame doesn't
+ * stall audio decoding or the other way around.
+ */
+
+class DecoderStage : public QThread
+{
+protected:
+    FFmpegProvider      *_provider;
+    FFmpeg              *_ffmpeg;
+    QMutex              *_mutex;
+    PacketQueue         *_packets;
+
+public:
+    DecoderStage(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex, PacketQueue *packets);
+
+protected:
+    bool isCurrent(int serial);
+};
+
+class AudioDecoderThread : public DecoderStage
+{
+public:
+    AudioDecoderThread(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex);
+
+    // QThread interface
+protected:
+    virtual void run() override;
 };
 
+class VideoDecoderThread : public DecoderStage
+{
+public:
+    VideoDecoderThread(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex);
+
+private:
+    bool queueFull(qint64 next_bytes, qreal fill, bool &process_limited);
+
+    // QThread interface
+protected:
+    virtual void run() override;
+};
 
 class DecoderThread : public QThread
 {
@@ -232,9 +622,12 @@ private:
     FFmpegProvider      *_provider;
     FFmpeg               *_ffmpeg;
     QMutex              *_mutex;
+    QWaitCondition       _state_cond;
     bool                 _run;
     PlayState            _request;
     PlayState            _current;
+    AudioDecoderThread  *_audio;
+    VideoDecoderThread  *_video;
 
 public:
     DecoderThread(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex);
@@ -249,6 +642,16 @@ public:
     void waitForRequest();
     void waitForState(PlayState s);
 
+public:
+    void wake();
+
+private:
+    bool packetQueuesFull();
+    void putPacket(AVPacket *pkt, int serial);
+    void setRequest(PlayState s);
+    void startStages();
+    void stopStages();
+
     // QThread interface
 protected:
     virtual void run() override;
@@ -268,19 +671,42 @@ FFmpegProvider::FFmpegProvider(MediaPlayerControl *parent)
 
     _ffmpeg = new FFmpeg();
     _decoder = nullptr;
+    _play_state = Stopped;
+    _media_state = NoMedia;
 
     quint64 ptr = reinterpret_cast<quint64>(this);
     setObjectName(QString::asprintf("FFmpegProvider_%llx", ptr));
 
     _control = parent;
 
+    // Presentation deadlines of the front image and audio chunk
+    _image_timer = new QTimer(this);
+    _image_timer->setSingleShot(true);
+    _image_timer->setTimerType(Qt::PreciseTimer);
+    _audio_timer = new QTimer(this);
+    _audio_timer->setSingleShot(true);
+    _audio_timer->setTimerType(Qt::PreciseTimer);
+
+    // Network buffering, only runs for a read ahead
+    _buffer_timer = new QTimer(this);
+    _buffer_timer->setInterval(BUFFER_POLL_MS);
+    _buffer_status = 0;
+
+    _prepare_pos = 0;
+    _current_device = nullptr;
+
+    connect(_image_timer, &QTimer::timeout, this, &FFmpegProvider::handleImageAvailable);
+    connect(_audio_timer, &QTimer::timeout, this, &FFmpegProvider::handleAudioAvailable);
+    connect(_buffer_timer, &QTimer::timeout, this, &FFmpegProvider::handleBufferStatus);
     connect(this, &FFmpegProvider::imageAvailable, this, &FFmpegProvider::handleImageAvailable, Qt::QueuedConnection);
     connect(this, &FFmpegProvider::pcmAvailable, this, &FFmpegProvider::handleAudioAvailable, Qt::QueuedConnection);
     connect(this, &FFmpegProvider::setStateSig, this, &FFmpegProvider::handleSetState, Qt::QueuedConnection);
+    connect(this, &FFmpegProvider::mediaOpened, this, &FFmpegProvider::handleMediaOpened, Qt::QueuedConnection);
 }
 
 FFmpegProvider::~FFmpegProvider()
 {
+    cancelOpen();
     if (_decoder != nullptr) {
         stopThreads();
     }
@@ -290,7 +716,7 @@ FFmpegProvider::~FFmpegProvider()
 
 void FFmpegProvider::setVideoDecoders(const QStringList &dec)
 {
-    // We set them, but we don't use them.
+    // Only the "FFmpeg[:key=value...]" entry is used, see applyVideoDecoderOptions()
     _video_decoders = dec;
 }
 
@@ -309,6 +735,11 @@ void FFmpegProvider::onEvent(std::function<void (const FFmpegProvider::MediaEven
     mediaevent_cbs.append(f);
 }
 
+void FFmpegProvider::onBufferStatusChanged(std::function<void (int)> f)
+{
+    bufferstatus_cbs.append(f);
+}
+
 void FFmpegProvider::setRenderCallback(std::function<void (void *)> f)
 {
     _render_cb = f;
@@ -316,7 +747,38 @@ void FFmpegProvider::setRenderCallback(std::function<void (void *)> f)
 
 void FFmpegProvider::setState(FFmpegProvider::State s)
 {
+    // Stopping gives up opening the media, but keeps it and the pending prepare():
+    // playing opens it again. A stream that can't be read from its start again is invalid.
+    if (s == Stopped && _ffmpeg->opener != nullptr) {
+        cancelOpen();
+        if (_ffmpeg->avio != nullptr && !_ffmpeg->avio->rewind()) {
+            SIGNAL_ERROR(CannotOpenVideo, tr("The stream cannot be read again"));
+            setMediaState(Invalid);
+            if (_prepare_cb) {
+                std::function<void (qint64, bool *)> cb = _prepare_cb;
+                _prepare_cb = nullptr;
+                cb(-1, nullptr);
+            }
+        } else {
+            _ffmpeg->open_cancelled = true;
+            setMediaState(NoMedia);
+        }
+    } else if (s != Stopped && _ffmpeg->open_cancelled) {
+        openMedia(_current_url, _current_device);
+    }
+
+    // Time to the first frame counts from here when the media was set earlier
+    if (s != Stopped && _ffmpeg->play_request_ms < 0) {
+        _ffmpeg->play_request_ms = monotonicMs();
+    }
+
     if (_play_state != s) {
+        // After frame steps the decoder isn't at the shown frame, playback continues from that frame
+        if (s == Playing && _ffmpeg->step_resync) {
+            _ffmpeg->step_resync = false;
+            seek(_ffmpeg->shown_position_ms, PreciseSeek);
+        }
+
         _play_state = s;
 
         AD(_decoder->requestPlayState(DecoderThread::toDecoderState(s)));
@@ -349,20 +811,128 @@ void FFmpegProvider::setMediaState(FFmpegProvider::MediaState s)
     }
 }
 
+// make vol act logarithmic, min = 1, max = 128
+static int sdlVolume(int percentage, bool muted)
+{
+    if (muted) {
+        return 0;
+    }
+
+    double pow2 = log2(SDL_MIX_MAXVOLUME);
+    double div = 100 / pow2;
+    double exp_vol = pow(2, percentage / div);
+    int v = static_cast<int>(round(exp_vol));
+    if (exp_vol < 1.01) { v = 0; }
+    return v;
+}
+
+// Monotonic, also used from the SDL audio callback. First called from setMedia().
+static qint64 monotonicMs()
+{
+    static QElapsedTimer timer = [] { QElapsedTimer t; t.start(); return t; }();
+    return timer.elapsed();
+}
+
+/*
+ * Audio output format negotiation. We ask the device for the format of the
+ * source, so the common case (e.g. 48kHz float stereo into a 48kHz device)
+ * needs no resampling at all. Planar formats are asked packed, formats the
+ * devices don't take (8 bit, double, 64 bit) as the nearest one they do.
+ */
+
+static AudioOutFormat wantedAudioFormat(AVCodecContext *ctx)
+{
+    AudioOutFormat f;
+    f.sample_rate = (ctx->sample_rate > 0) ? ctx->sample_rate : 44100;
+    f.channels = qBound(1, ctx->channels, SDL_MAX_CHANNELS);
+    f.channel_layout = av_get_default_channel_layout(f.channels);
+
+    switch(av_get_packed_sample_fmt(ctx->sample_fmt)) {
+        case AV_SAMPLE_FMT_S32: f.sample_fmt = AV_SAMPLE_FMT_S32;
+        break;
+        case AV_SAMPLE_FMT_FLT:
+        case AV_SAMPLE_FMT_DBL: f.sample_fmt = AV_SAMPLE_FMT_FLT;
+        break;
+        default: f.sample_fmt = AV_SAMPLE_FMT_S16;
+        break;
+    }
+
+    return f;
+}
+
+static SDL_AudioFormat toSdlFormat(AVSampleFormat fmt)
+{
+    switch(fmt) {
+        case AV_SAMPLE_FMT_S32: return AUDIO_S32SYS;
+        case AV_SAMPLE_FMT_FLT: return AUDIO_F32SYS;
+        default: return AUDIO_S16SYS;
+    }
+}
+
+static bool fromSdlFormat(SDL_AudioFormat sdl_fmt, AVSampleFormat &fmt)
+{
+    switch(sdl_fmt) {
+        case AUDIO_S16SYS: fmt = AV_SAMPLE_FMT_S16; return true;
+        case AUDIO_S32SYS: fmt = AV_SAMPLE_FMT_S32; return true;
+        case AUDIO_F32SYS: fmt = AV_SAMPLE_FMT_FLT; return true;
+        default: return false;
+    }
+}
+
+static QAudioFormat toQtFormat(const AudioOutFormat &f)
+{
+    QAudioFormat qf;
+    qf.setSampleRate(f.sample_rate);
+    qf.setChannelCount(f.channels);
+    qf.setSampleSize(av_get_bytes_per_sample(f.sample_fmt) * 8);
+    qf.setSampleType((f.sample_fmt == AV_SAMPLE_FMT_FLT) ? QAudioFormat::Float : QAudioFormat::SignedInt);
+    qf.setByteOrder(QAudioFormat::Endian(QSysInfo::ByteOrder));
+    qf.setCodec("audio/pcm");
+    return qf;
+}
+
+static bool fromQtFormat(const QAudioFormat &qf, AudioOutFormat &f)
+{
+    if (qf.codec() != "audio/pcm" || qf.byteOrder() != QAudioFormat::Endian(QSysInfo::ByteOrder) ||
+        qf.channelCount() < 1 || qf.channelCount() > SDL_MAX_CHANNELS || qf.sampleRate() <= 0) {
+        return false;
+    }
+
+    if (qf.sampleType() == QAudioFormat::Float && qf.sampleSize() == 32) {
+        f.sample_fmt = AV_SAMPLE_FMT_FLT;
+    } else if (qf.sampleType() == QAudioFormat::SignedInt && qf.sampleSize() == 32) {
+        f.sample_fmt = AV_SAMPLE_FMT_S32;
+    } else if (qf.sampleType() == QAudioFormat::SignedInt && qf.sampleSize() == 16) {
+        f.sample_fmt = AV_SAMPLE_FMT_S16;
+    } else {
+        return false;
+    }
+
+    f.sample_rate = qf.sampleRate();
+    f.channels = qf.channelCount();
+    f.channel_layout = av_get_default_channel_layout(f.channels);
+    return true;
+}
+
+static bool isPassthrough(AVCodecContext *ctx, const AudioOutFormat &f)
+{
+    bool default_layout = (ctx->channel_layout == 0 ||
+                           static_cast<int64_t>(ctx->channel_layout) == av_get_default_channel_layout(ctx->channels));
+    return ctx->sample_fmt == f.sample_fmt && ctx->sample_rate == f.sample_rate &&
+           ctx->channels == f.channels && default_layout;
+}
+
 void FFmpegProvider::setVolume(int percentage)
 {
-    _ffmpeg->mutex.lock();
-    _ffmpeg->volume_percent = percentage;
+    _ffmpeg->volume_percent.storeRelaxed(percentage);
 
     if (_ffmpeg->sdl) {
         SdlBuf *buf = _ffmpeg->sdl_buf;
         if (buf) {
-            buf->mutex.lock();
-            buf->volume_percent = percentage;
-            buf->mutex.unlock();
+            buf->volume.storeRelaxed(sdlVolume(percentage, _ffmpeg->muted.loadRelaxed()));
         }
     } else { // Qt backend
-        int vol = (_ffmpeg->muted) ? 0 : _ffmpeg->volume_percent;
+        int vol = (_ffmpeg->muted.loadRelaxed()) ? 0 : _ffmpeg->volume_percent.loadRelaxed();
         if (_ffmpeg->audio_out) {
             qreal linearVolume = QAudio::convertVolume(vol / qreal(100.0),
                                                        QAudio::LogarithmicVolumeScale,
@@ -370,60 +940,197 @@ void FFmpegProvider::setVolume(int percentage)
             _ffmpeg->audio_out->setVolume(linearVolume);
         }
     }
-
-    _ffmpeg->mutex.unlock();
 }
 
 void FFmpegProvider::setMuted(bool yes)
 {
-    _ffmpeg->mutex.lock();
-    _ffmpeg->muted = yes;
+    _ffmpeg->muted.storeRelaxed(yes);
 
     if (_ffmpeg->sdl) {
         SdlBuf *buf = _ffmpeg->sdl_buf;
         if (buf) {
-            buf->mutex.lock();
-            buf->muted = yes;
-            buf->mutex.unlock();
+            buf->volume.storeRelaxed(sdlVolume(_ffmpeg->volume_percent.loadRelaxed(), yes));
         }
     } else { // Qt
-        int vol = (_ffmpeg->muted) ? 0 : _ffmpeg->volume_percent;
+        int vol = (_ffmpeg->muted.loadRelaxed()) ? 0 : _ffmpeg->volume_percent.loadRelaxed();
         if (_ffmpeg->audio_out) {
             _ffmpeg->audio_out->setVolume(vol / 100.0);
         }
     }
-
-    _ffmpeg->mutex.unlock();
 }
 
 qreal FFmpegProvider::playbackRate() const
 {
-    return 1.0;
+    return _ffmpeg->playbackRate();
 }
 
-void FFmpegProvider::setPlaybackRate(qreal /*rate*/)
+// Audio is time stretched with its pitch kept, see TimeStretch, video
+// follows the clock, which runs at the playback rate.
+void FFmpegProvider::setPlaybackRate(qreal rate)
 {
-    LINE_DEBUG << "setPlaybackRate not implemented";
+    if (rate < MIN_PLAYBACK_RATE || rate > MAX_PLAYBACK_RATE) {
+        LINE_WARN << "Playback rate" << rate << "not supported, the range is" << MIN_PLAYBACK_RATE << "-" << MAX_PLAYBACK_RATE;
+        return;
+    }
+
+    _ffmpeg->setPlaybackRate(rate);
+
+    // The next frame and audio chunk were scheduled at the old rate
+    if (_image_timer->isActive()) {
+        _image_timer->stop();
+        handleImageAvailable();
+    }
+    if (_audio_timer->isActive()) {
+        _audio_timer->stop();
+        handleAudioAvailable();
+    }
 }
 
-void FFmpegProvider::seek(qint64 pos_in_ms)
+// Only the latest request counts, a request that the demuxer hasn't taken yet is replaced.
+// While it's pending, the decoder stages drop their packets, they're for a stale target.
+void FFmpegProvider::seek(qint64 pos_in_ms, SeekMode mode)
 {
     _ffmpeg->mutex.lock();
+    if (_ffmpeg->seek_pending.loadRelaxed()) {
+        _ffmpeg->seek_coalesced.fetchAndAddRelaxed(1);
+    }
     if (pos_in_ms == SEEK_BEGIN) {
         _ffmpeg->seek_frame = SEEK_BEGIN;
     } else {
         _ffmpeg->seek_frame = FS(pos_in_ms);
     }
+    _ffmpeg->seek_precise = (mode == PreciseSeek);
+    _ffmpeg->seek_scrub = (mode == ScrubSeek);
+    _ffmpeg->seek_request_ms = monotonicMs();
+    if (_ffmpeg->opener == nullptr) {     // would interrupt the probe, openStreams() makes it pending
+        _ffmpeg->seek_pending.storeRelease(1);
+    }
+    _ffmpeg->seek_requests.fetchAndAddRelaxed(1);
     _ffmpeg->mutex.unlock();
+
+    // The frame at the new position replaces a stepped frame
+    av_frame_free(&_ffmpeg->step_image.frame);
+    _ffmpeg->step_image.image = QImage();
+
+    // The demuxer may wait for data from the network, the seek ends that read
+    if (_ffmpeg->read_ahead != nullptr) {
+        _ffmpeg->read_ahead->wake();
+    }
+
+    AD(_decoder->wake());
+}
+
+// Shows the next (direction > 0) or previous frame and pauses. Steps are served from the
+// frame history or the image_queue when they have the frame, otherwise it's a precise seek.
+// Backward steps keep the history filled with the previous GOP in the background.
+void FFmpegProvider::stepFrame(int direction)
+{
+    if (_ffmpeg->video_stream_index < 0 || direction == 0) {
+        return;
+    }
+
+    if (_play_state == Playing) {
+        setState(Paused);
+    }
+    _ffmpeg->history.setEnabled(true);
+    _ffmpeg->steps += 1;
+    _ffmpeg->step_resync = true;
+
+    int pos = _ffmpeg->shown_position_ms;
+    int frame_ms = _ffmpeg->frame_duration_ms.loadRelaxed();
+    int frame_pos = -1;
+    AVFrame *frame = nullptr;
+
+    if (direction > 0) {
+        frame = _ffmpeg->history.after(pos, frame_pos);
+
+        // The decoder is usually ahead, then the front of the queue is the next frame
+        dropStaleImages();
+        FFmpegImage *next = _ffmpeg->image_queue.front();
+        if (next != nullptr && next->position_in_ms > pos && (frame == nullptr || next->position_in_ms <= frame_pos)) {
+            av_frame_free(&frame);
+            av_frame_free(&_ffmpeg->step_image.frame);
+            _ffmpeg->step_image.image = QImage();
+            _ffmpeg->step_hits += 1;
+            if (_render_cb) { _render_cb(this); }
+            return;
+        }
+    } else {
+        frame = _ffmpeg->history.before(pos, frame_pos);
+    }
+
+    if (frame != nullptr) {
+        av_frame_free(&_ffmpeg->step_image.frame);
+        _ffmpeg->step_image.frame = frame;
+        _ffmpeg->step_image.image = QImage();
+        _ffmpeg->step_image.bytes = 0;
+        _ffmpeg->step_image.position_in_ms = frame_pos;
+        _ffmpeg->step_image.serial = _ffmpeg->serial.loadAcquire();
+        _ffmpeg->step_hits += 1;
+        _ffmpeg->history.setPlayhead(frame_pos);
+        if (_render_cb) { _render_cb(this); }
+    } else {
+        // The frame that starts one frame duration away, see the precise seek in the video stage
+        seek(qMax(0, pos + direction * frame_ms), PreciseSeek);
+        _ffmpeg->step_resync = false;
+        frame_pos = pos;
+    }
+
+    if (direction < 0) {
+        refillHistory(frame_pos);
+    }
+}
+
+// Decodes the GOP before the frames that the history has up to position_in_ms,
+// when there are only a few left
+void FFmpegProvider::refillHistory(int position_in_ms)
+{
+    int frame_ms = _ffmpeg->frame_duration_ms.loadRelaxed();
+    int frames = 0;
+    int start = _ffmpeg->history.runStart(position_in_ms, frame_ms * 3 / 2, frames);
+
+    AVStream *stream = _ffmpeg->pFormatCtx->streams[_ffmpeg->video_stream_index];
+    AVRational millisecondbase = { 1, 1000 };
+    int first_ms = (stream->start_time != AV_NOPTS_VALUE) ? av_rescale_q(stream->start_time, stream->time_base, millisecondbase) : 0;
+
+    if (frames >= FRAME_HISTORY_REFILL_FRAMES || start <= first_ms) {
+        return;
+    }
+
+    // The refill opens the media itself. A stream can only be read by the player, a network
+    // url would be fetched again outside the read ahead and the disk cache.
+    if (_ffmpeg->avio != nullptr || !QFile::exists(_ffmpeg->media_file)) {
+        return;
+    }
+
+    if (_ffmpeg->gop_refill == nullptr) {
+        _ffmpeg->gop_refill = new GopRefill(_ffmpeg->media_file, _ffmpeg->video_stream_index,
+                                            _ffmpeg->pFormatCtx->streams[_ffmpeg->video_stream_index]->codecpar,
+                                            _ffmpeg->keyframe_index, &_ffmpeg->history);
+        _ffmpeg->gop_refill->start(QThread::LowPriority);
+    }
+    _ffmpeg->gop_refill->request(start);
 }
 
+// What is presented: the frame shown, or the playback clock for audio only media.
+// The decoders run up to their queues ahead of it.
 qint64 FFmpegProvider::position() const
 {
-    qint64 p;
+    if (_ffmpeg->video_stream_index >= 0) {
+        return _ffmpeg->shown_position_ms;
+    }
+    if (_ffmpeg->audio_stream_index < 0) {
+        return 0;
+    }
+
     _ffmpeg->mutex.lock();
-    p = _ffmpeg->position_in_ms;
+    int pos = (_ffmpeg->pause_offset_ms >= 0) ? _ffmpeg->pause_offset_ms : _ffmpeg->currentTimeMsLocked();
     _ffmpeg->mutex.unlock();
-    return p;
+
+    if (_ffmpeg->duration_in_ms > 0) {
+        pos = qMin(pos, _ffmpeg->duration_in_ms);
+    }
+    return qMax(0, pos);
 }
 
 void FFmpegProvider::setAspectRatio(float ar)
@@ -464,20 +1171,111 @@ void FFmpegProvider::setBrightness(int brightness)
 
 static void sdl_audio_callback(void *user_data, uint8_t *stream, int len);
 
-bool FFmpegProvider::setMedia(const QString &_url)
+// Divide the cores over all players on this box, so they don't oversubscribe the cpu.
+// This provider is not yet counted in active_providers when its media is opened.
+static int autoThreadCount()
+{
+    int cores = QThread::idealThreadCount();
+    int players = active_providers.loadRelaxed() + 1;
+    return qBound(1, cores / players, MAX_AUTO_DECODER_THREADS);
+}
+
+/*
+ * Applies the options of the "FFmpeg" decoder entry, e.g.
+ * "FFmpeg:threads=8:thread_type=frame", to the video codec context.
+ *
+ * threads     = auto | <n>
+ * thread_type = auto | frame | slice | frame+slice
+ *
+ * Other key=value pairs are passed on to avcodec_open2().
+ */
+static void applyVideoDecoderOptions(AVCodecContext *ctx, const QStringList &decoders, AVDictionary **opts)
+{
+    QString threads = "auto";
+    QString thread_type = "auto";
+
+    for(const QString &decoder : decoders) {
+        QStringList parts = decoder.split(':');
+        if (parts.first().trimmed().toLower() != "ffmpeg") {
+            continue;   // hardware decoders are not supported by this backend
+        }
+
+        int i, N;
+        for(i = 1, N = parts.size(); i < N; i++) {
+            int eq = parts[i].indexOf('=');
+            if (eq <= 0) {
+                LINE_WARN << "Ignoring decoder option" << parts[i];
+                continue;
+            }
+            QString key = parts[i].left(eq).trimmed();
+            QString value = parts[i].mid(eq + 1).trimmed();
+            if (key == "threads") {
+                threads = value;
+            } else if (key == "thread_type") {
+                thread_type = value;
+            } else {
+                av_dict_set(opts, key.toUtf8().constData(), value.toUtf8().constData(), 0);
+            }
+        }
+        break;
+    }
+
+    bool ok = false;
+    int n = threads.toInt(&ok);
+    ctx->thread_count = (ok && n > 0) ? n : autoThreadCount();
+
+    if (thread_type == "frame") {
+        ctx->thread_type = FF_THREAD_FRAME;
+    } else if (thread_type == "slice") {
+        ctx->thread_type = FF_THREAD_SLICE;
+    } else {
+        ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+
+    LINE_INFO << "Video decoder threads:" << ctx->thread_count << "thread_type:" << thread_type;
+}
+
+bool FFmpegProvider::setMedia(const QString &url)
+{
+    _prepare_cb = nullptr;
+    return openMedia(url, nullptr);
+}
+
+bool FFmpegProvider::setMedia(QIODevice *device)
+{
+    _prepare_cb = nullptr;
+    return openMedia(QString(), device);
+}
+
+// A url, or the stream of a device when device isn't nullptr. A prepare() of the
+// media set before is kept, for opening it again after a stop while loading.
+bool FFmpegProvider::openMedia(const QString &_url, QIODevice *device)
 {
-    LINE_INFO << "Trying to load media from" << _url;
+    LINE_INFO << "Trying to load media from" << ((device != nullptr) ? QString("a stream") : _url);
 
     _current_url = _url;
+    _current_device = device;
 
+    cancelOpen();
     stopThreads();
 
     setState(Stopped);
     resetProvider();
     setMediaState(NoMedia);
 
-    QString url = _url;
-    {
+    _ffmpeg->open_cancelled = false;
+    _ffmpeg->open_start_ms = monotonicMs();
+    _ffmpeg->play_request_ms = -1;
+    _ffmpeg->open_ms = -1;
+    _ffmpeg->probe_ms = -1;
+    _ffmpeg->probe_cached = false;
+    _ffmpeg->loaded_ms = -1;
+    _ffmpeg->first_frame_ms = -1;
+
+    bool stream = (device != nullptr);
+
+    QString url = (stream) ? QString("stream") : _url;
+    if (!stream) {
         QFile f(url);
         if (f.exists()) {
             if (!url.startsWith("file:")) { url = "file:" + url; }
@@ -486,364 +1284,546 @@ bool FFmpegProvider::setMedia(const QString &_url)
 
     QUrl u(url);
 
-    if (u.scheme() == "file" || u.isLocalFile() || u.scheme() == "http" || u.scheme() == "https") {
+    bool network = (u.scheme() == "http" || u.scheme() == "https");
+
+    if (u.scheme() == "file" || u.isLocalFile() || u.scheme() == "http" || u.scheme() == "https" || stream) {
         setMediaState(Loading);
 
         QString file;
         if (u.scheme() == "file" || u.isLocalFile()) {
             file = u.toLocalFile();
-        } else {
+        } else if (!stream) {
             file = u.toString();
         }
 
-        _ffmpeg->pFormatCtx = avformat_alloc_context();
-        if (_ffmpeg->pFormatCtx == nullptr) {
-            SIGNAL_ERROR(CantAlloc, tr("Not enough memory"));
-            setMediaState(Invalid);
-            return false;
+        // Streams are read through our own AVIOContext, avformat_open_input() leaves it alone
+        if (stream) {
+            _ffmpeg->avio = new QIODeviceAVIO(device);
+            if (_ffmpeg->avio->context() == nullptr) {
+                SIGNAL_ERROR(CannotOpenVideo, tr("Cannot read from the stream"));
+                setMediaState(Invalid);
+                return false;
+            }
         }
 
-        if (avformat_open_input(&_ffmpeg->pFormatCtx, file.toLocal8Bit().constData(), nullptr, nullptr) != 0) {
-            SIGNAL_ERROR(CannotOpenVideo, tr("Cannot open the Url %1").arg(url));
-            setMediaState(Invalid);
-            return false;
+        // Network urls are read ahead by a thread of their own, so a slow read doesn't
+        // stall the demuxer while there's data buffered. A pending seek ends a waiting read.
+        bool ok = false;
+        int read_ahead_mb = qEnvironmentVariable("FFMPEG_PLUGIN_READ_AHEAD_MB").toInt(&ok);
+        if (!ok || read_ahead_mb < 0) {
+            read_ahead_mb = READ_AHEAD_MB;
         }
+        qint64 read_ahead_bytes = (network) ? static_cast<qint64>(read_ahead_mb) * 1024 * 1024 : 0;
 
-        if (avformat_find_stream_info(_ffmpeg->pFormatCtx, nullptr) != 0) {
-            SIGNAL_ERROR(CannotFindStreamInfo, tr("Cannot determine the stream information for %1").arg(url));
-            setMediaState(Invalid);
-            return false;
+        // Opening and probing reads the media, which blocks for a network url or a slow
+        // device. It's done in the background, handleMediaOpened() takes it from there.
+        _ffmpeg->open_serial += 1;
+        _ffmpeg->opener = new MediaOpener(this, _ffmpeg->open_serial, url, file,
+                                          (stream) ? _ffmpeg->avio->context() : nullptr,
+                                          read_ahead_bytes, &_ffmpeg->seek_pending);
+        _ffmpeg->opener->start();
+
+        return true;
+    } else {
+        SIGNAL_ERROR(UrlNotSupported, tr("The Url scheme for Url %1 is not supported").arg(url));
+        setMediaState(Invalid);
+        return false;
+    }
+}
+
+void FFmpegProvider::handleMediaOpened(int serial)
+{
+    MediaOpener *opener = _ffmpeg->opener;
+    if (opener == nullptr || opener->serial() != serial) {
+        return;     // cancelled, or superseded by a newer setMedia()
+    }
+
+    opener->wait();
+    _ffmpeg->opener = nullptr;
+
+    _ffmpeg->pFormatCtx = opener->takeFormatContext();
+    _ffmpeg->read_ahead = opener->takeReadAhead();
+    _ffmpeg->open_ms = opener->openMs();
+    _ffmpeg->probe_ms = opener->probeMs();
+    _ffmpeg->probe_cached = opener->probeCached();
+
+    bool ok;
+    if (_ffmpeg->pFormatCtx == nullptr) {
+        SIGNAL_ERROR(opener->error(), opener->message());
+        setMediaState(Invalid);
+        ok = false;
+    } else {
+        ok = openStreams(opener->url(), opener->file());
+    }
+    delete opener;
+
+    // Play or pause as requested while the media was opened
+    if (ok) {
+        AD(_decoder->requestPlayState(DecoderThread::toDecoderState(_play_state)));
+    } else {
+        setState(Stopped);
+    }
+
+    if (_prepare_cb) {
+        std::function<void (qint64, bool *)> cb = _prepare_cb;
+        _prepare_cb = nullptr;
+        cb((ok) ? _prepare_pos : -1, nullptr);
+    }
+}
+
+// Ends opening the media, the ffmpeg calls of the opener are interrupted
+void FFmpegProvider::cancelOpen()
+{
+    if (_ffmpeg->opener != nullptr) {
+        _ffmpeg->opener->cancel();
+        if (_ffmpeg->avio != nullptr) {
+            _ffmpeg->avio->abort();     // the probe may wait for data of a sequential device
         }
+        _ffmpeg->opener->wait();
+        delete _ffmpeg->opener;
+        _ffmpeg->opener = nullptr;
+    }
+}
 
+// Sets up the decoders and the audio output for the opened and probed pFormatCtx
+bool FFmpegProvider::openStreams(const QString &url, const QString &file)
+{
+    bool stream = (_ffmpeg->avio != nullptr);
 
-        int videoStream = -1;
-        int audioStream = -1;
+    int videoStream = -1;
+    int audioStream = -1;
 
-        audioStream= av_find_best_stream(_ffmpeg->pFormatCtx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
-        videoStream = av_find_best_stream(_ffmpeg->pFormatCtx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    audioStream= av_find_best_stream(_ffmpeg->pFormatCtx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    videoStream = av_find_best_stream(_ffmpeg->pFormatCtx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
 
-        //LINE_DEBUG;
-        // Find the video and audio stream
-        {
-            for (unsigned int i = 0; i < _ffmpeg->pFormatCtx->nb_streams; i++) {
-                // look for the video stream
-                if (_ffmpeg->pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && videoStream < 0)
-                {
-                    videoStream = static_cast<int>(i);
-                }
+    //LINE_DEBUG;
+    // Find the video and audio stream
+    {
+        for (unsigned int i = 0; i < _ffmpeg->pFormatCtx->nb_streams; i++) {
+            // look for the video stream
+            if (_ffmpeg->pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && videoStream < 0)
+            {
+                videoStream = static_cast<int>(i);
+            }
 
-                // look for the audio stream
-                if (_ffmpeg->pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audioStream < 0)
-                {
-                    audioStream = static_cast<int>(i);
-                }
+            // look for the audio stream
+            if (_ffmpeg->pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audioStream < 0)
+            {
+                audioStream = static_cast<int>(i);
             }
         }
+    }
 
-        _ffmpeg->audio_stream_index = audioStream;
-        _ffmpeg->video_stream_index = videoStream;
+    _ffmpeg->audio_stream_index = audioStream;
+    _ffmpeg->video_stream_index = videoStream;
 
-        //LINE_DEBUG << audioStream << videoStream;
+    //LINE_DEBUG << audioStream << videoStream;
 
-        if (_ffmpeg->audio_stream_index >= 0) {
-            _info.has_audio = true;
-            auto codec_par = _ffmpeg->pFormatCtx->streams[_ffmpeg->audio_stream_index]->codecpar;
-            _ffmpeg->pAudioCodec = const_cast<AVCodec *>(avcodec_find_decoder(codec_par->codec_id));
-            if (_ffmpeg->pAudioCodec == nullptr) {
-                SIGNAL_ERROR(CannotOpenVideo, tr("Cannot open found audiostream for %1").arg(url));
+    if (_ffmpeg->audio_stream_index >= 0) {
+        _info.has_audio = true;
+        auto codec_par = _ffmpeg->pFormatCtx->streams[_ffmpeg->audio_stream_index]->codecpar;
+        _ffmpeg->pAudioCodec = const_cast<AVCodec *>(avcodec_find_decoder(codec_par->codec_id));
+        if (_ffmpeg->pAudioCodec == nullptr) {
+            SIGNAL_ERROR(CannotOpenVideo, tr("Cannot open found audiostream for %1").arg(url));
+            setMediaState(Invalid);
+            return false;
+        } else {
+            _ffmpeg->pAudioCtx = avcodec_alloc_context3(_ffmpeg->pAudioCodec);
+            if (_ffmpeg->pAudioCtx == nullptr) {
+                SIGNAL_ERROR(CantAlloc, tr("Cannot allocate audiostream context for %1").arg(url));
                 setMediaState(Invalid);
                 return false;
             } else {
-                _ffmpeg->pAudioCtx = avcodec_alloc_context3(_ffmpeg->pAudioCodec);
-                if (_ffmpeg->pAudioCtx == nullptr) {
-                    SIGNAL_ERROR(CantAlloc, tr("Cannot allocate audiostream context for %1").arg(url));
+                int res = avcodec_parameters_to_context(_ffmpeg->pAudioCtx, codec_par);
+                if (res < 0) {
+                    SIGNAL_ERROR(CannotOpenVideo, tr("Failed to transfer audio parameters to context"));
                     setMediaState(Invalid);
                     return false;
                 } else {
-                    int res = avcodec_parameters_to_context(_ffmpeg->pAudioCtx, codec_par);
+                    res = avcodec_open2(_ffmpeg->pAudioCtx, _ffmpeg->pAudioCodec, NULL);
                     if (res < 0) {
-                        SIGNAL_ERROR(CannotOpenVideo, tr("Failed to transfer audio parameters to context"));
+                        SIGNAL_ERROR(CannotOpenVideo, tr("Failed to open audiocodec"));
                         setMediaState(Invalid);
                         return false;
-                    } else {
-                        res = avcodec_open2(_ffmpeg->pAudioCtx, _ffmpeg->pAudioCodec, NULL);
-                        if (res < 0) {
-                            SIGNAL_ERROR(CannotOpenVideo, tr("Failed to open audiocodec"));
-                            setMediaState(Invalid);
-                            return false;
-                        }
                     }
                 }
             }
-        } else {
-            _info.has_audio = false;
         }
+    } else {
+        _info.has_audio = false;
+    }
 
-        //LINE_DEBUG;
+    //LINE_DEBUG;
 
-        if (_ffmpeg->video_stream_index >= 0) {
-            _info.has_video = true;
-            auto codec_par = _ffmpeg->pFormatCtx->streams[_ffmpeg->video_stream_index]->codecpar;
-            _ffmpeg->pVideoCodec = const_cast<AVCodec *>(avcodec_find_decoder(codec_par->codec_id));
-            if (_ffmpeg->pVideoCodec == nullptr) {
-                SIGNAL_ERROR(CannotOpenVideo, tr("Cannot open found videostream for %1").arg(url));
+    if (_ffmpeg->video_stream_index >= 0) {
+        _info.has_video = true;
+        auto codec_par = _ffmpeg->pFormatCtx->streams[_ffmpeg->video_stream_index]->codecpar;
+        _ffmpeg->pVideoCodec = const_cast<AVCodec *>(avcodec_find_decoder(codec_par->codec_id));
+        if (_ffmpeg->pVideoCodec == nullptr) {
+            SIGNAL_ERROR(CannotOpenVideo, tr("Cannot open found videostream for %1").arg(url));
+            setMediaState(Invalid);
+            return false;
+        } else {
+            _ffmpeg->pVideoCtx = avcodec_alloc_context3(_ffmpeg->pVideoCodec);
+            if (_ffmpeg->pVideoCtx == nullptr) {
+                SIGNAL_ERROR(CantAlloc, tr("Cannot allocate videostream context for %1").arg(url));
                 setMediaState(Invalid);
                 return false;
             } else {
-                _ffmpeg->pVideoCtx = avcodec_alloc_context3(_ffmpeg->pVideoCodec);
-                if (_ffmpeg->pVideoCtx == nullptr) {
-                    SIGNAL_ERROR(CantAlloc, tr("Cannot allocate videostream context for %1").arg(url));
+                int res = avcodec_parameters_to_context(_ffmpeg->pVideoCtx, codec_par);
+                if (res < 0) {
+                    SIGNAL_ERROR(CannotOpenVideo, tr("Failed to transfer video parameters to context"));
                     setMediaState(Invalid);
                     return false;
                 } else {
-                    int res = avcodec_parameters_to_context(_ffmpeg->pVideoCtx, codec_par);
+                    AVDictionary *opts = nullptr;
+                    applyVideoDecoderOptions(_ffmpeg->pVideoCtx, _video_decoders, &opts);
+                    res = avcodec_open2(_ffmpeg->pVideoCtx, _ffmpeg->pVideoCodec, &opts);
+                    av_dict_free(&opts);
                     if (res < 0) {
-                        SIGNAL_ERROR(CannotOpenVideo, tr("Failed to transfer video parameters to context"));
+                        SIGNAL_ERROR(CannotOpenVideo, tr("Failed to open videocodec"));
                         setMediaState(Invalid);
                         return false;
-                    } else {
-                        res = avcodec_open2(_ffmpeg->pVideoCtx, _ffmpeg->pVideoCodec, NULL);
-                        if (res < 0) {
-                            SIGNAL_ERROR(CannotOpenVideo, tr("Failed to open videocodec"));
-                            setMediaState(Invalid);
-                            return false;
-                        }
                     }
                 }
             }
         }
+    }
 
-        //LINE_DEBUG;
-
-        _info.duration = MS(_ffmpeg->pFormatCtx->duration);
-        _ffmpeg->duration_in_ms = static_cast<int>(_info.duration);
-
-        //LINE_DEBUG;
+    //LINE_DEBUG;
 
-        if (_ffmpeg->audio_stream_index >= 0) {
-            auto ctx = _ffmpeg->pAudioCtx;
-            _info.audio.bit_rate = ctx->bit_rate;
-            _info.audio.channels = ctx->channels;
-            _info.audio.sample_rate = ctx->sample_rate;
-            _info.audio.codec = QString::fromUtf8(ctx->codec_descriptor->name);
-        }
+    _info.duration = MS(_ffmpeg->pFormatCtx->duration);
+    _ffmpeg->duration_in_ms = static_cast<int>(_info.duration);
 
-        //LINE_DEBUG;
+    //LINE_DEBUG;
 
-        if (_ffmpeg->video_stream_index >= 0) {
-            auto ctx = _ffmpeg->pVideoCtx;
-            _info.video.bit_rate = ctx->bit_rate;
-            _info.video.frame_rate = av_q2d(ctx->framerate);
-            _info.video.height = ctx->height;
-            _info.video.width = ctx->width;
-            _info.video.codec = QString::fromUtf8(ctx->codec_descriptor->name);
-        }
+    if (_ffmpeg->audio_stream_index >= 0) {
+        auto ctx = _ffmpeg->pAudioCtx;
+        _info.audio.bit_rate = ctx->bit_rate;
+        _info.audio.channels = ctx->channels;
+        _info.audio.sample_rate = ctx->sample_rate;
+        _info.audio.codec = QString::fromUtf8(ctx->codec_descriptor->name);
+    }
 
-        //LINE_DEBUG;
+    //LINE_DEBUG;
 
-        LINE_INFO << "Video information:";
-        LINE_INFO << "Width:" << _info.video.width << "Height:" << _info.video.height;
-        LINE_INFO << "Framrate:" << _info.video.frame_rate << "Bitrate:" << _info.video.bit_rate;
-        LINE_INFO << "Codec:" << _info.video.codec;
-        LINE_INFO << "Duration:" << _info.duration;
-        LINE_INFO << "Audio information:";
-        LINE_INFO << "Bitrate:" << _info.audio.bit_rate;
-        LINE_INFO << "Channels:" << _info.audio.channels;
-        LINE_INFO << "Sample Rate:" << _info.audio.sample_rate;
-        LINE_INFO << "Codec:" << _info.audio.codec;
+    if (_ffmpeg->video_stream_index >= 0) {
+        auto ctx = _ffmpeg->pVideoCtx;
+        _info.video.bit_rate = ctx->bit_rate;
+        _info.video.frame_rate = av_q2d(ctx->framerate);
+        _info.video.height = ctx->height;
+        _info.video.width = ctx->width;
+        _info.video.codec = QString::fromUtf8(ctx->codec_descriptor->name);
+    }
 
-        //LINE_DEBUG;
+    //LINE_DEBUG;
+
+    LINE_INFO << "Video information:";
+    LINE_INFO << "Width:" << _info.video.width << "Height:" << _info.video.height;
+    LINE_INFO << "Framrate:" << _info.video.frame_rate << "Bitrate:" << _info.video.bit_rate;
+    LINE_INFO << "Codec:" << _info.video.codec;
+    LINE_INFO << "Duration:" << _info.duration;
+    LINE_INFO << "Audio information:";
+    LINE_INFO << "Bitrate:" << _info.audio.bit_rate;
+    LINE_INFO << "Channels:" << _info.audio.channels;
+    LINE_INFO << "Sample Rate:" << _info.audio.sample_rate;
+    LINE_INFO << "Codec:" << _info.audio.codec;
+
+    //LINE_DEBUG;
+
+    bool try_qt_audio = false;
+    AudioOutFormat wanted;
+    if (_ffmpeg->audio_stream_index >= 0) {
+        wanted = wantedAudioFormat(_ffmpeg->pAudioCtx);
+    }
+    _ffmpeg->audio_format = wanted;
 
-        if (!allocBuffers()) {
-            setMediaState(Invalid);
-            return false;
+    if (_ffmpeg->sdl) {
+        LINE_INFO << "Using SDL Backend for audio";
+        if(lib_sdl->SDL_Init(SDL_INIT_AUDIO)) {
+            SIGNAL_ERROR(Internal, QString("Could not initialize SDL - %1").arg(lib_sdl->SDL_GetError()));
+            try_qt_audio = true;
+            _ffmpeg->sdl = false;
+        } else {
+            SdlBuf *sdl_buf = new SdlBuf();
+
+            SDL_AudioSpec wanted_spec;
+            wanted_spec.freq = wanted.sample_rate;
+            wanted_spec.format = toSdlFormat(wanted.sample_fmt);
+            wanted_spec.channels = static_cast<Uint8>(wanted.channels);
+            wanted_spec.silence = 0;
+            wanted_spec.samples = static_cast<Uint16>(qBound(512, 1 << av_log2(wanted.sample_rate / 43), 8192));  // ~23ms
+            wanted_spec.callback = sdl_audio_callback;
+            wanted_spec.userdata = sdl_buf;
+
+            SDL_AudioSpec got_spec;
+
+            // The device may pick its own rate and channel count, which we then resample to.
+            // Sample formats we can't produce are converted by SDL.
+            _ffmpeg->sdl_id = lib_sdl->SDL_OpenAudioDevice(nullptr, 0, &wanted_spec, &got_spec,
+                                                           SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+
+            AudioOutFormat got = wanted;
+            if (_ffmpeg->sdl_id > 0 && fromSdlFormat(got_spec.format, got.sample_fmt) &&
+                    got_spec.channels >= 1 && got_spec.channels <= SDL_MAX_CHANNELS) {
+                got.sample_rate = got_spec.freq;
+                got.channels = got_spec.channels;
+                got.channel_layout = av_get_default_channel_layout(got.channels);
+            } else {
+                got_spec.format = wanted_spec.format;
+            }
+            _ffmpeg->audio_format = got;
+
+            // SDL doesn't report the device latency. The callback fills the next buffer
+            // while the current one plays, so the data it takes is heard 1 - 2 periods later.
+            _ffmpeg->audio_clock = AudioClock();
+            _ffmpeg->audio_clock.period_ms = static_cast<int>(got_spec.samples * 1000LL / got.sample_rate);
+            _ffmpeg->audio_clock.latency_ms = 2 * _ffmpeg->audio_clock.period_ms;
+            sdl_buf->callback_ms.storeRelaxed(monotonicMs());
+
+            _ffmpeg->sdl_format = got_spec.format;
+            _ffmpeg->sdl_buf = sdl_buf;
+            sdl_buf->format = got_spec.format;
+            sdl_buf->audiobuf.resize(static_cast<int>(static_cast<qint64>(got.sample_rate) * got.frameBytes() * SDL_RING_MS / 1000));
+            sdl_buf->volume.storeRelaxed(sdlVolume(_ffmpeg->volume_percent.loadRelaxed(), _ffmpeg->muted.loadRelaxed()));
+
+            if (_ffmpeg->sdl_id > 0) {
+                LINE_DEBUG << "Got audio device" << _ffmpeg->sdl_id;
+            } else {
+                SIGNAL_ERROR(Internal, lib_sdl->SDL_GetError());
+            }
         }
+    } else {
+        try_qt_audio = true;
+    }
 
-        //LINE_DEBUG;
+    if (try_qt_audio) {
+        LINE_INFO << "Qt QAudioOutput Backend";
 
-        bool try_qt_audio = false;
+        _ffmpeg->sdl = false;
 
-        if (_ffmpeg->sdl) {
-            LINE_INFO << "Using SDL Backend for audio";
-            if(lib_sdl->SDL_Init(SDL_INIT_AUDIO)) {
-                SIGNAL_ERROR(Internal, QString("Could not initialize SDL - %1").arg(lib_sdl->SDL_GetError()));
-                try_qt_audio = true;
-                _ffmpeg->sdl = false;
+        QAudioDeviceInfo device = QAudioDeviceInfo::defaultOutputDevice();
+        QAudioFormat audioFormat = toQtFormat(wanted);
+        if (!device.isFormatSupported(audioFormat)) {
+            AudioOutFormat nearest = wanted;
+            if (fromQtFormat(device.nearestFormat(audioFormat), nearest)) {
+                audioFormat = toQtFormat(nearest);
             } else {
-                SdlBuf *sdl_buf = new SdlBuf();
-
-                SDL_AudioSpec wanted_spec;
-                wanted_spec.freq = 44100;
-                wanted_spec.format = AUDIO_S16SYS;
-                wanted_spec.channels = 2;
-                wanted_spec.silence = 0;
-                wanted_spec.samples = 1024;
-                wanted_spec.callback = sdl_audio_callback;
-                wanted_spec.userdata = sdl_buf;
-
-                SDL_AudioSpec got_spec;
-
-                _ffmpeg->sdl_id = lib_sdl->SDL_OpenAudioDevice(nullptr, 0, &wanted_spec, &got_spec, 0);
-                _ffmpeg->sdl_format = got_spec.format;
-                _ffmpeg->sdl_buf = sdl_buf;
-                sdl_buf->format = got_spec.format;
-                sdl_buf->volume_percent = _ffmpeg->volume_percent;
-
-                if (_ffmpeg->sdl_id > 0) {
-                    LINE_DEBUG << "Got audio device" << _ffmpeg->sdl_id;
-                } else {
-                    SIGNAL_ERROR(Internal, lib_sdl->SDL_GetError());
-                }
+                audioFormat = toQtFormat(AudioOutFormat());     // 44.1kHz S16 stereo
             }
-        } else {
-            try_qt_audio = true;
         }
+        fromQtFormat(audioFormat, _ffmpeg->audio_format);
+        _ffmpeg->audio_clock = AudioClock();
 
-        if (try_qt_audio) {
-            LINE_INFO << "Qt QAudioOutput Backend";
+        _ffmpeg->audio_out = new QAudioOutput(device, audioFormat, this);
+        qreal audio_out_vol = (_ffmpeg->muted.loadRelaxed()) ? 0.0 : (_ffmpeg->volume_percent.loadRelaxed() / 100.0);
+        _ffmpeg->audio_out->setVolume(audio_out_vol);
+        _ffmpeg->audio_io = nullptr;
+    }
 
-            _ffmpeg->sdl = false;
+    if (_ffmpeg->audio_stream_index >= 0) {
+        AudioOutFormat &out = _ffmpeg->audio_format;
+        out.passthrough = isPassthrough(_ffmpeg->pAudioCtx, out);
+        _ffmpeg->stretch.configure(out.sample_rate, out.channels,
+                                   (out.sample_fmt == AV_SAMPLE_FMT_FLT) ? TimeStretch::Float32 :
+                                   (out.sample_fmt == AV_SAMPLE_FMT_S32) ? TimeStretch::Int32 : TimeStretch::Int16);
+        LINE_INFO << "Audio output:" << out.sample_rate << "Hz" << out.channels << "channels"
+                  << av_get_sample_fmt_name(out.sample_fmt) << (out.passthrough ? "(no resampling)" : "(resampled)");
+    }
 
-            QAudioFormat audioFormat;
-            audioFormat.setSampleRate(44100);
-            audioFormat.setChannelCount(2);
-            audioFormat.setSampleSize(16);
-            audioFormat.setSampleType(QAudioFormat::SignedInt);
-            audioFormat.setCodec("audio/pcm");
+    _ffmpeg->media_file = file;
 
-            _ffmpeg->audio_out = new QAudioOutput(audioFormat, this);
-            qreal audio_out_vol = (_ffmpeg->muted) ? 0.0 : (_ffmpeg->volume_percent / 100.0);
-            _ffmpeg->audio_out->setVolume(audio_out_vol);
-            _ffmpeg->audio_io = nullptr;
+    // The time budget of the read ahead needs the byte rate, which is estimated
+    // from the size and the duration when the container doesn't give it
+    if (_ffmpeg->read_ahead != nullptr) {
+        qint64 bit_rate = _ffmpeg->pFormatCtx->bit_rate;
+        qint64 size = _ffmpeg->read_ahead->size();
+        if (bit_rate <= 0 && size > 0 && _info.duration > 0) {
+            bit_rate = size * 8 * 1000 / _info.duration;
         }
+        _ffmpeg->byte_rate = (bit_rate > 0) ? bit_rate / 8 : 0;
 
-        //LINE_DEBUG;
-        startThreads();
+        bool ok = false;
+        int read_ahead_ms = qEnvironmentVariable("FFMPEG_PLUGIN_READ_AHEAD_MS").toInt(&ok);
+        _ffmpeg->read_ahead->setByteRate(_ffmpeg->byte_rate, (ok && read_ahead_ms > 0) ? read_ahead_ms : READ_AHEAD_MS);
+        _buffer_timer->start();
+    }
 
-        //LINE_DEBUG;
-        seek(SEEK_BEGIN);
+    // Index the keyframes of the main stream in the background, if the container
+    // supports seeking to byte positions. Seeks use it once it's ready. Only local
+    // files, indexing a network url would download all of it a second time.
+    bool local = !stream && QFile::exists(file);
+    if (qgetenv("FFMPEG_PLUGIN_KEYFRAME_INDEX") != "0" && local && !(_ffmpeg->pFormatCtx->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+        int index_stream = (_ffmpeg->video_stream_index >= 0) ? _ffmpeg->video_stream_index : _ffmpeg->audio_stream_index;
+        if (index_stream >= 0) {
+            _ffmpeg->keyframe_index = new KeyframeIndex(file, index_stream);
+            _ffmpeg->keyframe_index->start(QThread::IdlePriority);
+        }
+    }
 
-        //LINE_DEBUG;
-        setMediaState(Loaded);
+    //LINE_DEBUG;
+    startThreads();
 
-        return true;
-    } else {
-        SIGNAL_ERROR(UrlNotSupported, tr("The Url scheme for Url %1 is not supported").arg(url));
-        setMediaState(Invalid);
-        return false;
+    // A position set while the media was opened is sought now, otherwise the beginning
+    _ffmpeg->mutex.lock();
+    bool sought = (_ffmpeg->seek_frame != -1);
+    if (sought) {
+        _ffmpeg->seek_request_ms = monotonicMs();
+        _ffmpeg->seek_pending.storeRelease(1);
     }
-}
+    _ffmpeg->mutex.unlock();
 
-bool FFmpegProvider::allocBuffers()
-{
-    _ffmpeg->pFrame = av_frame_alloc();
-    if (_ffmpeg->pFrame == nullptr) {
-        SIGNAL_ERROR(CantAlloc, tr("Cannot allocate frame memory"));
-        return false;
-    }
-    _ffmpeg->pFrameRGB = av_frame_alloc();
-    if (_ffmpeg->pFrameRGB == nullptr) {
-        SIGNAL_ERROR(CantAlloc, tr("Cannot allocate rgb frame memory"));
-        return false;
+    //LINE_DEBUG;
+    if (sought) {
+        AD(_decoder->wake());
+    } else {
+        seek(SEEK_BEGIN);
     }
 
-    int size = av_image_get_buffer_size(VIDEO_FORMAT, _ffmpeg->pVideoCtx->width, _ffmpeg->pVideoCtx->height, 1);
-    _ffmpeg->buffer = (uint8_t *) av_malloc(size * sizeof(uint8_t));
-
-    int res = av_image_fill_arrays(_ffmpeg->pFrameRGB->data, _ffmpeg->pFrameRGB->linesize,
-                                   _ffmpeg->buffer, VIDEO_FORMAT,
-                                   _ffmpeg->pVideoCtx->width, _ffmpeg->pVideoCtx->height,
-                                   1);
+    _ffmpeg->loaded_ms = monotonicMs() - _ffmpeg->open_start_ms;
+    LINE_INFO << "Loaded in" << _ffmpeg->loaded_ms << "ms, open" << _ffmpeg->open_ms << "ms, probe"
+              << _ffmpeg->probe_ms << "ms" << (_ffmpeg->probe_cached ? "(cached)" : "");
 
-    if (res < 0) {
-        SIGNAL_ERROR(Internal, tr("Cannot fill image arrays"));
-        return false;
-    }
+    //LINE_DEBUG;
+    setMediaState(Loaded);
 
     return true;
 }
 
-// This is called exclusively from the readerthread
+// Called from the decoder threads. The GUI thread decides if the front image
+// is due, the signal is coalesced so we don't flood the event loop.
 void FFmpegProvider::signalImageAvailable()
 {
-    // Check if we need to render an image in the queue
-    // If so, we emit the signal.
-    if (_ffmpeg->image_queue.size() > 0) {
-        FFmpegImage &img = _ffmpeg->image_queue.first();
+    if (_ffmpeg->image_signal_pending.testAndSetOrdered(0, 1)) {
+        emit imageAvailable();
+    }
+}
 
-        int pos_in_ms = img.position_in_ms;
-        int current_time_ms = _ffmpeg->pos_offset_in_ms + _ffmpeg->elapsed.elapsed();
-        if (current_time_ms >= pos_in_ms) {
-            emit imageAvailable();
-        }
+// Drops images that were decoded before the last seek, consumer side only
+void FFmpegProvider::dropStaleImages()
+{
+    int serial = _ffmpeg->serial.loadAcquire();
+    bool dropped = false;
+    FFmpegImage *img;
+    while((img = _ffmpeg->image_queue.front()) != nullptr && img->serial != serial) {
+        _ffmpeg->popImage();
+        dropped = true;
+    }
+    if (dropped) {
+        imagePopped();
+    }
+}
+
+// Consumer side, wakes the stages that wait for a free slot
+void FFmpegProvider::imagePopped()
+{
+    _ffmpeg->video_wake.wake();
+    if (_ffmpeg->image_queue.isEmpty()) {
+        _ffmpeg->demux_wake.wake();
     }
 }
 
+// Renders the front image when it's due, otherwise sleeps till it is.
 void FFmpegProvider::handleImageAvailable()
 {
-    _render_cb(this);
+    _ffmpeg->image_signal_pending.storeRelease(0);
+
+    dropStaleImages();
+
+    if (_play_state != Playing) {
+        // After a seek while paused, the frame at the new position is shown
+        FFmpegImage *img = _ffmpeg->image_queue.front();
+        if (_play_state == Paused && img != nullptr && img->serial != _ffmpeg->image_serial) {
+            _ffmpeg->seekShown(img->serial);
+            _ffmpeg->startupShown();
+            _ffmpeg->image_serial = img->serial;
+            if (_render_cb) { _render_cb(this); }
+        }
+        return;
+    }
+
+    // When the next image is due as well, the front one would only delay it
+    int current_time_ms = _ffmpeg->currentTimeMs();
+    bool dropped = false;
+    FFmpegImage *next;
+    while((next = _ffmpeg->image_queue.at(1)) != nullptr && next->position_in_ms <= current_time_ms) {
+        _ffmpeg->popImage();
+        _ffmpeg->late_presented.fetchAndAddRelaxed(1);
+        dropped = true;
+    }
+    if (dropped) {
+        imagePopped();
+    }
+
+    FFmpegImage *img = _ffmpeg->image_queue.front();
+    if (img != nullptr) {
+        int wait_ms = img->position_in_ms - current_time_ms;
+        if (wait_ms <= 0) {
+            if (img->serial != _ffmpeg->image_serial) {
+                _ffmpeg->seekShown(img->serial);
+                _ffmpeg->startupShown();
+            }
+            _ffmpeg->image_serial = img->serial;
+            if (_render_cb) { _render_cb(this); }
+        } else {
+            _image_timer->start(static_cast<int>(wait_ms / _ffmpeg->playbackRate()));
+        }
+    }
 }
 
 int FFmpegProvider::audioThresholdMs()
 {
-    int current_time_ms = _ffmpeg->pos_offset_in_ms + _ffmpeg->elapsed.elapsed();
+    int current_time_ms = _ffmpeg->currentTimeMs();
     int extra_time_ms = AUDIO_THRESHOLD_EXTRA_MS;
     int threshold_ms = (current_time_ms + extra_time_ms);
     return threshold_ms;
 }
 
+// Called from the decoder threads, see signalImageAvailable()
 void FFmpegProvider::signalPcmAvailable()
 {
-    // Check if we need to fillup more in the audiobuffer
-    // if so, we emit the signal
-    if (_ffmpeg->audio_queue.size() > 0) {
-        int i, N;
-        for(i = 1, N = _ffmpeg->audio_queue.size(); i < N && _ffmpeg->audio_queue[i].clear; i++);
-
-        if (i == N) {
-            // do nothing
-        } else {
-            FFmpegAudio &audio = _ffmpeg->audio_queue[i];
-
-            int pos_in_ms = audio.position_in_ms;
-            int threshold_ms = audioThresholdMs();
-
-            if (threshold_ms >= pos_in_ms || audio.clear) {
-                emit pcmAvailable();
-            }
-        }
+    if (_ffmpeg->pcm_signal_pending.testAndSetOrdered(0, 1)) {
+        emit pcmAvailable();
     }
 }
 
+// The serial has been bumped by the demuxer, stale audio is dropped
+// and the device buffer is cleared by handleAudioAvailable().
 void FFmpegProvider::signalClearAudioBuffer()
 {
-    _ffmpeg->audio_queue.clear();
-
-    FFmpegAudio au;
-    au.position_in_ms = -1;
-    au.clear = true;
-
-    _ffmpeg->audio_queue.enqueue(au);
+    signalPcmAvailable();
 }
 
+// The serial has been bumped by the demuxer, stale images are dropped
+// by handleImageAvailable().
 void FFmpegProvider::signalClearVideoBuffer()
 {
-    _ffmpeg->image_queue.clear();
+    signalImageAvailable();
+}
+
+// Called from the MediaOpener
+void FFmpegProvider::signalMediaOpened(int serial)
+{
+    emit mediaOpened(serial);
 }
 
 void FFmpegProvider::signalSetState(FFmpegProvider::State s)
 {
-    emit setState(s);
+    emit setStateSig(s);
 }
 
 void FFmpegProvider::audiobClearBuf()
 {
+    AudioClock &c = _ffmpeg->audio_clock;
+    c.valid = false;
+    c.drift_avg_ms = 0.0;
+    c.drift_samples = 0;
+    _ffmpeg->stretch.reset();
+
     if (_ffmpeg->sdl) {
         SdlBuf *buf = _ffmpeg->sdl_buf;
         if (buf) {
-            buf->mutex.lock();
             buf->audiobuf.clear();
-            buf->mutex.unlock();
         }
     } else { // Qt
         // _ffmpeg->audio_out->reset();
@@ -857,30 +1837,31 @@ int FFmpegProvider::audiobBufSizeInMs()
         SdlBuf *buf = _ffmpeg->sdl_buf;
         size = 0;
         if (buf) {
-            buf->mutex.lock();
             size = buf->audiobuf.size();
-            buf->mutex.unlock();
         }
     } else { // Qt
         size = 0;
         if (_ffmpeg->audio_out) {
-            size = _ffmpeg->audio_out->bytesFree();
+            size = _ffmpeg->audio_out->bufferSize() - _ffmpeg->audio_out->bytesFree();
         }
     }
 
-    int samples_in_buffer = size / 2 / 2;  // 16bit, 2 channels
-    int ms_in_buffer = (samples_in_buffer / (44100 / 1000)); // 44100 sample rate
-    return ms_in_buffer;
+    return _ffmpeg->audio_format.bytesToMs(size);
 }
 
-void FFmpegProvider::audiobPutAudio(const QByteArray &samples)
+// end_pts_ms is the media position at the end of samples, played at rate
+void FFmpegProvider::audiobPutAudio(const QByteArray &samples, int end_pts_ms, qreal rate)
 {
+    AudioClock &c = _ffmpeg->audio_clock;
+    qint64 written = 0;
+
     if (_ffmpeg->sdl) {
         SdlBuf *buf = _ffmpeg->sdl_buf;
         if (buf) {
-            buf->mutex.lock();
-            buf->audiobuf.append(samples);
-            buf->mutex.unlock();
+            written = buf->audiobuf.write(samples.constData(), samples.size());
+            if (written < samples.size()) {
+                LINE_WARN << "Audio ring full, dropped" << (samples.size() - written) << "bytes";
+            }
         }
 
         lib_sdl->SDL_PauseAudioDevice(_ffmpeg->sdl_id, 0);
@@ -888,56 +1869,186 @@ void FFmpegProvider::audiobPutAudio(const QByteArray &samples)
         if (_ffmpeg->audio_io == nullptr) {
             if (_ffmpeg->audio_out) {
                 _ffmpeg->audio_io = _ffmpeg->audio_out->start();
+                // Qt doesn't report the device latency, count one period
+                c.written_bytes = 0;
+                c.period_ms = _ffmpeg->audio_format.bytesToMs(_ffmpeg->audio_out->periodSize());
+                c.latency_ms = c.period_ms;
             }
         }
         if (_ffmpeg->audio_io) {
-            _ffmpeg->audio_io->write(samples);
+            written = _ffmpeg->audio_io->write(samples);
+            if (written > 0) {
+                c.written_bytes += written;
+            }
+        }
+    }
+
+    if (written > 0) {
+        c.end_pts_ms = end_pts_ms - static_cast<int>(_ffmpeg->audio_format.bytesToMs(samples.size() - written) * rate);
+        c.rate = rate;
+        c.valid = true;
+    }
+}
+
+// The position of the sample the audio device is playing now. False when
+// the device isn't playing our audio, e.g. after a clear or when the audio
+// stream ended before the video.
+bool FFmpegProvider::audioClockMs(int &clock_ms)
+{
+    const AudioClock &c = _ffmpeg->audio_clock;
+    const AudioOutFormat &fmt = _ffmpeg->audio_format;
+
+    if (!c.valid) {
+        return false;
+    }
+
+    int pending_ms;
+    int device_ms;
+
+    if (_ffmpeg->sdl) {
+        SdlBuf *buf = _ffmpeg->sdl_buf;
+        if (buf == nullptr) {
+            return false;
+        }
+        int pending = buf->audiobuf.size();
+        if (pending == 0) {
+            return false;
+        }
+        int since_callback_ms = static_cast<int>(monotonicMs() - buf->callback_ms.loadAcquire());
+        pending_ms = fmt.bytesToMs(pending);
+        device_ms = qBound(0, c.latency_ms - since_callback_ms, c.latency_ms);
+    } else { // Qt, the consumed samples are counted by processedUSecs()
+        if (_ffmpeg->audio_out == nullptr || _ffmpeg->audio_io == nullptr) {
+            return false;
+        }
+        pending_ms = fmt.bytesToMs(c.written_bytes) - static_cast<int>(_ffmpeg->audio_out->processedUSecs() / 1000);
+        if (pending_ms <= 0) {
+            return false;
+        }
+        device_ms = c.latency_ms;
+    }
+
+    clock_ms = c.end_pts_ms - static_cast<int>((pending_ms + device_ms) * c.rate);
+    return true;
+}
+
+// Steers the playback clock towards the audio device. Single measurements
+// jitter with the device period, so only the averaged drift is corrected.
+// Larger offsets, e.g. stale audio after a seek, are left to handleAudioAvailable().
+void FFmpegProvider::syncClock()
+{
+    int audio_ms;
+    if (_play_state != Playing || _ffmpeg->stalled || !audioClockMs(audio_ms)) {
+        return;
+    }
+
+    AudioClock &c = _ffmpeg->audio_clock;
+    int drift_ms = audio_ms - _ffmpeg->currentTimeMs();
+    if (qAbs(drift_ms) > AUDIO_MAX_OFF_MS) {
+        return;
+    }
+
+    c.drift_avg_ms = (c.drift_samples == 0) ? drift_ms : (0.9 * c.drift_avg_ms + 0.1 * drift_ms);
+    c.drift_samples += 1;
+
+    int correction_ms = 0;
+    if (c.drift_samples >= AUDIO_SYNC_AVG_SAMPLES && qAbs(c.drift_avg_ms) > AUDIO_SYNC_THRESHOLD_MS) {
+        correction_ms = static_cast<int>(round(c.drift_avg_ms));
+    }
+
+    _ffmpeg->stats_mutex.lock();
+    c.last_drift_ms = c.drift_avg_ms;
+    c.max_drift_ms = qMax(c.max_drift_ms, qAbs(static_cast<double>(drift_ms)));
+    if (correction_ms != 0) {
+        c.corrections += 1;
+        c.corrected_ms += correction_ms;
+    }
+    _ffmpeg->stats_mutex.unlock();
+
+    if (correction_ms != 0) {
+        _ffmpeg->adjustClock(correction_ms);
+        c.drift_avg_ms = 0.0;
+        c.drift_samples = 0;
+
+        // The next frame was scheduled against the old clock
+        if (_image_timer->isActive()) {
+            _image_timer->stop();
+            handleImageAvailable();
         }
     }
 }
 
 void FFmpegProvider::handleAudioAvailable()
 {
-    _ffmpeg->mutex.lock();
+    _ffmpeg->pcm_signal_pending.storeRelease(0);
+
+    int serial = _ffmpeg->serial.loadAcquire();
+    int threshold_ms = audioThresholdMs();
+    qreal rate = _ffmpeg->playbackRate();
+    bool buffer_off_checked = false;
+    bool popped = false;
 
-    if (_ffmpeg->audio_queue.size() > 0) {
+    FFmpegAudio *au;
+    while((au = _ffmpeg->audio_queue.front()) != nullptr) {
 
-        int threshold_ms = audioThresholdMs();
-        bool buffer_off_checked = false;
-        bool prev_was_clear = false;
+        if (au->serial != serial) {     // decoded before the last seek
+            _ffmpeg->audio_queue.pop();
+            popped = true;
+            continue;
+        }
 
-        while(_ffmpeg->audio_queue.size() > 0 &&
-              (((_ffmpeg->audio_queue.first().position_in_ms) <= threshold_ms) || _ffmpeg->audio_queue.first().clear)
-             ) {
+        if (_play_state != Playing) {
+            break;
+        }
 
-            //LINE_DEBUG << _ffmpeg->audio_queue.first().position_in_ms;
+        if (au->serial != _ffmpeg->audio_serial) {
+            audiobClearBuf();
+            _ffmpeg->audio_serial = au->serial;
+            buffer_off_checked = true;
+        }
 
-            FFmpegAudio &au = _ffmpeg->audio_queue.first();
+        if (au->position_in_ms > threshold_ms) {
+            _audio_timer->start(static_cast<int>((au->position_in_ms - threshold_ms) / rate));
+            break;
+        }
 
-            if (au.clear) {
-                if (!prev_was_clear) {
-                    audiobClearBuf();
-                    prev_was_clear = true;
-                }
-            } else if (!buffer_off_checked) {
-                prev_was_clear = false;
-                int ms_in_buffer = audiobBufSizeInMs();
-                int max_ms_off = AUDIO_MAX_OFF_MS;
-                if (ms_in_buffer > max_ms_off) {
-                    audiobClearBuf();
-                }
-                buffer_off_checked = true;
+        //LINE_DEBUG << au->position_in_ms;
+
+        if (!buffer_off_checked) {
+            int ms_in_buffer = static_cast<int>(audiobBufSizeInMs() * rate);     // in media time
+            int max_ms_off = AUDIO_MAX_OFF_MS;
+            if (ms_in_buffer > max_ms_off) {
+                audiobClearBuf();
             }
+            buffer_off_checked = true;
+        }
 
-            if (au.audio.size() > 0) {
-                audiobPutAudio(au.audio);
+        if (au->audio.size() > 0) {
+            const AudioOutFormat &fmt = _ffmpeg->audio_format;
+            int end_pts_ms = au->position_in_ms + fmt.bytesToMs(au->audio.size());
+            if (rate == 1.0 && _ffmpeg->stretch.isIdle()) {
+                audiobPutAudio(au->audio, end_pts_ms, rate);
+            } else {
+                QByteArray stretched;
+                _ffmpeg->stretch.process(au->audio.constData(), au->audio.size(), rate, stretched);
+                end_pts_ms -= fmt.bytesToMs(static_cast<qint64>(_ffmpeg->stretch.bufferedFrames()) * fmt.frameBytes());
+                audiobPutAudio(stretched, end_pts_ms, rate);
             }
+            _ffmpeg->startupShown();
+        }
 
-            _ffmpeg->audio_queue.dequeue();
+        _ffmpeg->audio_queue.pop();
+        popped = true;
+    }
+
+    if (popped) {
+        _ffmpeg->audio_wake.wake();
+        if (_ffmpeg->audio_queue.isEmpty()) {
+            _ffmpeg->demux_wake.wake();
         }
     }
 
-    _ffmpeg->mutex.unlock();
+    syncClock();
 }
 
 void FFmpegProvider::handleSetState(FFmpegProvider::State s)
@@ -945,6 +2056,59 @@ void FFmpegProvider::handleSetState(FFmpegProvider::State s)
     setState(s);
 }
 
+// Follows the read ahead of a network url. Playing goes through Buffering while less than
+// READ_AHEAD_LOW_MS is buffered. When the demuxer waits for data and everything decoded has
+// been presented, playback is Stalled and the clock holds, till that much is buffered again.
+void FFmpegProvider::handleBufferStatus()
+{
+    ReadAheadAVIO *read_ahead = _ffmpeg->read_ahead;
+    if (read_ahead == nullptr) {
+        return;
+    }
+
+    int fill = read_ahead->fill();
+    bool enough = read_ahead->atEnd();
+    if (!enough) {
+        if (_ffmpeg->byte_rate > 0) {
+            enough = (read_ahead->aheadBytes() * 1000 / _ffmpeg->byte_rate) >= READ_AHEAD_LOW_MS;
+        } else {
+            enough = (fill >= READ_AHEAD_LOW_FILL);
+        }
+    }
+
+    if (_ffmpeg->stalled && (enough || _play_state == Stopped)) {
+        _ffmpeg->stalled = false;
+        _ffmpeg->stalled_ms += _ffmpeg->stall_timer.elapsed();
+        _ffmpeg->holdClock(false);
+
+        // Presentation was scheduled against the held clock
+        signalImageAvailable();
+        signalPcmAvailable();
+    } else if (!_ffmpeg->stalled && _play_state == Playing && read_ahead->waiting() &&
+               _ffmpeg->image_queue.size() == 0 && _ffmpeg->audio_queue.size() == 0) {
+        _ffmpeg->stalled = true;
+        _ffmpeg->stalls += 1;
+        _ffmpeg->stall_timer.start();
+        _ffmpeg->holdClock(true);
+    }
+
+    if (_play_state == Stopped) {
+        if (_media_state == Buffering || _media_state == Buffered || _media_state == Stalled) {
+            setMediaState(Loaded);
+        }
+    } else if (_media_state != Invalid) {
+        setMediaState((_ffmpeg->stalled) ? Stalled : (enough) ? Buffered : Buffering);
+    }
+
+    if (fill != _buffer_status) {
+        _buffer_status = fill;
+        int i, N;
+        for(i = 0, N = bufferstatus_cbs.size(); i < N; i++) {
+            bufferstatus_cbs[i](fill);
+        }
+    }
+}
+
 void sdl_audio_callback(void *user_data, uint8_t *stream, int len)
 {
     lib_sdl->SDL_memset(stream, 0, len);
@@ -952,30 +2116,21 @@ void sdl_audio_callback(void *user_data, uint8_t *stream, int len)
     SdlBuf *buf = reinterpret_cast<SdlBuf *>(user_data);
 
     if (buf) {
-        buf->mutex.lock();
-
-        int vol_p = buf->volume_percent;
-        int mixlen = (len < buf->audiobuf.size()) ? len : buf->audiobuf.size();
+        int vol = buf->volume.loadRelaxed();
         SDL_AudioFormat fmt = buf->format;
 
-        // make vol act logarithmic
-        double pow2 = log2(SDL_MIX_MAXVOLUME);
-        double div = 100 / pow2;
-        double exp_vol = pow(2, vol_p / div);   // min = 1, max = 128
-        int v = static_cast<int>(round(exp_vol));
-        if (exp_vol < 1.01) { v = 0; }
-        int vol = (buf->muted) ? 0 : v;
-
-        QByteArray b(buf->audiobuf.left(mixlen));
-        buf->audiobuf = buf->audiobuf.mid(mixlen);
-
-        //int remain = buf->audiobuf.size();
-
-        buf->mutex.unlock();
+        // Mixed straight from the ring, which may wrap around
+        const char *p1, *p2;
+        int n1, n2;
+        int mixlen = buf->audiobuf.peek(len, p1, n1, p2, n2);
 
-        //LINE_DEBUG << vol << mixlen << b.size() << remain << len;
+        lib_sdl->SDL_MixAudioFormat(stream, reinterpret_cast<const uint8_t *>(p1), fmt, n1, vol);
+        if (n2 > 0) {
+            lib_sdl->SDL_MixAudioFormat(stream + n1, reinterpret_cast<const uint8_t *>(p2), fmt, n2, vol);
+        }
 
-        lib_sdl->SDL_MixAudioFormat(stream, reinterpret_cast<uint8_t *>(b.data()), fmt, mixlen, vol);
+        buf->audiobuf.consume(mixlen);
+        buf->callback_ms.storeRelease(monotonicMs());
     }
 }
 
@@ -984,9 +2139,15 @@ void FFmpegProvider::waitFor(FFmpegProvider::State s)
     AD(_decoder->waitForState(DecoderThread::toDecoderState(s)));
 }
 
+// cb is called when the media has been opened, with pos = -1 when it couldn't be
 void FFmpegProvider::prepare(qint64 seek, std::function<void (qint64, bool *)> cb)
 {
-    cb(seek, nullptr);
+    if (_ffmpeg->opener != nullptr) {
+        _prepare_pos = seek;
+        _prepare_cb = cb;
+    } else {
+        cb((_media_state == Invalid) ? -1 : seek, nullptr);
+    }
 }
 
 const FFmpegProvider::Info &FFmpegProvider::mediaInfo() const
@@ -994,6 +2155,179 @@ const FFmpegProvider::Info &FFmpegProvider::mediaInfo() const
     return _info;
 }
 
+// Files are always available as a whole
+int FFmpegProvider::bufferStatus() const
+{
+    if (_ffmpeg->read_ahead != nullptr) {
+        return _buffer_status;
+    }
+    return (_ffmpeg->pFormatCtx != nullptr) ? 100 : 0;
+}
+
+// The buffered bytes of a read ahead are mapped to time with the byte rate of the media
+QList<QPair<qint64, qint64>> FFmpegProvider::bufferedRanges() const
+{
+    QList<QPair<qint64, qint64>> ranges;
+
+    if (_ffmpeg->read_ahead != nullptr) {
+        ReadAheadAVIO::Range r = _ffmpeg->read_ahead->range();
+        qint64 byte_rate = _ffmpeg->byte_rate;
+        if (byte_rate > 0 && r.end > r.start) {
+            qint64 start_ms = qMin(r.start * 1000 / byte_rate, _info.duration);
+            qint64 end_ms = qMin(r.end * 1000 / byte_rate, _info.duration);
+            if (end_ms > start_ms) {
+                ranges.append(qMakePair(start_ms, end_ms));
+            }
+        }
+    } else if (_ffmpeg->pFormatCtx != nullptr && _info.duration > 0) {
+        ranges.append(qMakePair(static_cast<qint64>(0), _info.duration));
+    }
+
+    return ranges;
+}
+
+QVariantMap FFmpegProvider::statistics() const
+{
+    QVariantMap stats;
+    QVariantMap conversion;
+
+    _ffmpeg->stats_mutex.lock();
+    auto it = _ffmpeg->conversion_stats.constBegin();
+    while(it != _ffmpeg->conversion_stats.constEnd()) {
+        const ConversionStats &c = it.value();
+        qreal avg_ms = (c.frames > 0) ? (c.total_ns / 1000000.0) / c.frames : 0.0;
+        QVariantMap m;
+        m["frames"] = c.frames;
+        m["bands"] = c.bands;
+        m["avg_ms"] = avg_ms;
+        m["max_ms"] = c.max_ns / 1000000.0;
+        m["fps"] = (avg_ms > 0.0) ? 1000.0 / avg_ms : 0.0;
+        conversion[it.key()] = m;
+        ++it;
+    }
+    _ffmpeg->stats_mutex.unlock();
+
+    stats["conversion"] = conversion;
+
+    QVariantMap render;
+    _ffmpeg->stats_mutex.lock();
+    auto rit = _ffmpeg->render_stats.constBegin();
+    while(rit != _ffmpeg->render_stats.constEnd()) {
+        const RenderStats &r = rit.value();
+        QVariantMap m;
+        m["frames"] = r.frames;
+        m["avg_ms"] = (r.frames > 0) ? (r.total_ns / 1000000.0) / r.frames : 0.0;
+        m["max_ms"] = r.max_ns / 1000000.0;
+        m["avg_upload_ms"] = (r.frames > 0) ? (r.upload_ns / 1000000.0) / r.frames : 0.0;
+        render[rit.key()] = m;
+        ++rit;
+    }
+    _ffmpeg->stats_mutex.unlock();
+    stats["render"] = render;
+    stats["frame_pool"] = FramePool::instance()->statistics();
+    stats["zero_copy_frames"] = _ffmpeg->zero_copy_frames;
+
+    const VideoQueuePolicy &policy = videoQueuePolicy();
+    int frames = _ffmpeg->image_queue.size();
+    QVariantMap queue;
+    queue["frames"] = frames;
+    queue["bytes"] = _ffmpeg->image_bytes.loadRelaxed();
+    queue["duration_ms"] = frames * _ffmpeg->frame_duration_ms.loadRelaxed();
+    queue["target_ms"] = policy.target_ms;
+    queue["budget_bytes"] = policy.player_bytes;
+    queue["process_bytes"] = process_image_bytes.loadRelaxed();
+    queue["process_budget_bytes"] = policy.process_bytes;
+    stats["video_queue"] = queue;
+
+    QVariantMap drops;
+    drops["late_decoded"] = _ffmpeg->late_decoded.loadRelaxed();
+    drops["late_presented"] = _ffmpeg->late_presented.loadRelaxed();
+    drops["skip_level"] = _ffmpeg->skip_level.loadRelaxed();
+    drops["skip_escalations"] = _ffmpeg->skip_escalations.loadRelaxed();
+    stats["frame_drops"] = drops;
+
+    QVariantMap step;
+    step["steps"] = _ffmpeg->steps;
+    step["hits"] = _ffmpeg->step_hits;
+    step["misses"] = _ffmpeg->steps - _ffmpeg->step_hits;
+    step["history_frames"] = _ffmpeg->history.frames();
+    step["history_bytes"] = _ffmpeg->history.bytes();
+    qint64 refills = _ffmpeg->history.refills();
+    step["refills"] = refills;
+    step["refill_frames"] = _ffmpeg->history.refillFrames();
+    step["refill_avg_ms"] = (refills > 0) ? static_cast<qreal>(_ffmpeg->history.refillMs()) / refills : 0.0;
+    stats["frame_step"] = step;
+
+    QVariantMap seek;
+    seek["requests"] = _ffmpeg->seek_requests.loadRelaxed();
+    seek["coalesced"] = _ffmpeg->seek_coalesced.loadRelaxed();
+    seek["aborted_packets"] = _ffmpeg->seek_aborted.loadRelaxed();
+    seek["scrub_previews"] = _ffmpeg->scrub_previews.loadRelaxed();
+    _ffmpeg->stats_mutex.lock();
+    auto sit = _ffmpeg->seek_stats.constBegin();
+    while(sit != _ffmpeg->seek_stats.constEnd()) {
+        const SeekStats &st = sit.value();
+        QVariantMap m;
+        m["seeks"] = st.seeks;
+        m["avg_latency_ms"] = (st.seeks > 0) ? static_cast<qreal>(st.total_ms) / st.seeks : 0.0;
+        m["max_latency_ms"] = st.max_ms;
+        m["last_latency_ms"] = st.last_ms;
+        seek[sit.key()] = m;
+        ++sit;
+    }
+    _ffmpeg->stats_mutex.unlock();
+    stats["seek"] = seek;
+
+    const AudioClock &c = _ffmpeg->audio_clock;
+    QVariantMap clock;
+    clock["master"] = (_ffmpeg->audio_stream_index >= 0 && c.valid) ? "audio" : "system";
+    clock["device_latency_ms"] = c.latency_ms;
+    clock["device_period_ms"] = c.period_ms;
+    _ffmpeg->stats_mutex.lock();
+    clock["drift_ms"] = c.last_drift_ms;
+    clock["max_drift_ms"] = c.max_drift_ms;
+    clock["corrections"] = c.corrections;
+    clock["corrected_ms"] = c.corrected_ms;
+    _ffmpeg->stats_mutex.unlock();
+    stats["clock"] = clock;
+
+    if (_ffmpeg->audio_stream_index >= 0) {
+        const AudioOutFormat &out = _ffmpeg->audio_format;
+        QVariantMap audio;
+        audio["backend"] = (_ffmpeg->sdl) ? "sdl" : "qt";
+        audio["sample_rate"] = out.sample_rate;
+        audio["channels"] = out.channels;
+        audio["sample_format"] = QString::fromUtf8(av_get_sample_fmt_name(out.sample_fmt));
+        audio["source_sample_rate"] = _info.audio.sample_rate;
+        audio["source_channels"] = _info.audio.channels;
+        audio["resampling"] = !out.passthrough;
+        stats["audio"] = audio;
+    }
+
+    if (_ffmpeg->keyframe_index != nullptr) {
+        stats["keyframe_index"] = _ffmpeg->keyframe_index->statistics();
+    }
+
+    if (_ffmpeg->read_ahead != nullptr) {
+        QVariantMap read_ahead = _ffmpeg->read_ahead->statistics();
+        read_ahead["byte_rate"] = _ffmpeg->byte_rate;
+        read_ahead["fill"] = _buffer_status;
+        read_ahead["stalls"] = _ffmpeg->stalls;
+        read_ahead["stalled_ms"] = _ffmpeg->stalled_ms + ((_ffmpeg->stalled) ? _ffmpeg->stall_timer.elapsed() : 0);
+        stats["read_ahead"] = read_ahead;
+    }
+
+    QVariantMap startup;
+    startup["open_ms"] = _ffmpeg->open_ms;
+    startup["probe_ms"] = _ffmpeg->probe_ms;
+    startup["probe_cached"] = _ffmpeg->probe_cached;
+    startup["loaded_ms"] = _ffmpeg->loaded_ms;
+    startup["first_frame_ms"] = _ffmpeg->first_frame_ms;
+    stats["startup"] = startup;
+
+    return stats;
+}
+
 void FFmpegProvider::setVideoSurfaceSize(int w, int h)
 {
     _surface_size = QSize(w, h);
@@ -1007,55 +2341,155 @@ QSize FFmpegProvider::getVideoSurfaceSize() const
 QImage *FFmpegProvider::getImage(bool &gotIt)
 {
     if (_can_render) {
-        _ffmpeg->mutex.lock();
+        dropStaleImages();
 
-        if (_ffmpeg->image_queue.size() > 0) {
-            FFmpegImage &fimg = _ffmpeg->image_queue.first();
-            _ffmpeg->mutex.unlock();
-            gotIt = true;
-            return &fimg.image;
+        FFmpegImage *fimg = _ffmpeg->frontImage();
+        if (fimg != nullptr) {
+            if (_ffmpeg->convertImage(fimg, _surface_size)) {
+                gotIt = true;
+                return &fimg->image;
+            }
+            LINE_WARN << "Cannot convert image";
+            popImage();
         }
-
-        _ffmpeg->mutex.unlock();
     }
 
     gotIt = false;
     return nullptr;
 }
 
-void FFmpegProvider::popImage()
+static QVideoFrame::PixelFormat toQtPixelFormat(int format)
 {
-    _ffmpeg->mutex.lock();
-
-    if (_ffmpeg->image_queue.size() > 0) {
-        _ffmpeg->image_queue.dequeue();
+    switch(format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:   return QVideoFrame::Format_YUV420P;
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:   return QVideoFrame::Format_YUV422P;
+    case AV_PIX_FMT_NV12:       return QVideoFrame::Format_NV12;
+    case AV_PIX_FMT_NV21:       return QVideoFrame::Format_NV21;
+    case AV_PIX_FMT_YUYV422:    return QVideoFrame::Format_YUYV;
+    case AV_PIX_FMT_UYVY422:    return QVideoFrame::Format_UYVY;
+    case AV_PIX_FMT_GRAY8:      return QVideoFrame::Format_Y8;
+    default:                    return QVideoFrame::Format_Invalid;
     }
-
-    _ffmpeg->mutex.unlock();
 }
 
+static QVideoSurfaceFormat::YCbCrColorSpace toQtColorSpace(const AVFrame *frame)
+{
+    if (frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ422P) {
+        return QVideoSurfaceFormat::YCbCr_JPEG;
+    } else if (frame->colorspace == AVCOL_SPC_BT709) {
+        return QVideoSurfaceFormat::YCbCr_BT709;
+    } else {
+        return QVideoSurfaceFormat::YCbCr_BT601;
+    }
+}
+
+// When the surface supports the pixel format of the front frame, the frame is delivered as is.
+// Otherwise it is converted to RGB32. Call popImage() after presenting it.
+QVideoFrame FFmpegProvider::getVideoFrame(const QList<QVideoFrame::PixelFormat> &supported, QVideoSurfaceFormat &format, bool &gotIt)
+{
+    gotIt = false;
+
+    if (_can_render) {
+        dropStaleImages();
+
+        FFmpegImage *fimg = _ffmpeg->frontImage();
+        if (fimg != nullptr) {
+            AVFrame *frame = fimg->frame;
+            QVideoFrame::PixelFormat pf = toQtPixelFormat(frame->format);
+
+            if (pf != QVideoFrame::Format_Invalid && supported.contains(pf) && frame->linesize[0] > 0) {
+                AVFrame *ref = av_frame_clone(frame);
+                if (ref != nullptr) {
+                    QSize size(frame->width, frame->height);
+                    format = QVideoSurfaceFormat(size, pf);
+                    format.setYCbCrColorSpace(toQtColorSpace(frame));
+                    _ffmpeg->zero_copy_frames += 1;
+                    gotIt = true;
+                    return QVideoFrame(new AVFrameVideoBuffer(ref), size, pf);
+                }
+            }
+
+            if (_ffmpeg->convertImage(fimg, _surface_size)) {
+                format = QVideoSurfaceFormat(fimg->image.size(), QVideoFrame::Format_RGB32);
+                gotIt = true;
+                return QVideoFrame(fimg->image);
+            }
+
+            LINE_WARN << "Cannot convert image";
+            popImage();
+        }
+    }
+
+    return QVideoFrame();
+}
+
+void FFmpegProvider::popImage()
+{
+    if (_ffmpeg->step_image.frame != nullptr) {
+        _ffmpeg->shown_position_ms = _ffmpeg->step_image.position_in_ms;
+        av_frame_free(&_ffmpeg->step_image.frame);
+        _ffmpeg->step_image.image = QImage();
+        return;
+    }
+
+    FFmpegImage *img = _ffmpeg->image_queue.front();
+    if (img != nullptr) {
+        _ffmpeg->shown_position_ms = img->position_in_ms;
+        _ffmpeg->history.setPlayhead(img->position_in_ms);
+    }
+
+    _ffmpeg->popImage();
+    imagePopped();
+    signalImageAvailable();     // schedule the next image
+}
+
+
+void FFmpegProvider::recordRenderStats(const QString &path, qint64 total_ns, qint64 upload_ns)
+{
+    _ffmpeg->stats_mutex.lock();
+    RenderStats &r = _ffmpeg->render_stats[path];
+    r.frames += 1;
+    r.total_ns += total_ns;
+    r.max_ns = qMax(r.max_ns, total_ns);
+    r.upload_ns += upload_ns;
+    _ffmpeg->stats_mutex.unlock();
+}
 
 void FFmpegProvider::renderVideo(QPainter *p)
 {
     if (_can_render) {
-        _ffmpeg->mutex.lock();
+        QElapsedTimer timer;
+        timer.start();
+
+        dropStaleImages();
 
-        if (_ffmpeg->image_queue.size() > 0) {
-            FFmpegImage &fimg = _ffmpeg->image_queue.first();
+        FFmpegImage *fimg = _ffmpeg->frontImage();
 
-            QSize img_s(fimg.image.size());
-            QSize img_p_s(img_s.scaled(_surface_size, Qt::KeepAspectRatio));
+        if (fimg != nullptr) {
+            if (_ffmpeg->convertImage(fimg, _surface_size)) {
+                // Frames larger than the surface have been scaled down by the conversion already,
+                // they're painted 1:1.
+                QSize img_s(fimg->image.size());
+                QSize img_p_s(img_s);
+                if (img_s == QSize(fimg->frame->width, fimg->frame->height)) {
+                    img_p_s = img_s.scaled(_surface_size, Qt::KeepAspectRatio);
+                }
 
-            int top = (_surface_size.height() - img_p_s.height()) / 2;
-            int left = (_surface_size.width() - img_p_s.width()) / 2;
+                int top = (_surface_size.height() - img_p_s.height()) / 2;
+                int left = (_surface_size.width() - img_p_s.width()) / 2;
 
-            QRect img_r(QPoint(left, top), img_p_s);
-            p->drawImage(img_r, fimg.image, fimg.image.rect());
+                QRect img_r(QPoint(left, top), img_p_s);
+                p->drawImage(img_r, fimg->image, fimg->image.rect());
+            } else {
+                LINE_WARN << "Cannot convert image";
+            }
 
-            _ffmpeg->image_queue.dequeue();
-        }
+            popImage();
 
-        _ffmpeg->mutex.unlock();
+            recordRenderStats("painter", timer.nsecsElapsed(), 0);
+        }
     }
 }
 
@@ -1080,14 +2514,41 @@ void FFmpegProvider::threadError(Error e, const QString &msg, const char *func,
 
 void FFmpegProvider::stopThreads()
 {
+    if (_decoder != nullptr) {
+        active_providers.deref();
+    }
+    if (_ffmpeg->avio != nullptr) {
+        _ffmpeg->avio->abort();     // the demuxer may wait for data of a sequential device
+    }
+    if (_ffmpeg->read_ahead != nullptr) {
+        _ffmpeg->read_ahead->stop();    // or for data from the network
+    }
     AD(_decoder->endDecoder());
     AD(_decoder->wait());
     AD(delete _decoder);
     _decoder = nullptr;
+
+    if (_ffmpeg->gop_refill != nullptr) {
+        _ffmpeg->gop_refill->stop();
+        delete _ffmpeg->gop_refill;
+        _ffmpeg->gop_refill = nullptr;
+    }
+
+    if (_ffmpeg->keyframe_index != nullptr) {
+        _ffmpeg->keyframe_index->stop();
+        delete _ffmpeg->keyframe_index;
+        _ffmpeg->keyframe_index = nullptr;
+    }
+
+    _ffmpeg->history.setEnabled(false);
+    av_frame_free(&_ffmpeg->step_image.frame);
+    _ffmpeg->step_image.image = QImage();
+    _ffmpeg->step_resync = false;
 }
 
 void FFmpegProvider::startThreads()
 {
+    active_providers.ref();
     _decoder = new DecoderThread(this, _ffmpeg, &_ffmpeg->mutex);
     AD(_decoder->start());
 }
@@ -1113,9 +2574,14 @@ void FFmpegProvider::resetProvider()
     _info.video.codec = "none";
 
     // _ffmpeg stuff
+    _buffer_timer->stop();
+    _buffer_status = 0;
+
     _ffmpeg->mutex.lock();
 
     _ffmpeg->seek_frame = -1;
+    _ffmpeg->seek_pending.storeRelaxed(0);     // would end the reads of the next read ahead
+    _ffmpeg->clock_held = false;
 
     if (_ffmpeg->pAudioCtx != nullptr) {
         avcodec_free_context(&_ffmpeg->pAudioCtx);
@@ -1127,24 +2593,27 @@ void FFmpegProvider::resetProvider()
         avformat_close_input(&_ffmpeg->pFormatCtx);
         _ffmpeg->pFormatCtx = nullptr;
     }
-    if (_ffmpeg->pFrame != nullptr) {
-        av_free(_ffmpeg->pFrame);
-        _ffmpeg->pFrame = nullptr;
-    }
-    if (_ffmpeg->pFrameRGB != nullptr) {
-        av_free(_ffmpeg->pFrameRGB);
-        _ffmpeg->pFrameRGB = nullptr;
+    if (_ffmpeg->avio != nullptr) {     // not closed by avformat_close_input()
+        delete _ffmpeg->avio;
+        _ffmpeg->avio = nullptr;
     }
-    if (_ffmpeg->buffer != nullptr) {
-        av_free(_ffmpeg->buffer);
-        _ffmpeg->buffer = nullptr;
+    if (_ffmpeg->read_ahead != nullptr) {
+        delete _ffmpeg->read_ahead;
+        _ffmpeg->read_ahead = nullptr;
     }
+    _ffmpeg->byte_rate = 0;
+    _ffmpeg->stalled = false;
     _ffmpeg->pVideoCodec = nullptr;
     _ffmpeg->pAudioCodec = nullptr;
+    _ffmpeg->audio_stream_index = -1;     // none till the next media has been opened
+    _ffmpeg->video_stream_index = -1;
 
-    _ffmpeg->position_in_ms = 0;
-    _ffmpeg->image_queue.clear();
+    _ffmpeg->shown_position_ms = 0;
+    _ffmpeg->audio_packets.flush();
+    _ffmpeg->video_packets.flush();
+    _ffmpeg->clearImages();
     _ffmpeg->audio_queue.clear();
+    _ffmpeg->audio_serial = -1;
     _ffmpeg->pos_offset_in_ms = 0;
     _ffmpeg->elapsed.invalidate();
 
@@ -1172,31 +2641,426 @@ void FFmpegProvider::resetProvider()
  *******************************************************************************/
 
 FFmpeg::FFmpeg()
+    : image_queue(IMAGE_RING_SIZE), audio_queue(AUDIO_RING_SIZE)
 {
     pFormatCtx = nullptr;
     pVideoCodec = nullptr;
     pAudioCodec = nullptr;
     pVideoCtx = nullptr;
     pAudioCtx = nullptr;
-    pFrame = nullptr;
-    pFrameRGB = nullptr;
     audio_stream_index = -1;
     video_stream_index = -1;
-    buffer = nullptr;
-    position_in_ms = 0;
     pos_offset_in_ms = 0;
+    pause_offset_ms = -1;
+    playback_rate = 1.0;
     seek_frame = -1;
+    seek_precise = true;
+    seek_scrub = false;
+    seek_request_ms = 0;
+    seek_pending.storeRelaxed(0);
+    shown_serial = -1;
+    shown_request_ms = 0;
+    shown_mode = "precise";
+    pushed_serial.storeRelaxed(-1);
+    keyframe_index = nullptr;
+    avio = nullptr;
+    read_ahead = nullptr;
+    opener = nullptr;
+    open_serial = 0;
+    open_cancelled = false;
+    open_start_ms = 0;
+    play_request_ms = -1;
+    open_ms = -1;
+    probe_ms = -1;
+    probe_cached = false;
+    loaded_ms = -1;
+    first_frame_ms = -1;
+    byte_rate = 0;
+    clock_held = false;
+    stalled = false;
+    stalls = 0;
+    stalled_ms = 0;
+    gop_refill = nullptr;
+    step_image.frame = nullptr;
+    shown_position_ms = 0;
+    step_resync = false;
+    steps = 0;
+    step_hits = 0;
+    serial.storeRelaxed(0);
+    audio_serial = -1;
+    image_serial = -1;
+    image_signal_pending.storeRelaxed(0);
+    pcm_signal_pending.storeRelaxed(0);
+    image_bytes.storeRelaxed(0);
+    zero_copy_frames = 0;
+    clock_running.storeRelaxed(0);
+    late_decoded.storeRelaxed(0);
+    late_presented.storeRelaxed(0);
+    skip_level.storeRelaxed(0);
+    skip_escalations.storeRelaxed(0);
+    seek_requests.storeRelaxed(0);
+    seek_coalesced.storeRelaxed(0);
+    seek_aborted.storeRelaxed(0);
+    scrub_previews.storeRelaxed(0);
+    frame_duration_ms.storeRelaxed(40);
     sdl = (lib_sdl != nullptr);
     sdl_id = 0;
     sdl_buf = nullptr;
     audio_out = nullptr;
     audio_io = nullptr;
-    volume_percent = 100;
-    muted = false;
+    volume_percent.storeRelaxed(100);
+    muted.storeRelaxed(false);
+    audio_packets.setSpaceEvent(&demux_wake);
+    video_packets.setSpaceEvent(&demux_wake);
+}
+
+int FFmpeg::currentTimeMs()
+{
+    mutex.lock();
+    int current_time_ms = currentTimeMsLocked();
+    mutex.unlock();
+    return current_time_ms;
+}
+
+// The playback clock runs at playback_rate times the system clock
+int FFmpeg::currentTimeMsLocked() const
+{
+    if (clock_held) {
+        return pos_offset_in_ms;
+    }
+    return pos_offset_in_ms + static_cast<int>(elapsed.elapsed() * playback_rate);
+}
+
+void FFmpeg::adjustClock(int delta_ms)
+{
+    mutex.lock();
+    pos_offset_in_ms += delta_ms;
+    mutex.unlock();
+}
+
+// A keyframe seek lands before or after the target, the clock starts at the frame shown
+void FFmpeg::snapClock(int position_in_ms)
+{
+    mutex.lock();
+    if (pause_offset_ms >= 0) {
+        pause_offset_ms = position_in_ms;
+    } else {
+        pos_offset_in_ms = position_in_ms;
+        elapsed.start();
+    }
+    mutex.unlock();
+}
+
+// While the network stalls, the clock stays at the last presented position
+void FFmpeg::holdClock(bool yes)
+{
+    mutex.lock();
+    if (clock_held != yes) {
+        pos_offset_in_ms = currentTimeMsLocked();
+        clock_held = yes;
+        elapsed.start();
+    }
+    mutex.unlock();
+}
+
+// GUI thread, the first image after a flush is shown. Records the latency of the seek that caused it.
+void FFmpeg::seekShown(int serial)
+{
+    mutex.lock();
+    bool measured = (serial == shown_serial);
+    qint64 latency_ms = monotonicMs() - shown_request_ms;
+    const char *mode = shown_mode;
+    if (measured) {
+        shown_serial = -1;
+    }
+    mutex.unlock();
+
+    if (measured) {
+        stats_mutex.lock();
+        SeekStats &st = seek_stats[mode];
+        st.seeks += 1;
+        st.total_ms += latency_ms;
+        st.max_ms = qMax(st.max_ms, latency_ms);
+        st.last_ms = latency_ms;
+        stats_mutex.unlock();
+    }
+}
+
+// A frame after setMedia() was shown or its audio was played, counted once it was requested
+void FFmpeg::startupShown()
+{
+    if (first_frame_ms < 0 && play_request_ms >= 0) {
+        first_frame_ms = monotonicMs() - qMax(open_start_ms, play_request_ms);
+    }
+}
+
+qreal FFmpeg::playbackRate()
+{
+    mutex.lock();
+    qreal rate = playback_rate;
+    mutex.unlock();
+    return rate;
+}
+
+void FFmpeg::setPlaybackRate(qreal rate)
+{
+    mutex.lock();
+    if (elapsed.isValid()) {    // rebase, the time played so far counts at the old rate
+        pos_offset_in_ms = currentTimeMsLocked();
+        elapsed.start();
+    }
+    playback_rate = rate;
+    mutex.unlock();
+}
+
+// Producer side, the queue takes ownership of img.frame
+bool FFmpeg::pushImage(const FFmpegImage &img)
+{
+    qint64 bytes = img.bytes;
+    image_bytes.fetchAndAddOrdered(bytes);
+    process_image_bytes.fetchAndAddOrdered(bytes);
+    if (!image_queue.push(img)) {
+        image_bytes.fetchAndAddOrdered(-bytes);
+        process_image_bytes.fetchAndAddOrdered(-bytes);
+        AVFrame *frame = img.frame;
+        av_frame_free(&frame);
+        return false;
+    }
+    return true;
+}
+
+// Consumer side, converts the frame of a queued image when it's presented for the first time,
+// so frames that are dropped or flushed are never converted. When the surface is smaller than
+// the frame, the frame is scaled down to the size it's painted at (see renderVideo).
+bool FFmpeg::convertImage(FFmpegImage *img, const QSize &surface_size)
+{
+    if (!img->image.isNull()) {
+        return true;
+    }
+
+    AVFrame *frame = img->frame;
+    QSize size(frame->width, frame->height);
+    if (surface_size.isValid() && (surface_size.width() < size.width() || surface_size.height() < size.height())) {
+        size = size.scaled(surface_size, Qt::KeepAspectRatio);
+        size = size.expandedTo(QSize(1, 1));
+    }
+
+    QImage image = FramePool::instance()->acquire(size.width(), size.height(), QImage::Format_RGB32);
+    if (image.isNull()) {
+        return false;
+    }
+
+    QElapsedTimer conversion_timer;
+    conversion_timer.start();
+    if (!converter.convert(frame, image)) {
+        return false;
+    }
+    qint64 ns = conversion_timer.nsecsElapsed();
+
+    stats_mutex.lock();
+    QString key = QString("%1x%2").arg(frame->width).arg(frame->height);
+    if (size != QSize(frame->width, frame->height)) {
+        key += QString("->%1x%2").arg(size.width()).arg(size.height());
+    }
+    ConversionStats &c = conversion_stats[key];
+    c.frames += 1;
+    c.total_ns += ns;
+    c.max_ns = qMax(c.max_ns, ns);
+    c.bands = converter.bands();
+    stats_mutex.unlock();
+
+    img->image = image;
+    return true;
+}
+
+// Consumer side
+// The image to present: a stepped frame, otherwise the front of the image_queue
+FFmpegImage *FFmpeg::frontImage()
+{
+    if (step_image.frame != nullptr) {
+        return &step_image;
+    }
+    return image_queue.front();
+}
+
+void FFmpeg::popImage()
+{
+    FFmpegImage *img = image_queue.front();
+    if (img != nullptr) {
+        qint64 bytes = img->bytes;
+        history.add(img->position_in_ms, img->frame);
+        av_frame_free(&img->frame);
+        image_queue.pop();
+        image_bytes.fetchAndAddOrdered(-bytes);
+        process_image_bytes.fetchAndAddOrdered(-bytes);
+    }
+}
+
+// Only when the video stage is not running
+void FFmpeg::clearImages()
+{
+    while(image_queue.front() != nullptr) { popImage(); }
 }
 
 /*******************************************************************************
- * Our internal DecoderThread to use ffmpeg to decode our input stream
+ * WakeEvent, lets our threads sleep until there's something to do
+ *******************************************************************************/
+
+WakeEvent::WakeEvent()
+{
+    _signalled = false;
+}
+
+void WakeEvent::wake()
+{
+    _mutex.lock();
+    _signalled = true;
+    _cond.wakeAll();
+    _mutex.unlock();
+}
+
+void WakeEvent::wait(int timeout_ms)
+{
+    _mutex.lock();
+    if (!_signalled) {
+        if (timeout_ms < 0) {
+            _cond.wait(&_mutex);
+        } else {
+            _cond.wait(&_mutex, static_cast<unsigned long>(timeout_ms));
+        }
+    }
+    _signalled = false;
+    _mutex.unlock();
+}
+
+/*******************************************************************************
+ * PacketQueue, bounded queue between the demuxer and a decoder stage
+ *******************************************************************************/
+
+PacketQueue::PacketQueue()
+{
+    _bytes = 0;
+    _aborted = false;
+    _space = nullptr;
+}
+
+void PacketQueue::setSpaceEvent(WakeEvent *e)
+{
+    _space = e;
+}
+
+PacketQueue::~PacketQueue()
+{
+    flush();
+}
+
+void PacketQueue::put(AVPacket *pkt, int serial)
+{
+    AVPacket *p = av_packet_alloc();
+    av_packet_move_ref(p, pkt);
+
+    FFmpegPacket fp;
+    fp.pkt = p;
+    fp.serial = serial;
+    fp.seek_target_ms = -1;
+    fp.snap_clock = false;
+    fp.scrub = false;
+
+    _mutex.lock();
+    _queue.enqueue(fp);
+    _bytes += p->size;
+    _cond.wakeOne();
+    _mutex.unlock();
+}
+
+void PacketQueue::putFlush(int serial, int seek_target_ms, bool snap_clock, bool scrub)
+{
+    FFmpegPacket fp;
+    fp.pkt = nullptr;
+    fp.serial = serial;
+    fp.seek_target_ms = seek_target_ms;
+    fp.snap_clock = snap_clock;
+    fp.scrub = scrub;
+
+    _mutex.lock();
+    _queue.enqueue(fp);
+    _cond.wakeOne();
+    _mutex.unlock();
+}
+
+bool PacketQueue::get(FFmpegPacket &p)
+{
+    _mutex.lock();
+    while(_queue.isEmpty() && !_aborted) {
+        _cond.wait(&_mutex);
+    }
+
+    bool ok = !_aborted;
+    if (ok) {
+        p = _queue.dequeue();
+        if (p.pkt != nullptr) { _bytes -= p.pkt->size; }
+    }
+    _mutex.unlock();
+
+    if (ok && _space != nullptr) {
+        _space->wake();
+    }
+
+    return ok;
+}
+
+void PacketQueue::flush()
+{
+    _mutex.lock();
+    while(!_queue.isEmpty()) {
+        FFmpegPacket fp = _queue.dequeue();
+        if (fp.pkt != nullptr) { av_packet_free(&fp.pkt); }
+    }
+    _bytes = 0;
+    _mutex.unlock();
+}
+
+void PacketQueue::abort()
+{
+    _mutex.lock();
+    _aborted = true;
+    _cond.wakeAll();
+    _mutex.unlock();
+}
+
+void PacketQueue::start()
+{
+    _mutex.lock();
+    _aborted = false;
+    _mutex.unlock();
+}
+
+bool PacketQueue::isAborted()
+{
+    _mutex.lock();
+    bool a = _aborted;
+    _mutex.unlock();
+    return a;
+}
+
+int PacketQueue::size()
+{
+    _mutex.lock();
+    int n = _queue.size();
+    _mutex.unlock();
+    return n;
+}
+
+int PacketQueue::bytes()
+{
+    _mutex.lock();
+    int b = _bytes;
+    _mutex.unlock();
+    return b;
+}
+
+/*******************************************************************************
+ * Our internal DecoderThread to use ffmpeg to demux our input stream
  *******************************************************************************/
 
 DecoderThread::DecoderThread(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex)
@@ -1207,6 +3071,8 @@ DecoderThread::DecoderThread(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex)
     _run = true;
     _request = Stopped;
     _current = Stopped;
+    _audio = nullptr;
+    _video = nullptr;
 }
 
 DecoderThread::PlayState DecoderThread::toDecoderState(FFmpegProvider::State s)
@@ -1234,81 +3100,117 @@ FFmpegProvider::State DecoderThread::toFFmpegState(PlayState s)
     }
 }
 
-static void setup_array(uint8_t* out[], AVFrame* in_frame, enum AVSampleFormat format, int /*samples*/)
+#define ERR(a, b) _provider->threadError(a, b, __FUNCTION__, __LINE__)
+
+bool DecoderThread::packetQueuesFull()
 {
-    if (av_sample_fmt_is_planar(format)) {
-        int i;
-        for (i = 0; i < in_frame->channels; i++) {
-            out[i] = in_frame->data[i];
-        }
-    } else {
-        out[0] = in_frame->data[0];
+    // Like ffplay: stop reading when we've got a lot of bytes queued, or
+    // when every stream has enough packets to continue decoding.
+    int audio_size = _ffmpeg->audio_packets.size();
+    int video_size = _ffmpeg->video_packets.size();
+    int bytes = _ffmpeg->audio_packets.bytes() + _ffmpeg->video_packets.bytes();
+
+    if (bytes > PACKET_QUEUE_MAX_BYTES) {
+        return true;
     }
-}
 
-#define CH_MAX 128
+    bool audio_enough = (_ffmpeg->audio_stream_index < 0 || audio_size > PACKET_QUEUE_MIN_PACKETS);
+    bool video_enough = (_ffmpeg->video_stream_index < 0 || video_size > PACKET_QUEUE_MIN_PACKETS);
 
-#define ERR(a, b) _provider->threadError(a, b, __FUNCTION__, __LINE__)
+    return audio_enough && video_enough;
+}
 
-void DecoderThread::run()
+void DecoderThread::startStages()
 {
-    AVPacket *pkt = av_packet_alloc();
+    _ffmpeg->audio_packets.start();
+    _ffmpeg->video_packets.start();
 
-    SwsContext *sws = nullptr;
-    SwrContext *swr_ctx = nullptr;
-    uint8_t **dst_data = nullptr;
+    if (_ffmpeg->pAudioCtx != nullptr) {
+        _audio = new AudioDecoderThread(_provider, _ffmpeg, _mutex);
+        _audio->start();
+    }
 
-    int max_queue_depth = 20;  // memory usage!
-    int min_queue_depth = 10;
+    if (_ffmpeg->pVideoCtx != nullptr) {
+        _video = new VideoDecoderThread(_provider, _ffmpeg, _mutex);
+        _video->start();
+    }
+}
 
-    int max_n_samples = -1;
-    int dst_linesize;
-    QElapsedTimer el;
-    int ms_count;
+void DecoderThread::stopStages()
+{
+    _ffmpeg->audio_packets.abort();
+    _ffmpeg->video_packets.abort();
+    _ffmpeg->audio_wake.wake();
+    _ffmpeg->video_wake.wake();
 
-    auto audio_ctx = _ffmpeg->pAudioCtx;
-    auto video_ctx = _ffmpeg->pVideoCtx;
-    auto format_ctx = _ffmpeg->pFormatCtx;
+    if (_audio != nullptr) {
+        _audio->wait();
+        delete _audio;
+        _audio = nullptr;
+    }
 
-    if (audio_ctx != nullptr) { // only when there is audio
-        swr_ctx = swr_alloc();
+    if (_video != nullptr) {
+        _video->wait();
+        delete _video;
+        _video = nullptr;
+    }
 
-        av_opt_set_int(swr_ctx, "in_channel_layout", audio_ctx->channel_layout, 0);
-        av_opt_set_int(swr_ctx, "in_sample_rate", audio_ctx->sample_rate, 0);
-        av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt", audio_ctx->sample_fmt, 0);
+    _ffmpeg->audio_packets.flush();
+    _ffmpeg->video_packets.flush();
+}
 
-        av_opt_set_int(swr_ctx, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-        av_opt_set_int(swr_ctx, "out_sample_rate", 44100, 0);
-        av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+void DecoderThread::run()
+{
+    AVPacket *pkt = av_packet_alloc();
 
-        swr_init(swr_ctx);
-    }
+    QElapsedTimer el;
+    int ms_count;
+
+    auto format_ctx = _ffmpeg->pFormatCtx;
 
     auto at_end = [this](int ms) {
         return ms > (_ffmpeg->duration_in_ms - 200);    // Don't finalize till the end, keep 0,2s of lag
     };
 
-    QByteArray tmp_audio_buf;
+    // After a scrub seek or a seek while paused, only what's needed to show a frame is read
+    enum { Streaming, ScrubKeyframe, ScrubHold, PausedFrame } phase = Streaming;
+    int phase_serial = 0;
 
-    int pause_offset_ms = -1;
-    bool dont_decode = false;
+    startStages();
 
     while(_run) {
 
+        bool do_seek = false;
+        bool flush = false;
+        bool changed = false;
+        bool state_changed = false;
+        bool precise = true;
+        bool scrub = false;
+        qint64 seek_ts = -1;
+        qint64 request_ms = 0;
+
         _mutex->lock();
 
         if (_request != _current) {
             if (_current == Paused) {
-                _ffmpeg->seek_frame = SEEK_CONTINUE;
+                if (_ffmpeg->seek_frame >= 0) {
+                    _ffmpeg->pause_offset_ms = -1;      // the clock continues from the pending seek
+                } else {
+                    _ffmpeg->seek_frame = SEEK_CONTINUE;
+                }
             }
 
             if (_request == Paused) {
-                if (pause_offset_ms < 0) {
-                    pause_offset_ms = _ffmpeg->elapsed.elapsed() + _ffmpeg->pos_offset_in_ms;
+                if (_ffmpeg->pause_offset_ms < 0) {
+                    _ffmpeg->pause_offset_ms = _ffmpeg->currentTimeMsLocked();
                 }
             }
 
             _current = _request;
+            _ffmpeg->clock_running.storeRelaxed(_current == Playing || _current == Ended);
+            _state_cond.wakeAll();
+            changed = true;
+            state_changed = true;
         }
 
         if (_ffmpeg->seek_frame >= 0 || _ffmpeg->seek_frame == SEEK_BEGIN || _ffmpeg->seek_frame == SEEK_CONTINUE) {
@@ -1317,266 +3219,768 @@ void DecoderThread::run()
 
             if (!s_begin && !s_continue) {
                 if (_current == Paused) {
-                    pause_offset_ms = MS(_ffmpeg->seek_frame);
+                    _ffmpeg->pause_offset_ms = MS(_ffmpeg->seek_frame);
                 } else {
                     _ffmpeg->pos_offset_in_ms = MS(_ffmpeg->seek_frame);
                 }
-                av_seek_frame(format_ctx, -1, _ffmpeg->seek_frame, AVSEEK_FLAG_FRAME);
+                do_seek = true;
+                seek_ts = _ffmpeg->seek_frame;
+                precise = _ffmpeg->seek_precise;
+                scrub = _ffmpeg->seek_scrub;
+                request_ms = _ffmpeg->seek_request_ms;
             } else if (s_begin) {
                 _ffmpeg->pos_offset_in_ms = MS(0);
             } else if (s_continue) {
-                _ffmpeg->pos_offset_in_ms = pause_offset_ms;
-                pause_offset_ms = -1;
+                _ffmpeg->pos_offset_in_ms = _ffmpeg->pause_offset_ms;
+                _ffmpeg->pause_offset_ms = -1;
             }
 
             _ffmpeg->elapsed.start();
             _ffmpeg->seek_frame = -1;
+            _ffmpeg->seek_pending.storeRelease(0);
 
-            if (!s_continue) {
-                if (video_ctx != nullptr) avcodec_flush_buffers(video_ctx);
-                if (audio_ctx != nullptr) avcodec_flush_buffers(audio_ctx);
-                _provider->signalClearAudioBuffer();
-                _provider->signalClearVideoBuffer();
-            }
+            flush = !s_continue;
+            changed = true;
         }
 
+        PlayState current = _current;
+
         _mutex->unlock();
 
-        if (_current == Ended) {
-            if (_ffmpeg->image_queue.size() > 0) {
+        // The format context is only used by this thread, so no lock is needed.
+        // A precise seek goes to the keyframe at or before the target and decodes from there,
+        // a keyframe seek takes the keyframe nearest to it. When the keyframe index is ready,
+        // the seek goes straight to the byte position of that keyframe.
+        int seek_target_ms = -1;
+        if (do_seek) {
+            KeyframeIndex::Entry kf;
+            KeyframeIndex *index = _ffmpeg->keyframe_index;
+            bool indexed = (index != nullptr && index->lookup(MS(seek_ts), precise, kf) &&
+                            av_seek_frame(format_ctx, -1, kf.pos, AVSEEK_FLAG_BYTE) >= 0);
+            if (!indexed) {
+                int64_t max_ts = (precise) ? seek_ts : INT64_MAX;
+                if (avformat_seek_file(format_ctx, -1, INT64_MIN, seek_ts, max_ts, 0) < 0) {
+                    av_seek_frame(format_ctx, -1, seek_ts, AVSEEK_FLAG_BACKWARD);
+                }
+            }
+            seek_target_ms = (precise) ? MS(seek_ts) : -1;
+
+            // A read of the read ahead that the seek ended left its error on the context
+            if (_ffmpeg->read_ahead != nullptr) {
+                format_ctx->pb->error = 0;
+            }
+        }
+
+        if (flush) {
+            // Everything queued or being decoded before this point is stale.
+            // The decoder stages flush their codecs when they get the marker.
+            int serial = _ffmpeg->serial.fetchAndAddOrdered(1) + 1;
+            _ffmpeg->audio_packets.flush();
+            _ffmpeg->video_packets.flush();
+            _ffmpeg->audio_packets.putFlush(serial, seek_target_ms, do_seek && !precise);
+            _ffmpeg->video_packets.putFlush(serial, seek_target_ms, do_seek && !precise, scrub);
+            _ffmpeg->audio_wake.wake();
+            _ffmpeg->video_wake.wake();
+            _provider->signalClearAudioBuffer();
+            _provider->signalClearVideoBuffer();
+
+            if (do_seek) {
                 _mutex->lock();
-                _provider->signalImageAvailable();  // make sure we're trying to handle our video images
-                _provider->signalPcmAvailable();
+                _ffmpeg->shown_serial = serial;
+                _ffmpeg->shown_request_ms = request_ms;
+                _ffmpeg->shown_mode = (scrub) ? "scrub" : (precise) ? "precise" : "keyframe";
                 _mutex->unlock();
-                msleep(1);
+            }
+
+            // A scrub seek only reads the keyframe it landed on. A seek while paused reads
+            // till the frame at the target has been decoded, so it can be shown.
+            if (scrub) {
+                phase = (_ffmpeg->video_stream_index >= 0) ? ScrubKeyframe : ScrubHold;
+            } else if (do_seek && current == Paused && _ffmpeg->video_stream_index >= 0) {
+                phase = PausedFrame;
+            } else {
+                phase = Streaming;
+            }
+            phase_serial = serial;
+        } else if (changed) {
+            // The clock may have changed, let the GUI thread reschedule presentation
+            _provider->signalImageAvailable();
+            _provider->signalPcmAvailable();
+        }
+
+        if (state_changed && phase != Streaming && !flush) {
+            phase = Streaming;
+        }
+
+        if (phase == ScrubKeyframe) {
+            // Audio and other packets up to the keyframe aren't needed for the preview
+            int ret = av_read_frame(format_ctx, pkt);
+            if (ret == 0 && pkt->stream_index == _ffmpeg->video_stream_index && (pkt->flags & AV_PKT_FLAG_KEY)) {
+                _ffmpeg->video_packets.put(pkt, phase_serial);
+                phase = ScrubHold;
+            } else if (ret == 0) {
+                av_packet_unref(pkt);
+            } else {
+                phase = ScrubHold;
+            }
+        } else if (phase == ScrubHold) {
+            // Woken by the next seek, which ends the scrub when it isn't a scrub seek itself
+            _ffmpeg->demux_wake.wait();
+        } else if (phase == PausedFrame) {
+            if (_ffmpeg->pushed_serial.loadAcquire() == phase_serial) {
+                phase = Streaming;
+            } else if (packetQueuesFull()) {
+                // Woken when a decoder stage takes a packet or the video stage queues the frame
+                _ffmpeg->demux_wake.wait();
+            } else {
+                // The packets are kept, playback continues with them
+                int ret = av_read_frame(format_ctx, pkt);
+                if (ret == 0) {
+                    putPacket(pkt, phase_serial);
+                } else {
+                    phase = Streaming;
+                }
+            }
+        } else if (current == Ended) {
+            int queued = _ffmpeg->image_queue.size() + _ffmpeg->audio_queue.size();
+            queued += _ffmpeg->video_packets.size() + _ffmpeg->audio_packets.size();
+
+            if (queued > 0) {
+                // Woken when the packet queues or the rings have been drained
+                _ffmpeg->demux_wake.wait();
             } else {
-                msleep(10);
                 _mutex->lock();
                 _ffmpeg->seek_frame = 0;
                 _mutex->unlock();
-                _request = Playing;
+                setRequest(Playing);
                 el.start();
                 ms_count = 200;     // Play for ms_count ms
             }
-        } else if (_current == Paused) {
-            msleep(100);
-        } else if (_current == Stopped) {
-            msleep(100);
+        } else if (current == Paused || current == Stopped) {
+            _ffmpeg->demux_wake.wait();
         } else { // Playing
+            int timeout_ms = -1;
             if (el.isValid()) {
                 if (el.elapsed() >= ms_count) {
-                    _request = Stopped;
+                    setRequest(Stopped);
                     el.invalidate();
                     ms_count = -1;
                     _provider->signalSetState(toFFmpegState(Stopped));
+                    continue;
                 }
+                timeout_ms = ms_count - static_cast<int>(el.elapsed());
             }
 
-            // Check if the queue > max_queue_depth
-            _mutex->lock();
-            int queue_depth = _ffmpeg->image_queue.size();
-            _mutex->unlock();
-
-            if (dont_decode) {
-                if (queue_depth <= min_queue_depth) {
-                    dont_decode = false;
-                }
+            if (packetQueuesFull()) {
+                // Woken when a decoder stage takes a packet
+                _ffmpeg->demux_wake.wait(timeout_ms);
             } else {
-                if (queue_depth >= max_queue_depth) {
-                    dont_decode = true;
+                // Read from ffmpeg
+                int ret = av_read_frame(format_ctx, pkt);
+                int serial = _ffmpeg->serial.loadAcquire();
+
+                if (ret == 0) {
+                    AVRational millisecondbase = { 1, 1000 };
+                    int stream_index = pkt->stream_index;
+
+                    if (stream_index == _ffmpeg->audio_stream_index || stream_index == _ffmpeg->video_stream_index) {
+                        int pkt_position_in_ms = av_rescale_q(pkt->dts, format_ctx->streams[stream_index]->time_base, millisecondbase);
+                        if (at_end(pkt_position_in_ms)) {
+                            setRequest(Ended);
+                        }
+                    }
+
+                    putPacket(pkt, serial);
+                } else {
+                    if (ret == AVERROR_EXIT) {
+                        // A seek ended a read that waited for the network, it's taken next
+                    } else if (ret == AVERROR_EOF) {
+                        ERR(FFmpegProvider::Internal, tr("End of stream."));
+                        setRequest(Ended);
+                    } else {
+                        ERR(FFmpegProvider::Internal, tr("Unclear %1").arg(ret));
+                        setRequest(Ended);
+                    }
                 }
             }
+        }
+    }
 
-            if (dont_decode) {
-                _mutex->lock();
-                _provider->signalImageAvailable();  // make sure we're trying to handle our video images
-                _provider->signalPcmAvailable();
-                _mutex->unlock();
-                msleep(3);  // frequency = 333Hz max
-            } else {
-                _mutex->lock();
+    stopStages();
 
-                // Read from ffmpeg
-                int ret = av_read_frame(format_ctx, pkt);
+    av_packet_free(&pkt);
+}
+
+void DecoderThread::putPacket(AVPacket *pkt, int serial)
+{
+    if (pkt->stream_index == _ffmpeg->audio_stream_index) {
+        _ffmpeg->audio_packets.put(pkt, serial);
+    } else if (pkt->stream_index == _ffmpeg->video_stream_index) {
+        _ffmpeg->video_packets.put(pkt, serial);
+    } else {
+        av_packet_unref(pkt);
+    }
+}
 
+void DecoderThread::setRequest(PlayState s)
+{
+    _mutex->lock();
+    _request = s;
+    _mutex->unlock();
+}
 
-                if (ret == 0) {
-                    if (pkt->stream_index == _ffmpeg->audio_stream_index) {
+void DecoderThread::wake()
+{
+    _ffmpeg->demux_wake.wake();
+}
 
-                        auto frame = _ffmpeg->pFrame;
+void DecoderThread::endDecoder()
+{
+    _mutex->lock();
+    _run = false;
+    _state_cond.wakeAll();
+    _mutex->unlock();
+    wake();
+}
 
-                        int res = avcodec_send_packet(audio_ctx, pkt);
-                        if (res < 0) {
-                            ERR(FFmpegProvider::Internal, tr("Cannot send packet to audio controller"));
-                            _request = Ended;
-                        } else {
-                            AVRational millisecondbase = { 1, 1000 };
-                            int audio_position_in_ms = av_rescale_q(pkt->dts, format_ctx->streams[_ffmpeg->audio_stream_index]->time_base, millisecondbase);
-
-                            if (at_end(audio_position_in_ms)) {
-                                _request = Ended;
-                            }
-
-                            while(res >= 0) {
-                                res = avcodec_receive_frame(audio_ctx, frame); // decodes to RAW PCM?
-
-                                if (res >= 0) {
-                                    int n_channels = av_get_channel_layout_nb_channels(AV_CH_LAYOUT_STEREO);
-
-                                    int n_samples;
-                                    if (max_n_samples == -1) {
-                                        n_samples = av_rescale_rnd(frame->nb_samples, 44100, audio_ctx->sample_rate, AV_ROUND_UP);
-                                        max_n_samples = n_samples;
-                                        res = av_samples_alloc_array_and_samples(&dst_data, &dst_linesize, n_channels, n_samples, AV_SAMPLE_FMT_S16, 0);
-                                        if (res < 0) {
-                                            ERR(FFmpegProvider::Internal, tr("Cannot allocate dst_data"));
-                                        }
-                                    } else {
-                                        n_samples = av_rescale_rnd(swr_get_delay(swr_ctx, audio_ctx->sample_rate) + frame->nb_samples,
-                                                                   44100, audio_ctx->sample_rate, AV_ROUND_UP
-                                                                   );
-                                        if (n_samples > max_n_samples) {
-                                            av_freep(&dst_data[0]);
-                                            res = av_samples_alloc(dst_data, &dst_linesize, n_channels, n_samples, AV_SAMPLE_FMT_S16, 1);
-                                            if (res < 0) {
-                                                ERR(FFmpegProvider::Internal, tr("Cannot allocate dst_data again"));
-                                            }
-                                            max_n_samples = n_samples;
-                                        }
-                                    }
-
-                                    uint8_t *tmp_in[CH_MAX];
-                                    setup_array(reinterpret_cast<uint8_t **>(tmp_in), frame, audio_ctx->sample_fmt, frame->nb_samples);
-                                    int r = swr_convert(swr_ctx, dst_data, n_samples, const_cast<const uint8_t **>(reinterpret_cast<uint8_t **>(tmp_in)), frame->nb_samples);
-                                    if (r < 0) {
-                                        ERR(FFmpegProvider::Internal, tr("Conversion error"));
-                                    } else {
-                                        char *out = reinterpret_cast<char *>(dst_data[0]);
-                                        int bufsize = av_samples_get_buffer_size(&dst_linesize, n_channels, r, AV_SAMPLE_FMT_S16, 1);
-
-                                        tmp_audio_buf.append(out, bufsize);
-                                        while((r = swr_convert(swr_ctx, dst_data, n_samples, NULL, 0)) > 0) {
-                                            bufsize = av_samples_get_buffer_size(&dst_linesize, n_channels, r, AV_SAMPLE_FMT_S16, 1);
-                                            tmp_audio_buf.append(out, bufsize);
-                                        }
-                                    }
-                                }
-                            }
-
-                            FFmpegAudio au;
-                            au.audio = tmp_audio_buf;
-                            au.position_in_ms = audio_position_in_ms;
-                            au.clear = false;
-                            _ffmpeg->audio_queue.enqueue(au);
-                            _provider->signalPcmAvailable();
-
-                            tmp_audio_buf.clear();
-                        }
-                    } else if (pkt->stream_index == _ffmpeg->video_stream_index) {
-                        int res = avcodec_send_packet(video_ctx, pkt);
-                        if (res < 0) {
-                            ERR(FFmpegProvider::Internal, tr("Cannot send packet to video controller"));
-                            _request = Ended;
-                        } else {
-                            res = avcodec_receive_frame(video_ctx, _ffmpeg->pFrame);
-                            if (res == 0) {
+void DecoderThread::requestPlayState(PlayState s)
+{
+    setRequest(s);
+    wake();
+}
+
+void DecoderThread::waitForRequest()
+{
+    _mutex->lock();
+    while(_current != _request && _run) {
+        _state_cond.wait(_mutex);
+    }
+    _mutex->unlock();
+}
+
+void DecoderThread::waitForState(PlayState s)
+{
+    _mutex->lock();
+    while(_current != s && _run) {
+        _state_cond.wait(_mutex);
+    }
+    _mutex->unlock();
+}
+
+/*******************************************************************************
+ * AVFrameVideoBuffer, zero copy frames for a QAbstractVideoSurface
+ *******************************************************************************/
+
+AVFrameVideoBuffer::AVFrameVideoBuffer(AVFrame *frame)
+    : QAbstractVideoBuffer(QAbstractVideoBuffer::NoHandle)
+{
+    _frame = frame;
+    _mode = NotMapped;
+}
+
+AVFrameVideoBuffer::~AVFrameVideoBuffer()
+{
+    av_frame_free(&_frame);
+}
+
+QAbstractVideoBuffer::MapMode AVFrameVideoBuffer::mapMode() const
+{
+    return _mode;
+}
+
+uchar *AVFrameVideoBuffer::map(MapMode mode, int *numBytes, int *bytesPerLine)
+{
+    int linesizes[4];
+    uchar *data[4];
+    if (mapPlanes(mode, numBytes, linesizes, data) == 0) {
+        return nullptr;
+    }
+    if (bytesPerLine) { *bytesPerLine = linesizes[0]; }
+    return data[0];
+}
+
+// The decoder may still reference the planes, so they can only be mapped read only
+int AVFrameVideoBuffer::mapPlanes(MapMode mode, int *numBytes, int bytesPerLine[4], uchar *data[4])
+{
+    if (mode != ReadOnly || _mode != NotMapped) {
+        return 0;
+    }
+
+    AVPixelFormat fmt = static_cast<AVPixelFormat>(_frame->format);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    int planes = av_pix_fmt_count_planes(fmt);
+    if (desc == nullptr || planes <= 0 || planes > 4) {
+        return 0;
+    }
+
+    int bytes = 0;
+    int i;
+    for(i = 0; i < planes; i++) {
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        int h = -((-_frame->height) >> shift);
+        bytesPerLine[i] = _frame->linesize[i];
+        data[i] = _frame->data[i];
+        bytes += _frame->linesize[i] * h;
+    }
+    if (numBytes) { *numBytes = bytes; }
+
+    _mode = mode;
+    return planes;
+}
 
-                                AVRational millisecondbase = { 1, 1000 };
-                                _ffmpeg->position_in_ms = av_rescale_q(pkt->dts, format_ctx->streams[_ffmpeg->video_stream_index]->time_base, millisecondbase);
-                                if (at_end(_ffmpeg->position_in_ms)) {
-                                    _request = Ended;
-                                }
+void AVFrameVideoBuffer::unmap()
+{
+    _mode = NotMapped;
+}
 
+/*******************************************************************************
+ * The decoder stages, audio and video each decode on their own thread
+ *******************************************************************************/
 
-                                AVCodecContext *ctx = video_ctx;
-                                int w = ctx->width;
-                                int h = ctx->height;
+DecoderStage::DecoderStage(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex, PacketQueue *packets)
+{
+    _provider = p;
+    _ffmpeg = ffmpeg;
+    _mutex = mutex;
+    _packets = packets;
+}
 
-                                int flags = SWS_BILINEAR; // SWS_POINT;  // SWS_FAST_BILINEAR;      // SWS_BILINEAR
+bool DecoderStage::isCurrent(int serial)
+{
+    return serial == _ffmpeg->serial.loadAcquire();
+}
 
-                                sws = sws_getCachedContext(sws, w, h, ctx->pix_fmt, w, h, VIDEO_FORMAT, flags, NULL, NULL, NULL);
+static void setup_array(uint8_t* out[], AVFrame* in_frame, enum AVSampleFormat format, int /*samples*/)
+{
+    if (av_sample_fmt_is_planar(format)) {
+        int i;
+        for (i = 0; i < in_frame->channels; i++) {
+            out[i] = in_frame->data[i];
+        }
+    } else {
+        out[0] = in_frame->data[0];
+    }
+}
 
-                                FFmpegImage fimg;
-                                fimg.image = QImage(w, h, QImage::Format_RGB32);
+#define CH_MAX 128
 
-                                if (sws == nullptr) {
-                                    ERR(FFmpegProvider::Internal, tr("Cannot initialize conversion context"));
-                                    _request = Ended;
-                                } else {
-                                    unsigned char *img[8] = { fimg.image.bits() };
-                                    int rgb_linesize[8] = { 0 };
-                                    rgb_linesize[0] = w * 4;
-                                    sws_scale(sws, _ffmpeg->pFrame->data, _ffmpeg->pFrame->linesize, 0, h, img, rgb_linesize);
-                                }
+AudioDecoderThread::AudioDecoderThread(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex)
+    : DecoderStage(p, ffmpeg, mutex, &ffmpeg->audio_packets)
+{
+}
 
-                                fimg.position_in_ms = _ffmpeg->position_in_ms;
-                                _ffmpeg->image_queue.enqueue(fimg);
+void AudioDecoderThread::run()
+{
+    AVFrame *frame = av_frame_alloc();
 
-                                _provider->signalImageAvailable();
-                            }
+    SwrContext *swr_ctx = nullptr;
+    uint8_t **dst_data = nullptr;
+
+    int max_n_samples = -1;
+    int dst_linesize;
+
+    auto audio_ctx = _ffmpeg->pAudioCtx;
+    auto format_ctx = _ffmpeg->pFormatCtx;
+    const AudioOutFormat &out = _ffmpeg->audio_format;
+    AVRational time_base = format_ctx->streams[_ffmpeg->audio_stream_index]->time_base;
+    AVRational millisecondbase = { 1, 1000 };
+
+    swr_ctx = swr_alloc();
+
+    int64_t in_layout = (audio_ctx->channel_layout != 0) ? static_cast<int64_t>(audio_ctx->channel_layout)
+                                                         : av_get_default_channel_layout(audio_ctx->channels);
+    av_opt_set_int(swr_ctx, "in_channel_layout", in_layout, 0);
+    av_opt_set_int(swr_ctx, "in_sample_rate", audio_ctx->sample_rate, 0);
+    av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt", audio_ctx->sample_fmt, 0);
+
+    av_opt_set_int(swr_ctx, "out_channel_layout", out.channel_layout, 0);
+    av_opt_set_int(swr_ctx, "out_sample_rate", out.sample_rate, 0);
+    av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt", out.sample_fmt, 0);
+
+    swr_init(swr_ctx);
+
+    QByteArray tmp_audio_buf;
+    FFmpegPacket p;
+    int seek_target_ms = -1;
+    bool snap_clock = false;
+
+    while(_packets->get(p)) {
+        if (p.pkt == nullptr) {
+            avcodec_flush_buffers(audio_ctx);
+            seek_target_ms = p.seek_target_ms;
+            snap_clock = p.snap_clock && (_ffmpeg->video_stream_index < 0);     // otherwise video sets the clock
+            continue;
+        }
+
+        if (_ffmpeg->seek_pending.loadAcquire() || !isCurrent(p.serial)) {
+            _ffmpeg->seek_aborted.fetchAndAddRelaxed(1);
+            av_packet_free(&p.pkt);
+            continue;
+        }
+
+        int res = avcodec_send_packet(audio_ctx, p.pkt);
+        int audio_position_in_ms = av_rescale_q(p.pkt->dts, time_base, millisecondbase);
+        av_packet_free(&p.pkt);
+
+        if (res < 0) {
+            ERR(FFmpegProvider::Internal, tr("Cannot send packet to audio controller"));
+            continue;
+        }
+
+        bool first = true;
+        while(res >= 0) {
+            res = avcodec_receive_frame(audio_ctx, frame); // decodes to RAW PCM?
+
+            if (res >= 0) {
+                if (first && frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+                    audio_position_in_ms = av_rescale_q(frame->best_effort_timestamp, time_base, millisecondbase);
+                }
+                first = false;
+
+                // The device takes the decoder output as is
+                if (out.passthrough && frame->format == out.sample_fmt &&
+                        frame->sample_rate == out.sample_rate && frame->channels == out.channels) {
+                    int bufsize = av_samples_get_buffer_size(nullptr, out.channels, frame->nb_samples, out.sample_fmt, 1);
+                    tmp_audio_buf.append(reinterpret_cast<const char *>(frame->data[0]), bufsize);
+                    continue;
+                }
+
+                int n_channels = out.channels;
+
+                int n_samples;
+                if (max_n_samples == -1) {
+                    n_samples = av_rescale_rnd(frame->nb_samples, out.sample_rate, audio_ctx->sample_rate, AV_ROUND_UP);
+                    max_n_samples = n_samples;
+                    res = av_samples_alloc_array_and_samples(&dst_data, &dst_linesize, n_channels, n_samples, out.sample_fmt, 0);
+                    if (res < 0) {
+                        ERR(FFmpegProvider::Internal, tr("Cannot allocate dst_data"));
+                    }
+                } else {
+                    n_samples = av_rescale_rnd(swr_get_delay(swr_ctx, audio_ctx->sample_rate) + frame->nb_samples,
+                                               out.sample_rate, audio_ctx->sample_rate, AV_ROUND_UP
+                                               );
+                    if (n_samples > max_n_samples) {
+                        av_freep(&dst_data[0]);
+                        res = av_samples_alloc(dst_data, &dst_linesize, n_channels, n_samples, out.sample_fmt, 1);
+                        if (res < 0) {
+                            ERR(FFmpegProvider::Internal, tr("Cannot allocate dst_data again"));
                         }
+                        max_n_samples = n_samples;
                     }
+                }
+
+                uint8_t *tmp_in[CH_MAX];
+                setup_array(reinterpret_cast<uint8_t **>(tmp_in), frame, audio_ctx->sample_fmt, frame->nb_samples);
+                int r = swr_convert(swr_ctx, dst_data, n_samples, const_cast<const uint8_t **>(reinterpret_cast<uint8_t **>(tmp_in)), frame->nb_samples);
+                if (r < 0) {
+                    ERR(FFmpegProvider::Internal, tr("Conversion error"));
                 } else {
-                    if (ret == AVERROR_EOF) {
-                        ERR(FFmpegProvider::Internal, tr("End of stream."));
-                        _request = Ended;
-                    } else {
-                        ERR(FFmpegProvider::Internal, tr("Unclear %1").arg(ret));
-                        _request = Ended;
+                    char *dst = reinterpret_cast<char *>(dst_data[0]);
+                    int bufsize = av_samples_get_buffer_size(&dst_linesize, n_channels, r, out.sample_fmt, 1);
+
+                    tmp_audio_buf.append(dst, bufsize);
+                    while((r = swr_convert(swr_ctx, dst_data, n_samples, NULL, 0)) > 0) {
+                        bufsize = av_samples_get_buffer_size(&dst_linesize, n_channels, r, out.sample_fmt, 1);
+                        tmp_audio_buf.append(dst, bufsize);
                     }
                 }
+            }
+        }
 
-                _mutex->unlock();
+        // Precise seek: audio before the target is dropped
+        if (seek_target_ms >= 0 && tmp_audio_buf.size() > 0) {
+            if (audio_position_in_ms < seek_target_ms) {
+                const AudioOutFormat &fmt = _ffmpeg->audio_format;
+                qint64 skip = static_cast<qint64>(seek_target_ms - audio_position_in_ms) * fmt.sample_rate / 1000 * fmt.frameBytes();
+                if (skip >= tmp_audio_buf.size()) {
+                    tmp_audio_buf.clear();
+                } else {
+                    tmp_audio_buf.remove(0, static_cast<int>(skip));
+                    audio_position_in_ms = seek_target_ms;
+                    seek_target_ms = -1;
+                }
+            } else {
+                seek_target_ms = -1;
+            }
+        }
+
+        if (snap_clock && tmp_audio_buf.size() > 0) {
+            if (isCurrent(p.serial)) {
+                _ffmpeg->snapClock(audio_position_in_ms);
+            }
+            snap_clock = false;
+        }
+
+        // Backpressure: don't decode too far ahead of the playing position.
+        // Sleep till we're within range again, or the GUI thread frees a slot.
+        while(isCurrent(p.serial) && !_packets->isAborted()) {
+            int ahead_ms = audio_position_in_ms - _ffmpeg->currentTimeMs();
+            if (_ffmpeg->audio_queue.isFull()) {
+                _ffmpeg->audio_wake.wait();
+            } else if (ahead_ms > AUDIO_QUEUE_MAX_MS) {
+                _ffmpeg->audio_wake.wait(ahead_ms - AUDIO_QUEUE_MAX_MS);
+            } else {
+                break;
             }
         }
+
+        if (isCurrent(p.serial) && tmp_audio_buf.size() > 0) {
+            FFmpegAudio au;
+            au.audio = tmp_audio_buf;
+            au.position_in_ms = audio_position_in_ms;
+            au.serial = p.serial;
+            _ffmpeg->audio_queue.push(au);
+            _provider->signalPcmAvailable();
+        }
+
+        tmp_audio_buf.clear();
     }
 
     if (dst_data) {
         av_freep(&dst_data[0]);
         av_freep(&dst_data);
     }
-    av_packet_unref(pkt);
     if (swr_ctx) {
         swr_free(&swr_ctx);
     }
+    av_frame_free(&frame);
 }
 
-void DecoderThread::endDecoder()
+VideoDecoderThread::VideoDecoderThread(FFmpegProvider *p, FFmpeg *ffmpeg, QMutex *mutex)
+    : DecoderStage(p, ffmpeg, mutex, &ffmpeg->video_packets)
 {
-    _mutex->lock();
-    _run = false;
-    _mutex->unlock();
 }
 
-void DecoderThread::requestPlayState(PlayState s)
+// The image queue is full when its buffered duration or memory is over `fill` of the player's
+// budget, or when adding next_bytes would go over the budget of all players together.
+bool VideoDecoderThread::queueFull(qint64 next_bytes, qreal fill, bool &process_limited)
 {
-    _mutex->lock();
-    _request = s;
-    _mutex->unlock();
-}
+    const VideoQueuePolicy &policy = videoQueuePolicy();
+    int depth = _ffmpeg->image_queue.size();
 
-void DecoderThread::waitForRequest()
-{
-    while(true) {
-        bool reached = false;
-        _mutex->lock();
-        if (_current == _request) { reached = true; }
-        _mutex->unlock();
-        if (reached) { return; }
-        QThread::msleep(10);
+    process_limited = false;
+    if (depth < VIDEO_QUEUE_MIN_FRAMES) {
+        return false;
     }
+    if (depth >= _ffmpeg->image_queue.capacity() * fill) {
+        return true;
+    }
+    if (depth * _ffmpeg->frame_duration_ms.loadRelaxed() >= policy.target_ms * fill) {
+        return true;
+    }
+    if (_ffmpeg->image_bytes.loadRelaxed() + next_bytes > policy.player_bytes * fill) {
+        return true;
+    }
+    if (process_image_bytes.loadRelaxed() + next_bytes > policy.process_bytes) {
+        process_limited = true;
+        return true;
+    }
+    return false;
 }
 
-void DecoderThread::waitForState(PlayState s)
+void VideoDecoderThread::run()
 {
-    while(true) {
-        bool reached = false;
-        _mutex->lock();
-        if (_current == s) { reached = true; }
-        _mutex->unlock();
-        if (reached) { return; }
-        QThread::msleep(10);
+    AVFrame *frame = av_frame_alloc();
+
+    auto video_ctx = _ffmpeg->pVideoCtx;
+    auto format_ctx = _ffmpeg->pFormatCtx;
+    AVStream *stream = format_ctx->streams[_ffmpeg->video_stream_index];
+    AVRational time_base = stream->time_base;
+    AVRational millisecondbase = { 1, 1000 };
+
+    AVRational frame_rate = (stream->avg_frame_rate.num > 0) ? stream->avg_frame_rate : video_ctx->framerate;
+    if (frame_rate.num > 0 && frame_rate.den > 0) {
+        _ffmpeg->frame_duration_ms.storeRelaxed(qMax(1, static_cast<int>(1000 * frame_rate.den / frame_rate.num)));
     }
+
+    // Late frame policy: frames past their presentation slot are dropped before they're
+    // queued (and converted). After a flush frames aren't dropped till one is in time: a precise
+    // seek runs the clock from the target while it decodes from the keyframe, the frames at the
+    // target would all be late. When frames keep being late, the decoder skips the loop
+    // filter and then non reference frames, until it has caught up for a while.
+    int skip_level = 0;
+    int consecutive_drops = 0;
+    bool synced = false;        // a frame was in time since the last flush, lateness after a seek doesn't count
+    int window_frames = 0;
+    int window_late = 0;
+    int clean_windows = 0;
+    qint64 presented_drops = _ffmpeg->late_presented.loadRelaxed();
+
+    int seek_target_ms = -1;
+    bool snap_clock = false;
+    bool scrub = false;
+
+    FFmpegPacket p;
+
+    while(_packets->get(p)) {
+        if (p.pkt == nullptr) {
+            avcodec_flush_buffers(video_ctx);
+            seek_target_ms = p.seek_target_ms;
+            snap_clock = p.snap_clock;
+            scrub = p.scrub;
+            consecutive_drops = 0;
+            synced = false;
+            window_frames = 0;
+            window_late = 0;
+            continue;
+        }
+
+        // A newer seek is waiting for the demuxer, don't decode for the old target
+        if (_ffmpeg->seek_pending.loadAcquire() || !isCurrent(p.serial)) {
+            _ffmpeg->seek_aborted.fetchAndAddRelaxed(1);
+            av_packet_free(&p.pkt);
+            continue;
+        }
+
+        // At fast rates most frames would be late anyway, don't spend the cpu on them
+        bool fast = (_ffmpeg->playbackRate() > VIDEO_SKIP_NONREF_RATE);
+        AVDiscard skip_frame = (fast || skip_level >= 2) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+        AVDiscard skip_loop_filter = (skip_level >= 1) ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+        if (video_ctx->skip_frame != skip_frame) {
+            video_ctx->skip_frame = skip_frame;
+        }
+        if (video_ctx->skip_loop_filter != skip_loop_filter) {
+            video_ctx->skip_loop_filter = skip_loop_filter;
+        }
+
+        int res = avcodec_send_packet(video_ctx, p.pkt);
+        int64_t pkt_dts = p.pkt->dts;
+        av_packet_free(&p.pkt);
+
+        if (res < 0) {
+            ERR(FFmpegProvider::Internal, tr("Cannot send packet to video controller"));
+            continue;
+        }
+
+        // Scrub preview: the keyframe is drained out of the decoder right away, frame
+        // threading would otherwise hold it back till more packets have been sent.
+        if (scrub) {
+            avcodec_send_packet(video_ctx, nullptr);
+        }
+
+        while((res = avcodec_receive_frame(video_ctx, frame)) == 0) {
+            int64_t ts = (frame->best_effort_timestamp != AV_NOPTS_VALUE) ? frame->best_effort_timestamp : pkt_dts;
+            int position_in_ms = av_rescale_q(ts, time_base, millisecondbase);
+
+            // Precise seek: the frames from the keyframe up to the target are decoded,
+            // but not queued or converted. The frame showing the target is the first one queued.
+            if (seek_target_ms >= 0) {
+                int duration_ms = (frame->pkt_duration > 0) ? static_cast<int>(av_rescale_q(frame->pkt_duration, time_base, millisecondbase))
+                                                            : _ffmpeg->frame_duration_ms.loadRelaxed();
+                if (position_in_ms + duration_ms <= seek_target_ms) {
+                    _ffmpeg->history.add(position_in_ms, frame);     // backward steps from the target need these
+                    av_frame_unref(frame);
+                    continue;
+                }
+                seek_target_ms = -1;
+            }
+
+            if (snap_clock) {
+                if (isCurrent(p.serial)) {
+                    _ffmpeg->snapClock(position_in_ms);
+                }
+                snap_clock = false;
+            }
+
+            int w = frame->width;
+            int h = frame->height;
+
+            // Backpressure: when the queue is over its budget, wait till it has been drained
+            // below VIDEO_QUEUE_RESUME_FILL of it.
+            int frame_bytes = av_image_get_buffer_size(static_cast<AVPixelFormat>(frame->format), w, h, 1);
+            if (frame_bytes < 0) {
+                frame_bytes = w * h * 4;
+            }
+            bool process_limited = false;
+
+            if (queueFull(frame_bytes, 1.0, process_limited)) {
+                while(isCurrent(p.serial) && !_packets->isAborted() &&
+                      queueFull(frame_bytes, VIDEO_QUEUE_RESUME_FILL, process_limited)) {
+                    // woken when the GUI thread takes an image, other players don't wake us
+                    _ffmpeg->video_wake.wait(process_limited ? VIDEO_QUEUE_PROCESS_POLL_MS : -1);
+                }
+            }
+
+            bool late = false;
+            if (_ffmpeg->clock_running.loadRelaxed() && isCurrent(p.serial)) {
+                late = (position_in_ms + _ffmpeg->frame_duration_ms.loadRelaxed() < _ffmpeg->currentTimeMs());
+            }
+            synced = synced || !late;
+
+            if (synced) {
+                window_frames += 1;
+                window_late += (late) ? 1 : 0;
+                if (window_frames >= VIDEO_LATE_WINDOW) {
+                    qint64 gui_drops = _ffmpeg->late_presented.loadRelaxed();
+                    window_late += static_cast<int>(gui_drops - presented_drops);
+                    presented_drops = gui_drops;
+
+                    if (window_late > window_frames * VIDEO_LATE_ESCALATE_FRACTION) {
+                        if (skip_level < VIDEO_MAX_SKIP_LEVEL) {
+                            skip_level += 1;
+                            _ffmpeg->skip_escalations.fetchAndAddRelaxed(1);
+                            LINE_DEBUG << "Video decoding falls behind, skip level" << skip_level;
+                        }
+                        clean_windows = 0;
+                    } else if (window_late == 0 && skip_level > 0) {
+                        clean_windows += 1;
+                        if (clean_windows >= VIDEO_RECOVER_WINDOWS) {
+                            skip_level -= 1;
+                            clean_windows = 0;
+                            LINE_DEBUG << "Video decoding caught up, skip level" << skip_level;
+                        }
+                    }
+                    _ffmpeg->skip_level.storeRelaxed(skip_level);
+
+                    window_frames = 0;
+                    window_late = 0;
+                }
+            }
+
+            if (late && synced && consecutive_drops < VIDEO_MAX_CONSECUTIVE_DROPS) {
+                consecutive_drops += 1;
+                _ffmpeg->late_decoded.fetchAndAddRelaxed(1);
+                av_frame_unref(frame);
+                continue;
+            }
+            consecutive_drops = 0;
+
+            FFmpegImage fimg;
+            fimg.frame = av_frame_alloc();
+            if (fimg.frame == nullptr) {
+                ERR(FFmpegProvider::CantAlloc, tr("Cannot allocate video frame"));
+                continue;
+            }
+            av_frame_move_ref(fimg.frame, frame);      // queued in its native format
+            fimg.bytes = frame_bytes;
+            fimg.position_in_ms = position_in_ms;
+            fimg.serial = p.serial;
+
+            // The GUI thread drops stale images, but it only consumes while
+            // playing, so wait for a free slot.
+            while(_ffmpeg->image_queue.isFull() && isCurrent(p.serial) && !_packets->isAborted()) {
+                _ffmpeg->video_wake.wait();
+            }
+
+            if (isCurrent(p.serial)) {
+                _ffmpeg->pushImage(fimg);
+                _provider->signalImageAvailable();
+                if (_ffmpeg->pushed_serial.fetchAndStoreRelease(p.serial) != p.serial) {
+                    _ffmpeg->demux_wake.wake();     // a seek while paused waits for this frame
+                }
+            } else {
+                av_frame_free(&fimg.frame);
+            }
+        }
+
+        if (scrub) {
+            avcodec_flush_buffers(video_ctx);       // leave the drained state
+            _ffmpeg->scrub_previews.fetchAndAddRelaxed(1);
+            scrub = false;
+        }
+    }
+
+    av_frame_free(&frame);
 }
 
 /*****************************************************************
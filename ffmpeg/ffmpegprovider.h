@@ -18,14 +18,20 @@
 #include <QObject>
 #include <QHash>
 #include <QList>
+#include <QPair>
 #include <QSize>
 #include <QAudio>
+#include <QVideoFrame>
+#include <QVariantMap>
 
 class MediaPlayerControl;
 class FFmpeg;
 class DecoderThread;
 class QPainter;
 class QAudioOutput;
+class QTimer;
+class QVideoSurfaceFormat;
+class QIODevice;
 
 class FFmpegProvider : public QObject
 {
@@ -64,6 +70,13 @@ public:
         Other = 3
     };
 
+    enum SeekMode {
+        PreciseSeek = 0,        // decode from the keyframe before the target, show the frame at the target
+        KeyframeSeek = 1,       // show the keyframe nearest to the target, fast
+        ScrubSeek = 2           // while dragging: only the keyframe nearest to the target is decoded and shown,
+                                // playback holds till a precise or keyframe seek ends the scrub
+    };
+
     enum Ratio {
         IgnoreAspectRatio = 1,
         KeepAspectRatioCrop = 2,
@@ -119,11 +132,20 @@ private:
     MediaPlayerControl *_control;
 
     QString             _current_url;
+    QIODevice          *_current_device;    // set by setMedia(device), nullptr for urls
+
+    QTimer             *_image_timer;
+    QTimer             *_audio_timer;
+    QTimer             *_buffer_timer;      // polls the network read ahead
+    int                 _buffer_status;
 
     QList<std::function<void (State s)>> state_cbs;
     QList<std::function<void (MediaState s)>> mediastate_cbs;
     QList<std::function<void (const MediaEvent &e)>> mediaevent_cbs;
+    QList<std::function<void (int percent)>> bufferstatus_cbs;
     std::function<void (void *context)> _render_cb;
+    std::function<void (qint64 pos, bool *ok)> _prepare_cb;     // called once the media has been opened
+    qint64              _prepare_pos;
 
 public:
     FFmpegProvider(MediaPlayerControl *parent = nullptr);
@@ -135,6 +157,7 @@ public:
     void onStateChanged(std::function<void (State s)> f);
     void onMediaStateChanged(std::function<void (MediaState s)> f);
     void onEvent(std::function<void (const MediaEvent &e)> f);
+    void onBufferStatusChanged(std::function<void (int percent)> f);
     void setRenderCallback(std::function<void (void *context)> f);
 
 public:
@@ -151,29 +174,45 @@ public:
     qreal playbackRate() const;
     void setPlaybackRate(qreal rate);
 
-    void seek(qint64 pos_in_ms);
+    void seek(qint64 pos_in_ms, SeekMode mode = PreciseSeek);
     qint64 position() const;
 
+    // Shows the next (direction > 0) or previous frame, pauses playback
+    void stepFrame(int direction);
+
     void setHue(int hue);
     void setSaturation(int sat);
     void setContrast(int contr);
     void setBrightness(int brightness);
 
 public:
+    // Opens the media in the background, the media state is Loading till it's opened
     bool setMedia(const QString &url);
 
+    // Plays the stream of device from its current position. The device must stay valid
+    // and must not be used by others till other media is set.
+    bool setMedia(QIODevice *device);
+
 public:
     void waitFor(State s);
     void prepare(qint64 seek, std::function<void (qint64 pos, bool *ok)> cb);
 
     const Info &mediaInfo() const;
 
+    // Buffered part of the read ahead budget (0 - 100) and the buffered ranges in ms
+    int bufferStatus() const;
+    QList<QPair<qint64, qint64>> bufferedRanges() const;
+
+    QVariantMap statistics() const;
+
 public:
     void setVideoSurfaceSize(int w, int h);
     QSize getVideoSurfaceSize() const;
     void scale(qreal x, qreal y);
     void renderVideo(QPainter *p);
     QImage *getImage(bool &gotIt);
+    void recordRenderStats(const QString &path, qint64 total_ns, qint64 upload_ns);
+    QVideoFrame getVideoFrame(const QList<QVideoFrame::PixelFormat> &supported, QVideoSurfaceFormat &format, bool &gotIt);
     void popImage();
 
 public:
@@ -192,28 +231,43 @@ public:
     void signalClearAudioBuffer();
     void signalClearVideoBuffer();
     void signalSetState(State s);
+    void signalMediaOpened(int serial);
+
+private:
+    bool openMedia(const QString &url, QIODevice *device);
+    void cancelOpen();
+    bool openStreams(const QString &url, const QString &file);
 
 private:
     void resetProvider();
     void stopThreads();
     void startThreads();
-    bool allocBuffers();
+
+private:
+    void dropStaleImages();
+    void imagePopped();
+    void refillHistory(int position_in_ms);
 
 private:
     int audioThresholdMs();
     void audiobClearBuf();
     int audiobBufSizeInMs();
-    void audiobPutAudio(const QByteArray &samples);
+    void audiobPutAudio(const QByteArray &samples, int end_pts_ms, qreal rate);
+    bool audioClockMs(int &clock_ms);
+    void syncClock();
 
 signals:
     void imageAvailable();
     void pcmAvailable();
     void setStateSig(State s);
+    void mediaOpened(int serial);
 
 private slots:
     void handleImageAvailable();
     void handleAudioAvailable();
     void handleSetState(State s);
+    void handleBufferStatus();
+    void handleMediaOpened(int serial);
 };
 
 #endif // FFMPEGPROVIDER_H
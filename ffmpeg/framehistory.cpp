@@ -0,0 +1,191 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Decoded video frames around the playhead, for stepping through the video.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "framehistory.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+}
+
+#define FRAME_HISTORY_MB 256                // decoded frames kept around the playhead for frame stepping
+#define FRAME_HISTORY_MAX_FRAMES 250
+
+FrameHistory::FrameHistory()
+{
+    _bytes = 0;
+    _playhead = 0;
+    _enabled = 0;
+    _refills = 0;
+    _refill_frames = 0;
+    _refill_ms = 0;
+
+    int mb = qEnvironmentVariableIntValue("FFMPEG_PLUGIN_FRAME_HISTORY_MB");
+    _max_bytes = static_cast<qint64>((mb > 0) ? mb : FRAME_HISTORY_MB) * 1024 * 1024;
+}
+
+FrameHistory::~FrameHistory()
+{
+    clear();
+}
+
+int FrameHistory::frameBytes(const AVFrame *frame)
+{
+    int bytes = av_image_get_buffer_size(static_cast<AVPixelFormat>(frame->format), frame->width, frame->height, 1);
+    return (bytes < 0) ? frame->width * frame->height * 4 : bytes;
+}
+
+void FrameHistory::setEnabled(bool yes)
+{
+    _enabled.storeRelease(yes);
+    if (!yes) {
+        clear();
+    }
+}
+
+bool FrameHistory::isEnabled() const
+{
+    return _enabled.loadAcquire();
+}
+
+void FrameHistory::setPlayhead(int position_in_ms)
+{
+    _mutex.lock();
+    _playhead = position_in_ms;
+    _mutex.unlock();
+}
+
+bool FrameHistory::add(int position_in_ms, const AVFrame *frame)
+{
+    if (!isEnabled()) {
+        return false;
+    }
+
+    bool added = false;
+    _mutex.lock();
+    if (!_frames.contains(position_in_ms)) {
+        AVFrame *ref = av_frame_clone(frame);
+        if (ref != nullptr) {
+            _frames.insert(position_in_ms, ref);
+            _bytes += frameBytes(ref);
+            added = true;
+        }
+
+        while(!_frames.isEmpty() && (_bytes > _max_bytes || _frames.size() > FRAME_HISTORY_MAX_FRAMES)) {
+            int first = _frames.firstKey();
+            int last = _frames.lastKey();
+            int key = (qAbs(_playhead - first) >= qAbs(last - _playhead)) ? first : last;
+            AVFrame *f = _frames.take(key);
+            _bytes -= frameBytes(f);
+            av_frame_free(&f);
+        }
+    }
+    _mutex.unlock();
+
+    return added;
+}
+
+void FrameHistory::clear()
+{
+    _mutex.lock();
+    auto it = _frames.begin();
+    while(it != _frames.end()) {
+        av_frame_free(&it.value());
+        ++it;
+    }
+    _frames.clear();
+    _bytes = 0;
+    _mutex.unlock();
+}
+
+AVFrame *FrameHistory::before(int position_in_ms, int &frame_position_ms)
+{
+    AVFrame *ref = nullptr;
+    _mutex.lock();
+    auto it = _frames.lowerBound(position_in_ms);
+    if (it != _frames.begin()) {
+        --it;
+        frame_position_ms = it.key();
+        ref = av_frame_clone(it.value());
+    }
+    _mutex.unlock();
+    return ref;
+}
+
+AVFrame *FrameHistory::after(int position_in_ms, int &frame_position_ms)
+{
+    AVFrame *ref = nullptr;
+    _mutex.lock();
+    auto it = _frames.upperBound(position_in_ms);
+    if (it != _frames.end()) {
+        frame_position_ms = it.key();
+        ref = av_frame_clone(it.value());
+    }
+    _mutex.unlock();
+    return ref;
+}
+
+int FrameHistory::runStart(int position_in_ms, int max_gap_ms, int &frames)
+{
+    int start = position_in_ms;
+    frames = 0;
+
+    _mutex.lock();
+    auto it = _frames.upperBound(position_in_ms);
+    while(it != _frames.begin()) {
+        --it;
+        if (start - it.key() > max_gap_ms) {
+            break;
+        }
+        start = it.key();
+        frames += 1;
+    }
+    _mutex.unlock();
+
+    return start;
+}
+
+int FrameHistory::frames()
+{
+    _mutex.lock();
+    int n = _frames.size();
+    _mutex.unlock();
+    return n;
+}
+
+qint64 FrameHistory::bytes()
+{
+    _mutex.lock();
+    qint64 b = _bytes;
+    _mutex.unlock();
+    return b;
+}
+
+void FrameHistory::addRefill(int frames, qint64 ms)
+{
+    _refills.fetchAndAddRelaxed(1);
+    _refill_frames.fetchAndAddRelaxed(frames);
+    _refill_ms.fetchAndAddRelaxed(ms);
+}
+
+qint64 FrameHistory::refills() const
+{
+    return _refills.loadRelaxed();
+}
+
+qint64 FrameHistory::refillFrames() const
+{
+    return _refill_frames.loadRelaxed();
+}
+
+qint64 FrameHistory::refillMs() const
+{
+    return _refill_ms.loadRelaxed();
+}
@@ -0,0 +1,70 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Decoded video frames around the playhead, for stepping through the video.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef FRAMEHISTORY_H
+#define FRAMEHISTORY_H
+
+#include <QMutex>
+#include <QMap>
+#include <QAtomicInt>
+
+struct AVFrame;
+
+/*
+ * Decoded frames around the playhead, by position, for stepping through the video.
+ * It keeps frames only once the first frame step has enabled it. Over its budget,
+ * the frame furthest from the playhead goes first. It's filled by the GUI thread
+ * (presented frames), the video stage (frames decoded up to a seek target) and
+ * the GOP refill thread.
+ */
+class FrameHistory
+{
+private:
+    QMutex               _mutex;
+    QMap<int, AVFrame *> _frames;       // position_in_ms -> own reference
+    qint64               _bytes;
+    qint64               _max_bytes;
+    int                  _playhead;
+    QAtomicInt           _enabled;
+    QAtomicInteger<qint64> _refills;    // GOPs decoded into the history by a GopRefill
+    QAtomicInteger<qint64> _refill_frames;
+    QAtomicInteger<qint64> _refill_ms;
+
+public:
+    FrameHistory();
+   ~FrameHistory();
+
+public:
+    void setEnabled(bool yes);
+    bool isEnabled() const;
+    void setPlayhead(int position_in_ms);
+    bool add(int position_in_ms, const AVFrame *frame);     // false when it was there already or isn't kept
+    void clear();
+
+    // A new reference to the nearest frame before/after the position, nullptr when there's none
+    AVFrame *before(int position_in_ms, int &frame_position_ms);
+    AVFrame *after(int position_in_ms, int &frame_position_ms);
+
+    // The first frame of the run of frames, not more than max_gap_ms apart, that ends at the position
+    int runStart(int position_in_ms, int max_gap_ms, int &frames);
+
+    int frames();
+    qint64 bytes();
+
+    void addRefill(int frames, qint64 ms);
+    qint64 refills() const;
+    qint64 refillFrames() const;
+    qint64 refillMs() const;
+
+private:
+    static int frameBytes(const AVFrame *frame);
+};
+
+#endif // FRAMEHISTORY_H
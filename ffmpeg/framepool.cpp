@@ -0,0 +1,144 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Process wide pool of image buffers, so presenting frames doesn't allocate.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "framepool.h"
+
+extern "C" {
+#include <libavutil/mem.h>
+}
+
+#define FRAME_POOL_ALIGN 64
+#define FRAME_POOL_MAX_FREE_BYTES (256 * 1024 * 1024)
+
+FramePool::FramePool()
+{
+    _free_bytes = 0;
+    _allocations = 0;
+    _reuses = 0;
+    _evictions = 0;
+    _in_use = 0;
+}
+
+FramePool *FramePool::instance()
+{
+    // Never deleted, images may still be released while the application exits
+    static FramePool *pool = new FramePool();
+    return pool;
+}
+
+static int bytesPerPixel(QImage::Format fmt)
+{
+    switch(fmt) {
+    case QImage::Format_RGB888: return 3;
+    default: return 4;
+    }
+}
+
+QImage FramePool::acquire(int w, int h, QImage::Format fmt)
+{
+    int stride = (w * bytesPerPixel(fmt) + FRAME_POOL_ALIGN - 1) & ~(FRAME_POOL_ALIGN - 1);
+    quint64 key = (static_cast<quint64>(w) << 40) | (static_cast<quint64>(h) << 16) | static_cast<quint64>(fmt);
+    Buffer *b = nullptr;
+
+    _mutex.lock();
+    touch(key);
+    auto it = _free.find(key);
+    if (it != _free.end() && !it.value().isEmpty()) {
+        b = it.value().takeLast();
+        _free_bytes -= b->bytes;
+        _reuses += 1;
+    } else {
+        _allocations += 1;
+    }
+    _in_use += 1;
+    _mutex.unlock();
+
+    if (b == nullptr) {
+        b = new Buffer;
+        b->key = key;
+        b->bytes = stride * h;
+        b->data = static_cast<uchar *>(av_malloc(b->bytes));
+        if (b->data == nullptr) {
+            delete b;
+            _mutex.lock();
+            _in_use -= 1;
+            _mutex.unlock();
+            return QImage();
+        }
+    }
+
+    return QImage(b->data, w, h, stride, fmt, FramePool::release, b);
+}
+
+void FramePool::release(void *info)
+{
+    instance()->put(static_cast<Buffer *>(info));
+}
+
+// With the mutex locked
+void FramePool::touch(quint64 key)
+{
+    _lru.removeOne(key);
+    _lru.append(key);
+}
+
+void FramePool::put(Buffer *b)
+{
+    QList<Buffer *> evicted;
+
+    _mutex.lock();
+    _in_use -= 1;
+    touch(b->key);
+
+    // Make room by dropping the buffers of the sizes used least recently
+    int i = 0;
+    while(_free_bytes + b->bytes > FRAME_POOL_MAX_FREE_BYTES && i < _lru.size()) {
+        quint64 key = _lru[i];
+        if (key == b->key) {
+            i += 1;
+            continue;
+        }
+        QList<Buffer *> buffers = _free.take(key);
+        for(Buffer *e : buffers) {
+            _free_bytes -= e->bytes;
+            evicted.append(e);
+        }
+        _evictions += buffers.size();
+        _lru.removeAt(i);
+    }
+
+    if (_free_bytes + b->bytes <= FRAME_POOL_MAX_FREE_BYTES) {
+        _free[b->key].append(b);
+        _free_bytes += b->bytes;
+        b = nullptr;
+    }
+    _mutex.unlock();
+
+    if (b != nullptr) {
+        evicted.append(b);
+    }
+    for(Buffer *e : evicted) {
+        av_free(e->data);
+        delete e;
+    }
+}
+
+QVariantMap FramePool::statistics()
+{
+    QVariantMap m;
+    _mutex.lock();
+    m["allocations"] = _allocations;
+    m["reuses"] = _reuses;
+    m["evictions"] = _evictions;
+    m["in_use"] = _in_use;
+    m["free_bytes"] = _free_bytes;
+    _mutex.unlock();
+    return m;
+}
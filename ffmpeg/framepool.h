@@ -0,0 +1,64 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Process wide pool of image buffers, so presenting frames doesn't allocate.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <QMutex>
+#include <QHash>
+#include <QList>
+#include <QImage>
+#include <QVariantMap>
+
+/*
+ * A process wide pool of aligned image buffers, keyed by size and format.
+ * The images handed out release their buffer back to the pool when the last
+ * copy is destroyed, also when that copy is held by a QVideoFrame that has
+ * been presented to a surface. So steady state playback doesn't allocate.
+ * When the free buffers exceed their budget, the sizes that were used least
+ * recently go first, so sizes left behind by a resize don't take it up.
+ */
+class FramePool
+{
+private:
+    struct Buffer
+    {
+        uchar   *data;
+        quint64  key;
+        int      bytes;
+    };
+
+private:
+    QMutex                          _mutex;
+    QHash<quint64, QList<Buffer *>> _free;
+    QList<quint64>                  _lru;           // keys in _free, least recently used first
+    qint64                          _free_bytes;
+    qint64                          _allocations;
+    qint64                          _reuses;
+    qint64                          _evictions;
+    int                             _in_use;
+
+public:
+    FramePool();
+
+public:
+    static FramePool *instance();
+
+public:
+    QImage acquire(int w, int h, QImage::Format fmt);
+    QVariantMap statistics();
+
+private:
+    static void release(void *info);
+    void put(Buffer *b);
+    void touch(quint64 key);
+};
+
+#endif // FRAMEPOOL_H
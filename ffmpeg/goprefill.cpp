@@ -0,0 +1,162 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Decodes the GOP before the frame history in the background, for backward frame steps.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "goprefill.h"
+#include "framehistory.h"
+#include "keyframeindex.h"
+
+#include <QElapsedTimer>
+#include <QDebug>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+GopRefill::GopRefill(const QString &file, int stream_index, const AVCodecParameters *par,
+                     KeyframeIndex *keyframe_index, FrameHistory *history)
+{
+    _file = file;
+    _stream_index = stream_index;
+    _par = par;
+    _keyframe_index = keyframe_index;
+    _history = history;
+    _request_ms = -1;
+    _run = true;
+}
+
+void GopRefill::request(int before_ms)
+{
+    _mutex.lock();
+    _request_ms = before_ms;
+    _cond.wakeAll();
+    _mutex.unlock();
+}
+
+void GopRefill::stop()
+{
+    _mutex.lock();
+    _run = false;
+    _cond.wakeAll();
+    _mutex.unlock();
+    wait();
+}
+
+bool GopRefill::superseded()
+{
+    _mutex.lock();
+    bool yes = (_request_ms >= 0 || !_run);
+    _mutex.unlock();
+    return yes;
+}
+
+void GopRefill::run()
+{
+    AVFormatContext *ctx = nullptr;
+    int index = _stream_index;
+
+    if (avformat_open_input(&ctx, _file.toLocal8Bit().constData(), nullptr, nullptr) != 0) {
+        qWarning() << "Cannot open" << _file << "for the frame history";
+        return;
+    }
+    if (static_cast<int>(ctx->nb_streams) <= index) {
+        avformat_find_stream_info(ctx, nullptr);
+    }
+    if (static_cast<int>(ctx->nb_streams) <= index) {
+        avformat_close_input(&ctx);
+        return;
+    }
+
+    // The codec parameters of the player's stream don't change after opening
+    const AVCodecParameters *par = _par;
+    const AVCodec *dec = avcodec_find_decoder(par->codec_id);
+    AVCodecContext *codec = (dec != nullptr) ? avcodec_alloc_context3(dec) : nullptr;
+    if (codec != nullptr) {
+        codec->thread_count = 0;    // auto, a GOP should be ready before the steps reach it
+    }
+    if (codec == nullptr || avcodec_parameters_to_context(codec, par) < 0 || avcodec_open2(codec, dec, nullptr) < 0) {
+        qWarning() << "Cannot open a decoder for the frame history";
+        avcodec_free_context(&codec);
+        avformat_close_input(&ctx);
+        return;
+    }
+
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+
+    _mutex.lock();
+    while(_run) {
+        if (_request_ms < 0) {
+            _cond.wait(&_mutex);
+            continue;
+        }
+        int before_ms = _request_ms;
+        _request_ms = -1;
+        _mutex.unlock();
+
+        QElapsedTimer timer;
+        timer.start();
+        int frames = refill(ctx, codec, pkt, frame, before_ms);
+        if (frames > 0) {
+            _history->addRefill(frames, timer.elapsed());
+        }
+
+        _mutex.lock();
+    }
+    _mutex.unlock();
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&codec);
+    avformat_close_input(&ctx);
+}
+
+// Decodes from the keyframe before before_ms up to it, returns the number of frames added
+int GopRefill::refill(AVFormatContext *ctx, AVCodecContext *codec, AVPacket *pkt, AVFrame *frame, int before_ms)
+{
+    int index = _stream_index;
+    AVStream *stream = ctx->streams[index];
+    AVRational millisecondbase = { 1, 1000 };
+
+    KeyframeIndex::Entry kf;
+    KeyframeIndex *kf_index = _keyframe_index;
+    bool ok = (kf_index != nullptr && kf_index->lookup(before_ms - 1, true, kf) &&
+               av_seek_frame(ctx, -1, kf.pos, AVSEEK_FLAG_BYTE) >= 0);
+    if (!ok) {
+        int64_t ts = av_rescale_q(before_ms - 1, millisecondbase, stream->time_base);
+        ok = (avformat_seek_file(ctx, index, INT64_MIN, ts, ts, 0) >= 0);
+    }
+    if (!ok) {
+        return 0;
+    }
+
+    avcodec_flush_buffers(codec);
+
+    int added = 0;
+    bool done = false;
+    while(!done && !superseded() && av_read_frame(ctx, pkt) >= 0) {
+        if (pkt->stream_index == index && avcodec_send_packet(codec, pkt) >= 0) {
+            int64_t pkt_dts = pkt->dts;
+            while(avcodec_receive_frame(codec, frame) == 0) {
+                int64_t ts = (frame->best_effort_timestamp != AV_NOPTS_VALUE) ? frame->best_effort_timestamp : pkt_dts;
+                int position_in_ms = av_rescale_q(ts, stream->time_base, millisecondbase);
+                if (position_in_ms >= before_ms) {
+                    done = true;    // frames come in presentation order, the rest is known
+                } else if (_history->add(position_in_ms, frame)) {
+                    added += 1;
+                }
+                av_frame_unref(frame);
+            }
+        }
+        av_packet_unref(pkt);
+    }
+
+    return added;
+}
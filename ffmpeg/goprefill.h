@@ -0,0 +1,62 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Decodes the GOP before the frame history in the background, for backward frame steps.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef GOPREFILL_H
+#define GOPREFILL_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QString>
+
+struct AVFormatContext;
+struct AVCodecContext;
+struct AVCodecParameters;
+struct AVPacket;
+struct AVFrame;
+class KeyframeIndex;
+class FrameHistory;
+
+/*
+ * Decodes the GOP before a position into the frame history, with its own demuxer
+ * and decoder, so backward steps find their frames decoded already. A request
+ * replaces the pending one, the one being decoded is given up for it.
+ */
+class GopRefill : public QThread
+{
+private:
+    QString              _file;
+    int                  _stream_index;
+    const AVCodecParameters *_par;      // of the player's stream, valid while the refill runs
+    KeyframeIndex       *_keyframe_index;   // nullptr when not indexed
+    FrameHistory        *_history;
+    QMutex               _mutex;
+    QWaitCondition       _cond;
+    int                  _request_ms;   // decode the frames before this position, -1 = none
+    bool                 _run;
+
+public:
+    // file as given to avformat_open_input(), the frames of stream_index are added to history
+    GopRefill(const QString &file, int stream_index, const AVCodecParameters *par,
+              KeyframeIndex *keyframe_index, FrameHistory *history);
+
+public:
+    void request(int before_ms);
+    void stop();
+
+protected:
+    virtual void run() override;
+
+private:
+    int refill(AVFormatContext *ctx, AVCodecContext *codec, AVPacket *pkt, AVFrame *frame, int before_ms);
+    bool superseded();
+};
+
+#endif // GOPREFILL_H
@@ -0,0 +1,264 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Keyframe index (pts -> byte offset) of a media file, built in the
+ * background and cached on disk, so seeks don't need a bisection over
+ * the file for containers without an index of their own.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "keyframeindex.h"
+
+#include <QElapsedTimer>
+#include <QStandardPaths>
+#include <QSaveFile>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDir>
+#include <QDataStream>
+#include <QCryptographicHash>
+
+#include <algorithm>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#define INDEX_MAGIC 0x4b464931          // "KFI1"
+#define INDEX_VERSION 1
+#define AUDIO_ENTRY_INTERVAL_MS 500     // all audio packets are keyframes, one entry per interval is enough
+
+KeyframeIndex::KeyframeIndex(const QString &file, int stream_index)
+{
+    _file = file;
+    _stream_index = stream_index;
+    _abort = 0;
+    _state = Building;
+}
+
+KeyframeIndex::~KeyframeIndex()
+{
+    stop();
+}
+
+void KeyframeIndex::stop()
+{
+    _abort = 1;
+    wait();
+}
+
+KeyframeIndex::State KeyframeIndex::state() const
+{
+    return static_cast<State>(_state.loadAcquire());
+}
+
+bool KeyframeIndex::lookup(qint64 ts_ms, bool at_or_before, Entry &e)
+{
+    if (state() != Ready) {
+        return false;
+    }
+
+    _mutex.lock();
+
+    // first entry after ts_ms
+    int lo = 0, hi = _entries.size();
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (_entries[mid].ts_ms <= ts_ms) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+
+    bool found = true;
+    if (at_or_before || lo == _entries.size()) {
+        if (lo > 0) { e = _entries[lo - 1]; }
+        else { found = false; }
+    } else if (lo == 0) {
+        e = _entries[0];
+    } else {
+        const Entry &before = _entries[lo - 1];
+        const Entry &after = _entries[lo];
+        e = ((ts_ms - before.ts_ms) <= (after.ts_ms - ts_ms)) ? before : after;
+    }
+
+    if (found) { _lookups++; }
+
+    _mutex.unlock();
+
+    return found;
+}
+
+QVariantMap KeyframeIndex::statistics() const
+{
+    const char *states[] = { "building", "ready", "failed" };
+
+    QVariantMap m;
+    _mutex.lock();
+    m["state"] = states[state()];
+    m["entries"] = _entries.size();
+    m["from_cache"] = _from_cache;
+    m["build_ms"] = _build_ms;
+    m["lookups"] = _lookups;
+    _mutex.unlock();
+    return m;
+}
+
+QString KeyframeIndex::cacheDir()
+{
+    QString dir = qEnvironmentVariable("FFMPEG_PLUGIN_CACHE_DIR");
+    if (dir.isEmpty()) {
+        dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/ffmpeg-plugin";
+    }
+    return dir;
+}
+
+QString KeyframeIndex::cacheKey(const QString &file, AVFormatContext *ctx)
+{
+    QString key = file;
+    key += "|" + QString::number((ctx->pb != nullptr) ? avio_size(ctx->pb) : -1);
+    QFileInfo fi(file);
+    if (fi.exists()) {
+        key += "|" + QString::number(fi.lastModified().toMSecsSinceEpoch());
+    }
+    return QString::fromLatin1(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex());
+}
+
+int KeyframeIndex::interrupt(void *opaque)
+{
+    KeyframeIndex *me = static_cast<KeyframeIndex *>(opaque);
+    return me->_abort.loadAcquire();
+}
+
+void KeyframeIndex::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    AVFormatContext *ctx = avformat_alloc_context();
+    if (ctx == nullptr) {
+        _state = Failed;
+        return;
+    }
+    ctx->interrupt_callback.callback = interrupt;
+    ctx->interrupt_callback.opaque = this;
+
+    // Frees ctx on failure
+    if (avformat_open_input(&ctx, _file.toLocal8Bit().constData(), nullptr, nullptr) != 0) {
+        _state = Failed;
+        return;
+    }
+
+    QString cache_file = cacheDir() + "/keyframes/" + cacheKey(_file, ctx) + "-" + QString::number(_stream_index) + ".idx";
+
+    if (load(cache_file)) {
+        avformat_close_input(&ctx);
+        _mutex.lock();
+        _from_cache = true;
+        _build_ms = timer.elapsed();
+        _mutex.unlock();
+        _state = Ready;
+        return;
+    }
+
+    QVector<Entry> entries;
+    AVRational ms = { 1, 1000 };
+    qint64 last_audio_ms = 0;
+    AVPacket *pkt = av_packet_alloc();
+    int res = 0;
+
+    while(!_abort && (res = av_read_frame(ctx, pkt)) >= 0) {
+        if (pkt->stream_index == _stream_index && (pkt->flags & AV_PKT_FLAG_KEY) && pkt->pos >= 0) {
+            int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+            if (ts != AV_NOPTS_VALUE) {
+                AVStream *st = ctx->streams[_stream_index];
+                qint64 ts_ms = av_rescale_q(ts, st->time_base, ms);
+                bool audio = (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO);
+                if (!audio || entries.isEmpty() || (ts_ms - last_audio_ms) >= AUDIO_ENTRY_INTERVAL_MS) {
+                    Entry e = { ts_ms, pkt->pos };
+                    entries.append(e);
+                    last_audio_ms = ts_ms;
+                }
+            }
+        }
+        av_packet_unref(pkt);
+    }
+
+    av_packet_free(&pkt);
+    avformat_close_input(&ctx);
+
+    // An incomplete index would send seeks past its end to the wrong place
+    if (_abort || res != AVERROR_EOF || entries.isEmpty()) {
+        _state = Failed;
+        return;
+    }
+
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.ts_ms < b.ts_ms;
+    });
+
+    _mutex.lock();
+    _entries = entries;
+    _from_cache = false;
+    _build_ms = timer.elapsed();
+    _mutex.unlock();
+    _state = Ready;
+
+    save(cache_file);
+}
+
+bool KeyframeIndex::load(const QString &cache_file)
+{
+    QFile f(cache_file);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream in(&f);
+    quint32 magic, version;
+    qint32 count;
+    in >> magic >> version >> count;
+    if (magic != INDEX_MAGIC || version != INDEX_VERSION || count <= 0) {
+        return false;
+    }
+
+    QVector<Entry> entries;
+    entries.reserve(count);
+    for(int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        Entry e;
+        in >> e.ts_ms >> e.pos;
+        entries.append(e);
+    }
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    _mutex.lock();
+    _entries = entries;
+    _mutex.unlock();
+
+    return true;
+}
+
+void KeyframeIndex::save(const QString &cache_file)
+{
+    QDir().mkpath(QFileInfo(cache_file).absolutePath());
+
+    QSaveFile f(cache_file);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return;
+    }
+
+    QDataStream out(&f);
+    _mutex.lock();
+    out << quint32(INDEX_MAGIC) << quint32(INDEX_VERSION) << qint32(_entries.size());
+    for(const Entry &e : _entries) {
+        out << e.ts_ms << e.pos;
+    }
+    _mutex.unlock();
+
+    f.commit();
+}
@@ -0,0 +1,80 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Keyframe index (pts -> byte offset) of a media file, built in the
+ * background and cached on disk, so seeks don't need a bisection over
+ * the file for containers without an index of their own.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef KEYFRAMEINDEX_H
+#define KEYFRAMEINDEX_H
+
+#include <QThread>
+#include <QMutex>
+#include <QVector>
+#include <QVariantMap>
+#include <QAtomicInt>
+
+struct AVFormatContext;
+
+class KeyframeIndex : public QThread
+{
+public:
+    struct Entry
+    {
+        qint64 ts_ms;
+        qint64 pos;
+    };
+
+    enum State {
+        Building = 0,
+        Ready = 1,
+        Failed = 2
+    };
+
+private:
+    QString         _file;
+    int             _stream_index;
+    QAtomicInt      _abort;
+    QAtomicInt      _state;
+
+    mutable QMutex  _mutex;         // protects the members below
+    QVector<Entry>  _entries;       // sorted by ts_ms, only filled when Ready
+    bool            _from_cache = false;
+    qint64          _build_ms = 0;
+    qint64          _lookups = 0;
+
+public:
+    // file as given to avformat_open_input(), stream_index is the stream to index
+    KeyframeIndex(const QString &file, int stream_index);
+   ~KeyframeIndex();
+
+public:
+    void stop();
+    State state() const;
+
+    // The keyframe at or before ts_ms, or the nearest one. False when the index isn't ready.
+    bool lookup(qint64 ts_ms, bool at_or_before, Entry &e);
+
+    QVariantMap statistics() const;
+
+    static QString cacheDir();
+
+    // Names the cache entries of file, opened as ctx: a hash of the file,
+    // its size and, for local files, the modification time
+    static QString cacheKey(const QString &file, AVFormatContext *ctx);
+
+protected:
+    virtual void run() override;
+
+private:
+    bool load(const QString &cache_file);
+    void save(const QString &cache_file);
+    static int interrupt(void *opaque);
+};
+
+#endif // KEYFRAMEINDEX_H
@@ -0,0 +1,316 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Disk cache of the byte ranges of network media that have been read,
+ * so replays and seeks into them don't go to the network.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "mediacache.h"
+#include "keyframeindex.h"
+
+#include <QSaveFile>
+#include <QLockFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDataStream>
+#include <QPair>
+#include <QCryptographicHash>
+
+#define CACHE_MAGIC 0x4d435231          // "MCR1"
+#define CACHE_VERSION 1
+#define CACHE_SAVE_BYTES (8 * 1024 * 1024)  // the ranges are saved, and the cache trimmed, after this much is written
+
+MediaCache::MediaCache(const QString &url, const QString &validator, qint64 max_bytes)
+{
+    _url = url;
+    _validator = validator;
+    _max_bytes = max_bytes;
+    _lock = nullptr;
+    _unsaved = 0;
+    _full = false;
+
+    QString hash = QString::fromLatin1(QCryptographicHash::hash(url.toUtf8(), QCryptographicHash::Sha1).toHex());
+    _base = KeyframeIndex::cacheDir() + "/http/" + hash;
+}
+
+MediaCache::~MediaCache()
+{
+    if (_data.isOpen()) {
+        saveRanges();
+        _data.close();
+    }
+    if (_lock != nullptr) {
+        _lock->unlock();
+        delete _lock;
+    }
+}
+
+bool MediaCache::open()
+{
+    QDir().mkpath(QFileInfo(_base).absolutePath());
+
+    // A player may play for hours, the lock is only stale when its process is gone
+    _lock = new QLockFile(_base + ".lock");
+    _lock->setStaleLockTime(0);
+    if (!_lock->tryLock(0)) {
+        delete _lock;
+        _lock = nullptr;
+        return false;
+    }
+
+    _data.setFileName(_base + ".data");
+    if (!_data.open(QIODevice::ReadWrite)) {
+        return false;
+    }
+
+    // Another version of the media, or no entry yet
+    if (!loadRanges()) {
+        _data.resize(0);
+        _mutex.lock();
+        _ranges.clear();
+        _mutex.unlock();
+    }
+
+    evict(_max_bytes - cachedBytes());
+    _full = (cachedBytes() >= _max_bytes);
+
+    // Also marks the entry as used most recently
+    saveRanges();
+
+    return true;
+}
+
+int MediaCache::read(qint64 at, char *data, int n)
+{
+    qint64 available = 0;
+
+    _mutex.lock();
+    for(const Range &r : _ranges) {
+        if (r.start > at) {
+            break;
+        }
+        if (at < r.end) {
+            available = r.end - at;
+            break;
+        }
+    }
+    if (available == 0) {
+        _misses += 1;
+    }
+    _mutex.unlock();
+
+    if (available == 0 || !_data.seek(at)) {
+        return 0;
+    }
+
+    qint64 got = _data.read(data, qMin(static_cast<qint64>(n), available));
+    if (got <= 0) {
+        return 0;
+    }
+
+    _mutex.lock();
+    _hits += 1;
+    _hit_bytes += got;
+    _mutex.unlock();
+
+    return static_cast<int>(got);
+}
+
+void MediaCache::write(qint64 at, const char *data, int n)
+{
+    if (_full) {
+        return;
+    }
+
+    // Seeking past the end leaves a hole, which stays sparse on most file systems
+    if (!_data.seek(at) || _data.write(data, n) != n) {
+        _full = true;       // e.g. the disk is full, playback goes on from the network
+        return;
+    }
+
+    _mutex.lock();
+    addRange(at, at + n);
+    _stored_bytes += n;
+    _mutex.unlock();
+
+    _unsaved += n;
+    if (_unsaved >= CACHE_SAVE_BYTES) {
+        saveRanges();
+        evict(_max_bytes - cachedBytes());
+    }
+
+    _full = (cachedBytes() >= _max_bytes);
+}
+
+QVariantMap MediaCache::statistics() const
+{
+    qint64 cached = cachedBytes();
+
+    QVariantMap m;
+    _mutex.lock();
+    m["max_bytes"] = _max_bytes;
+    m["cached_bytes"] = cached;
+    m["ranges"] = _ranges.size();
+    m["hits"] = _hits;
+    m["misses"] = _misses;
+    m["hit_bytes"] = _hit_bytes;
+    m["stored_bytes"] = _stored_bytes;
+    m["evictions"] = _evictions;
+    _mutex.unlock();
+    return m;
+}
+
+qint64 MediaCache::maxBytes()
+{
+    int mb = qEnvironmentVariableIntValue("FFMPEG_PLUGIN_HTTP_CACHE_MB");
+    return (mb > 0) ? static_cast<qint64>(mb) * 1024 * 1024 : 0;
+}
+
+qint64 MediaCache::cachedBytes() const
+{
+    qint64 bytes = 0;
+    _mutex.lock();
+    for(const Range &r : _ranges) {
+        bytes += r.end - r.start;
+    }
+    _mutex.unlock();
+    return bytes;
+}
+
+bool MediaCache::loadRanges()
+{
+    QFile f(_base + ".ranges");
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream in(&f);
+    quint32 magic, version;
+    qint64 cached;
+    QString url, validator;
+    qint32 count;
+    in >> magic >> version >> cached >> url >> validator >> count;
+    if (magic != CACHE_MAGIC || version != CACHE_VERSION || url != _url || validator != _validator || count < 0) {
+        return false;
+    }
+
+    QVector<Range> ranges;
+    ranges.reserve(count);
+    for(int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        Range r;
+        in >> r.start >> r.end;
+        if (r.end <= r.start || (!ranges.isEmpty() && r.start <= ranges.last().end)) {
+            return false;
+        }
+        ranges.append(r);
+    }
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    _mutex.lock();
+    _ranges = ranges;
+    _mutex.unlock();
+
+    return true;
+}
+
+// The ranges only claim data that has been flushed to the data file
+void MediaCache::saveRanges()
+{
+    _data.flush();
+
+    QSaveFile f(_base + ".ranges");
+    if (!f.open(QIODevice::WriteOnly)) {
+        return;
+    }
+
+    qint64 cached = cachedBytes();
+
+    QDataStream out(&f);
+    _mutex.lock();
+    out << quint32(CACHE_MAGIC) << quint32(CACHE_VERSION) << cached << _url << _validator << qint32(_ranges.size());
+    for(const Range &r : _ranges) {
+        out << r.start << r.end;
+    }
+    _mutex.unlock();
+
+    if (f.commit()) {
+        _unsaved = 0;
+    }
+}
+
+// Caller holds _mutex
+void MediaCache::addRange(qint64 start, qint64 end)
+{
+    Range n = { start, end };
+    QVector<Range> merged;
+    bool placed = false;
+
+    for(const Range &r : _ranges) {
+        if (r.end < n.start) {
+            merged.append(r);
+        } else if (r.start > n.end) {
+            if (!placed) {
+                merged.append(n);
+                placed = true;
+            }
+            merged.append(r);
+        } else {
+            n.start = qMin(n.start, r.start);
+            n.end = qMax(n.end, r.end);
+        }
+    }
+    if (!placed) {
+        merged.append(n);
+    }
+
+    _ranges = merged;
+}
+
+// Removes the least recently used other entries till they take at most max_others bytes.
+// The modification time of the ranges file is the last use of an entry.
+void MediaCache::evict(qint64 max_others)
+{
+    QDir dir(QFileInfo(_base).absolutePath());
+    QFileInfoList entries = dir.entryInfoList(QStringList() << "*.ranges", QDir::Files, QDir::Time | QDir::Reversed);
+    QString own = QFileInfo(_base + ".ranges").fileName();
+
+    QVector<QPair<QString, qint64>> others;     // base path and cached bytes, least recently used first
+    qint64 total = 0;
+    for(const QFileInfo &fi : entries) {
+        if (fi.fileName() == own) {
+            continue;
+        }
+        QFile f(fi.absoluteFilePath());
+        quint32 magic = 0, version = 0;
+        qint64 bytes = 0;
+        if (f.open(QIODevice::ReadOnly)) {
+            QDataStream in(&f);
+            in >> magic >> version >> bytes;
+        }
+        others.append(qMakePair(fi.absolutePath() + "/" + fi.completeBaseName(), (magic == CACHE_MAGIC) ? bytes : 0));
+        total += others.last().second;
+    }
+
+    for(int i = 0; i < others.size() && total > qMax(static_cast<qint64>(0), max_others); i++) {
+        const QString &base = others[i].first;
+        QLockFile lock(base + ".lock");
+        lock.setStaleLockTime(0);
+        if (!lock.tryLock(0)) {
+            continue;       // played by someone else
+        }
+        QFile::remove(base + ".ranges");
+        QFile::remove(base + ".data");
+        lock.unlock();
+        total -= others[i].second;
+
+        _mutex.lock();
+        _evictions += 1;
+        _mutex.unlock();
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Disk cache of the byte ranges of network media that have been read,
+ * so replays and seeks into them don't go to the network.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef MEDIACACHE_H
+#define MEDIACACHE_H
+
+#include <QFile>
+#include <QMutex>
+#include <QVector>
+#include <QVariantMap>
+
+class QLockFile;
+
+/*
+ * One cached url. The data is kept in a sparse file at its own offsets, the
+ * ranges that have been written are kept next to it. An entry is only used
+ * while its validator matches, otherwise it starts empty. Entries are evicted
+ * least recently used first, when the cache would grow past its size.
+ *
+ * read() and write() are called by one thread, statistics() by any.
+ */
+class MediaCache
+{
+public:
+    struct Range
+    {
+        qint64 start;       // bytes [start, end)
+        qint64 end;
+    };
+
+private:
+    QString         _url;
+    QString         _validator;
+    qint64          _max_bytes;
+    QString         _base;          // path of the entry without extension
+    QFile           _data;
+    QLockFile      *_lock;          // a url is cached by one player at a time
+    qint64          _unsaved;       // bytes written since the ranges were saved
+    bool            _full;          // the entry itself reached the cache size
+
+    mutable QMutex  _mutex;         // protects the members below
+    QVector<Range>  _ranges;        // sorted, disjoint and not adjacent
+    qint64          _hits = 0;      // reads served from disk
+    qint64          _misses = 0;
+    qint64          _hit_bytes = 0;
+    qint64          _stored_bytes = 0;
+    qint64          _evictions = 0;
+
+public:
+    // validator identifies the version of the media, e.g. its size and content type
+    MediaCache(const QString &url, const QString &validator, qint64 max_bytes);
+   ~MediaCache();
+
+public:
+    // False when the entry is in use or can't be created
+    bool open();
+
+    // Reads cached data at offset at, 0 when it's not cached
+    int read(qint64 at, char *data, int n);
+
+    // Stores data read from the network
+    void write(qint64 at, const char *data, int n);
+
+    QVariantMap statistics() const;
+
+    // FFMPEG_PLUGIN_HTTP_CACHE_MB, 0 when caching is off
+    static qint64 maxBytes();
+
+private:
+    qint64 cachedBytes() const;
+    bool loadRanges();
+    void saveRanges();
+    void addRange(qint64 start, qint64 end);
+    void evict(qint64 max_others);
+};
+
+#endif // MEDIACACHE_H
@@ -0,0 +1,205 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Opens and probes the media off the GUI thread.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "mediaopener.h"
+#include "readaheadavio.h"
+#include "probecache.h"
+
+#include <QElapsedTimer>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+}
+
+MediaOpener::MediaOpener(FFmpegProvider *p, int serial, const QString &url, const QString &file,
+                         AVIOContext *pb, qint64 read_ahead_bytes, QAtomicInt *seek_pending)
+{
+    _provider = p;
+    _serial = serial;
+    _url = url;
+    _file = file;
+    _pb = pb;
+    _read_ahead_bytes = read_ahead_bytes;
+    _seek_pending = seek_pending;
+    _abort = 0;
+    _read_ahead = nullptr;
+    _ctx = nullptr;
+    _error = FFmpegProvider::NoError;
+    _open_ms = -1;
+    _probe_ms = -1;
+    _probe_cached = false;
+}
+
+MediaOpener::~MediaOpener()
+{
+    if (_ctx != nullptr) {
+        avformat_close_input(&_ctx);
+    }
+    delete _read_ahead;     // after the format context, which reads from it
+}
+
+int MediaOpener::serial() const
+{
+    return _serial;
+}
+
+const QString &MediaOpener::url() const
+{
+    return _url;
+}
+
+const QString &MediaOpener::file() const
+{
+    return _file;
+}
+
+void MediaOpener::cancel()
+{
+    _abort = 1;
+    _mutex.lock();
+    if (_read_ahead != nullptr) {
+        _read_ahead->abort();
+    }
+    _mutex.unlock();
+}
+
+AVFormatContext *MediaOpener::takeFormatContext()
+{
+    AVFormatContext *ctx = _ctx;
+    if (ctx != nullptr) {
+        ctx->interrupt_callback.callback = nullptr;     // we're gone
+        ctx->interrupt_callback.opaque = nullptr;
+    }
+    _ctx = nullptr;
+    return ctx;
+}
+
+ReadAheadAVIO *MediaOpener::takeReadAhead()
+{
+    ReadAheadAVIO *r = _read_ahead;
+    _read_ahead = nullptr;
+    return r;
+}
+
+FFmpegProvider::Error MediaOpener::error() const
+{
+    return _error;
+}
+
+const QString &MediaOpener::message() const
+{
+    return _message;
+}
+
+qint64 MediaOpener::openMs() const
+{
+    return _open_ms;
+}
+
+qint64 MediaOpener::probeMs() const
+{
+    return _probe_ms;
+}
+
+bool MediaOpener::probeCached() const
+{
+    return _probe_cached;
+}
+
+void MediaOpener::run()
+{
+    _ctx = avformat_alloc_context();
+    if (_ctx == nullptr) {
+        _error = FFmpegProvider::CantAlloc;
+        _message = FFmpegProvider::tr("Not enough memory");
+        _provider->signalMediaOpened(_serial);
+        return;
+    }
+    _ctx->interrupt_callback.callback = interrupt;
+    _ctx->interrupt_callback.opaque = this;
+
+    if (_pb != nullptr) {
+        _ctx->pb = _pb;
+        _ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    if (_read_ahead_bytes > 0) {
+        ReadAheadAVIO *read_ahead = new ReadAheadAVIO(_file, _read_ahead_bytes, _seek_pending);
+        _mutex.lock();
+        _read_ahead = read_ahead;
+        if (_abort) {
+            read_ahead->abort();
+        }
+        _mutex.unlock();
+
+        if (!read_ahead->open()) {
+            avformat_free_context(_ctx);
+            _ctx = nullptr;
+            _error = FFmpegProvider::CannotOpenVideo;
+            _message = FFmpegProvider::tr("Cannot open the Url %1").arg(_url);
+            _provider->signalMediaOpened(_serial);
+            return;
+        }
+        _ctx->pb = read_ahead->context();
+        _ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    // Fast start, how much is read to find the streams and their parameters
+    AVDictionary *opts = nullptr;
+    int probesize = qEnvironmentVariableIntValue("FFMPEG_PLUGIN_PROBESIZE");
+    if (probesize >= 32) {
+        av_dict_set_int(&opts, "probesize", probesize, 0);
+    }
+    int analyze_ms = qEnvironmentVariableIntValue("FFMPEG_PLUGIN_ANALYZEDURATION_MS");
+    if (analyze_ms > 0) {
+        av_dict_set_int(&opts, "analyzeduration", static_cast<int64_t>(analyze_ms) * 1000, 0);
+    }
+    int fpsprobesize = qEnvironmentVariableIntValue("FFMPEG_PLUGIN_FPSPROBESIZE");
+    if (fpsprobesize > 0) {
+        av_dict_set_int(&opts, "fpsprobesize", fpsprobesize, 0);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Frees the context when it fails
+    int res = avformat_open_input(&_ctx, _file.toLocal8Bit().constData(), nullptr, &opts);
+    av_dict_free(&opts);
+    _open_ms = timer.restart();
+    if (res != 0) {
+        _ctx = nullptr;
+        _error = FFmpegProvider::CannotOpenVideo;
+        _message = FFmpegProvider::tr("Cannot open the Url %1").arg(_url);
+        _provider->signalMediaOpened(_serial);
+        return;
+    }
+
+    // Known media takes its streams from the probe cache, streams have no stable url
+    bool cacheable = (_pb == nullptr && ProbeCache::enabled());
+    if (cacheable && ProbeCache(_file, _ctx).apply(_ctx)) {
+        _probe_cached = true;
+    } else if (avformat_find_stream_info(_ctx, nullptr) < 0) {
+        avformat_close_input(&_ctx);
+        _error = FFmpegProvider::CannotFindStreamInfo;
+        _message = FFmpegProvider::tr("Cannot determine the stream information for %1").arg(_url);
+    } else if (cacheable && !_abort) {
+        ProbeCache(_file, _ctx).store(_ctx);
+    }
+    _probe_ms = timer.elapsed();
+
+    _provider->signalMediaOpened(_serial);
+}
+
+int MediaOpener::interrupt(void *opaque)
+{
+    MediaOpener *me = static_cast<MediaOpener *>(opaque);
+    return me->_abort.loadAcquire();
+}
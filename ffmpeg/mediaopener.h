@@ -0,0 +1,77 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Opens and probes the media off the GUI thread.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef MEDIAOPENER_H
+#define MEDIAOPENER_H
+
+#include "ffmpegprovider.h"
+
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QString>
+
+struct AVFormatContext;
+struct AVIOContext;
+class ReadAheadAVIO;
+
+/*
+ * Opens and probes the media for setMedia(), which can take seconds for a network url.
+ * The GUI thread takes the result when it's signalled, or cancels the open, which ends
+ * the blocking ffmpeg calls through the interrupt callback.
+ */
+class MediaOpener : public QThread
+{
+private:
+    FFmpegProvider      *_provider;
+    int                  _serial;
+    QString              _url;
+    QString              _file;
+    AVIOContext         *_pb;               // of a stream, nullptr otherwise
+    qint64               _read_ahead_bytes; // network url, 0 = no read ahead
+    QAtomicInt          *_seek_pending;
+    QAtomicInt           _abort;
+    QMutex               _mutex;            // protects _read_ahead while it opens
+    ReadAheadAVIO       *_read_ahead;
+    AVFormatContext     *_ctx;
+    FFmpegProvider::Error _error;
+    QString              _message;
+    qint64               _open_ms;          // avformat_open_input()
+    qint64               _probe_ms;         // avformat_find_stream_info() or the probe cache
+    bool                 _probe_cached;
+
+public:
+    MediaOpener(FFmpegProvider *p, int serial, const QString &url, const QString &file,
+                AVIOContext *pb, qint64 read_ahead_bytes, QAtomicInt *seek_pending);
+   ~MediaOpener();
+
+public:
+    int serial() const;
+    const QString &url() const;
+    const QString &file() const;
+    void cancel();
+
+    // After the thread has finished. The caller owns what's taken.
+    AVFormatContext *takeFormatContext();
+    ReadAheadAVIO *takeReadAhead();
+    FFmpegProvider::Error error() const;
+    const QString &message() const;
+    qint64 openMs() const;
+    qint64 probeMs() const;
+    bool probeCached() const;
+
+protected:
+    virtual void run() override;
+
+private:
+    static int interrupt(void *opaque);
+};
+
+#endif // MEDIAOPENER_H
@@ -0,0 +1,290 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Stream layout and codec parameters of probed media, cached on disk,
+ * so opening known media doesn't need avformat_find_stream_info().
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "probecache.h"
+#include "keyframeindex.h"
+
+#include <QSaveFile>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDataStream>
+#include <QVector>
+
+#include <string.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#define PROBE_MAGIC 0x50524331          // "PRC1"
+#define PROBE_VERSION 1
+#define PROBE_MAX_EXTRADATA (1024 * 1024)
+
+// What avformat_find_stream_info() fills in for a stream
+struct ProbeStream
+{
+    qint32 codec_type;
+    qint32 codec_id;
+    quint32 codec_tag;
+    QByteArray extradata;
+    qint32 format;
+    qint64 bit_rate;
+    qint32 bits_per_coded_sample;
+    qint32 bits_per_raw_sample;
+    qint32 profile;
+    qint32 level;
+    qint32 width;
+    qint32 height;
+    qint32 sar_num, sar_den;
+    qint32 field_order;
+    qint32 color_range;
+    qint32 color_primaries;
+    qint32 color_trc;
+    qint32 color_space;
+    qint32 chroma_location;
+    qint32 video_delay;
+    quint64 channel_layout;
+    qint32 channels;
+    qint32 sample_rate;
+    qint32 block_align;
+    qint32 frame_size;
+    qint32 initial_padding;
+    qint32 trailing_padding;
+    qint32 seek_preroll;
+    qint32 tb_num, tb_den;
+    qint64 start_time;
+    qint64 duration;
+    qint64 nb_frames;
+    qint32 disposition;
+    qint32 stream_sar_num, stream_sar_den;
+    qint32 avg_fr_num, avg_fr_den;
+    qint32 r_fr_num, r_fr_den;
+};
+
+static QDataStream &operator<<(QDataStream &out, const ProbeStream &s)
+{
+    out << s.codec_type << s.codec_id << s.codec_tag << s.extradata << s.format << s.bit_rate
+        << s.bits_per_coded_sample << s.bits_per_raw_sample << s.profile << s.level
+        << s.width << s.height << s.sar_num << s.sar_den << s.field_order
+        << s.color_range << s.color_primaries << s.color_trc << s.color_space << s.chroma_location << s.video_delay
+        << s.channel_layout << s.channels << s.sample_rate << s.block_align << s.frame_size
+        << s.initial_padding << s.trailing_padding << s.seek_preroll
+        << s.tb_num << s.tb_den << s.start_time << s.duration << s.nb_frames << s.disposition
+        << s.stream_sar_num << s.stream_sar_den << s.avg_fr_num << s.avg_fr_den << s.r_fr_num << s.r_fr_den;
+    return out;
+}
+
+static QDataStream &operator>>(QDataStream &in, ProbeStream &s)
+{
+    in >> s.codec_type >> s.codec_id >> s.codec_tag >> s.extradata >> s.format >> s.bit_rate
+       >> s.bits_per_coded_sample >> s.bits_per_raw_sample >> s.profile >> s.level
+       >> s.width >> s.height >> s.sar_num >> s.sar_den >> s.field_order
+       >> s.color_range >> s.color_primaries >> s.color_trc >> s.color_space >> s.chroma_location >> s.video_delay
+       >> s.channel_layout >> s.channels >> s.sample_rate >> s.block_align >> s.frame_size
+       >> s.initial_padding >> s.trailing_padding >> s.seek_preroll
+       >> s.tb_num >> s.tb_den >> s.start_time >> s.duration >> s.nb_frames >> s.disposition
+       >> s.stream_sar_num >> s.stream_sar_den >> s.avg_fr_num >> s.avg_fr_den >> s.r_fr_num >> s.r_fr_den;
+    return in;
+}
+
+// A parameter the demuxer declared must have the cached value, 0 is not declared
+static bool declared(int demuxer, int cached)
+{
+    return demuxer == 0 || demuxer == cached;
+}
+
+ProbeCache::ProbeCache(const QString &file, AVFormatContext *ctx)
+{
+    _cache_file = KeyframeIndex::cacheDir() + "/probe/" + KeyframeIndex::cacheKey(file, ctx) + ".probe";
+}
+
+bool ProbeCache::apply(AVFormatContext *ctx) const
+{
+    QFile f(_cache_file);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream in(&f);
+    quint32 magic, version;
+    qint64 start_time, duration, bit_rate;
+    qint32 count;
+    in >> magic >> version >> start_time >> duration >> bit_rate >> count;
+    if (magic != PROBE_MAGIC || version != PROBE_VERSION || count <= 0 || static_cast<unsigned int>(count) != ctx->nb_streams) {
+        return false;
+    }
+
+    QVector<ProbeStream> streams;
+    streams.reserve(count);
+    for(int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        ProbeStream s;
+        in >> s;
+        streams.append(s);
+    }
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    // The demuxer must have found the same streams, with the codec known. A network url
+    // is only keyed by its size, so the dimensions and audio format the demuxer declares
+    // must match as well.
+    for(int i = 0; i < count; i++) {
+        const ProbeStream &s = streams[i];
+        const AVStream *st = ctx->streams[i];
+        const AVCodecParameters *par = st->codecpar;
+        if (par->codec_id == AV_CODEC_ID_NONE || par->codec_id != s.codec_id ||
+                par->codec_type != s.codec_type ||
+                st->time_base.num != s.tb_num || st->time_base.den != s.tb_den ||
+                s.extradata.size() > PROBE_MAX_EXTRADATA) {
+            return false;
+        }
+        if (!declared(par->width, s.width) || !declared(par->height, s.height) ||
+                !declared(par->sample_rate, s.sample_rate) || !declared(par->channels, s.channels)) {
+            return false;
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        const ProbeStream &s = streams[i];
+        AVStream *st = ctx->streams[i];
+        AVCodecParameters *par = st->codecpar;
+
+        if (!s.extradata.isEmpty()) {
+            uint8_t *extradata = static_cast<uint8_t *>(av_mallocz(s.extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+            if (extradata == nullptr) {
+                return false;
+            }
+            memcpy(extradata, s.extradata.constData(), s.extradata.size());
+            av_freep(&par->extradata);
+            par->extradata = extradata;
+            par->extradata_size = s.extradata.size();
+        }
+
+        par->codec_tag = s.codec_tag;
+        par->format = s.format;
+        par->bit_rate = s.bit_rate;
+        par->bits_per_coded_sample = s.bits_per_coded_sample;
+        par->bits_per_raw_sample = s.bits_per_raw_sample;
+        par->profile = s.profile;
+        par->level = s.level;
+        par->width = s.width;
+        par->height = s.height;
+        par->sample_aspect_ratio = { s.sar_num, s.sar_den };
+        par->field_order = static_cast<enum AVFieldOrder>(s.field_order);
+        par->color_range = static_cast<enum AVColorRange>(s.color_range);
+        par->color_primaries = static_cast<enum AVColorPrimaries>(s.color_primaries);
+        par->color_trc = static_cast<enum AVColorTransferCharacteristic>(s.color_trc);
+        par->color_space = static_cast<enum AVColorSpace>(s.color_space);
+        par->chroma_location = static_cast<enum AVChromaLocation>(s.chroma_location);
+        par->video_delay = s.video_delay;
+        par->channel_layout = s.channel_layout;
+        par->channels = s.channels;
+        par->sample_rate = s.sample_rate;
+        par->block_align = s.block_align;
+        par->frame_size = s.frame_size;
+        par->initial_padding = s.initial_padding;
+        par->trailing_padding = s.trailing_padding;
+        par->seek_preroll = s.seek_preroll;
+
+        st->start_time = s.start_time;
+        st->duration = s.duration;
+        st->nb_frames = s.nb_frames;
+        st->disposition = s.disposition;
+        st->sample_aspect_ratio = { s.stream_sar_num, s.stream_sar_den };
+        st->avg_frame_rate = { s.avg_fr_num, s.avg_fr_den };
+        st->r_frame_rate = { s.r_fr_num, s.r_fr_den };
+    }
+
+    ctx->start_time = start_time;
+    ctx->duration = duration;
+    ctx->bit_rate = bit_rate;
+
+    return true;
+}
+
+void ProbeCache::store(AVFormatContext *ctx) const
+{
+    if (ctx->nb_streams == 0) {
+        return;
+    }
+
+    QDir().mkpath(QFileInfo(_cache_file).absolutePath());
+
+    QSaveFile f(_cache_file);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return;
+    }
+
+    QDataStream out(&f);
+    out << quint32(PROBE_MAGIC) << quint32(PROBE_VERSION)
+        << qint64(ctx->start_time) << qint64(ctx->duration) << qint64(ctx->bit_rate) << qint32(ctx->nb_streams);
+
+    for(unsigned int i = 0; i < ctx->nb_streams; i++) {
+        const AVStream *st = ctx->streams[i];
+        const AVCodecParameters *par = st->codecpar;
+
+        ProbeStream s;
+        s.codec_type = par->codec_type;
+        s.codec_id = par->codec_id;
+        s.codec_tag = par->codec_tag;
+        if (par->extradata != nullptr && par->extradata_size > 0) {
+            s.extradata = QByteArray(reinterpret_cast<const char *>(par->extradata), par->extradata_size);
+        }
+        s.format = par->format;
+        s.bit_rate = par->bit_rate;
+        s.bits_per_coded_sample = par->bits_per_coded_sample;
+        s.bits_per_raw_sample = par->bits_per_raw_sample;
+        s.profile = par->profile;
+        s.level = par->level;
+        s.width = par->width;
+        s.height = par->height;
+        s.sar_num = par->sample_aspect_ratio.num;
+        s.sar_den = par->sample_aspect_ratio.den;
+        s.field_order = par->field_order;
+        s.color_range = par->color_range;
+        s.color_primaries = par->color_primaries;
+        s.color_trc = par->color_trc;
+        s.color_space = par->color_space;
+        s.chroma_location = par->chroma_location;
+        s.video_delay = par->video_delay;
+        s.channel_layout = par->channel_layout;
+        s.channels = par->channels;
+        s.sample_rate = par->sample_rate;
+        s.block_align = par->block_align;
+        s.frame_size = par->frame_size;
+        s.initial_padding = par->initial_padding;
+        s.trailing_padding = par->trailing_padding;
+        s.seek_preroll = par->seek_preroll;
+        s.tb_num = st->time_base.num;
+        s.tb_den = st->time_base.den;
+        s.start_time = st->start_time;
+        s.duration = st->duration;
+        s.nb_frames = st->nb_frames;
+        s.disposition = st->disposition;
+        s.stream_sar_num = st->sample_aspect_ratio.num;
+        s.stream_sar_den = st->sample_aspect_ratio.den;
+        s.avg_fr_num = st->avg_frame_rate.num;
+        s.avg_fr_den = st->avg_frame_rate.den;
+        s.r_fr_num = st->r_frame_rate.num;
+        s.r_fr_den = st->r_frame_rate.den;
+
+        out << s;
+    }
+
+    f.commit();
+}
+
+bool ProbeCache::enabled()
+{
+    return qgetenv("FFMPEG_PLUGIN_PROBE_CACHE") != "0";
+}
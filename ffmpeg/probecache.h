@@ -0,0 +1,46 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Stream layout and codec parameters of probed media, cached on disk,
+ * so opening known media doesn't need avformat_find_stream_info().
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef PROBECACHE_H
+#define PROBECACHE_H
+
+#include <QString>
+
+struct AVFormatContext;
+
+/*
+ * An entry is keyed like the keyframe index: by the url, its size and, for local
+ * files, the modification time. It's only applied when the streams the demuxer
+ * created while opening have the codecs and time bases of the cached ones, and the
+ * dimensions and audio format they declare. Containers that only create their
+ * streams while reading packets are always probed.
+ */
+class ProbeCache
+{
+private:
+    QString         _cache_file;
+
+public:
+    // file as given to avformat_open_input(), ctx opened from it
+    ProbeCache(const QString &file, AVFormatContext *ctx);
+
+public:
+    // Fills in the stream parameters of ctx, false when there's no matching entry
+    bool apply(AVFormatContext *ctx) const;
+
+    // Stores the stream parameters of ctx after avformat_find_stream_info()
+    void store(AVFormatContext *ctx) const;
+
+    // FFMPEG_PLUGIN_PROBE_CACHE, on unless it's 0
+    static bool enabled();
+};
+
+#endif // PROBECACHE_H
@@ -0,0 +1,292 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * An AVIOContext that reads from a QIODevice, for QMediaPlayer::setMedia()
+ * with a stream.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "qiodeviceavio.h"
+
+#include <QBuffer>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QByteArray>
+#include <string.h>
+#include <stdio.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+}
+
+#define AVIO_DEVICE_BUFFER_SIZE (256 * 1024)    // big reads from files and other devices
+#define AVIO_MEMORY_BUFFER_SIZE (32 * 1024)     // larger reads bypass the buffer
+#define AVIO_PUMP_MAX_BYTES (4 * 1024 * 1024)   // read from a sequential device ahead of the decoder
+
+/*
+ * Reads a sequential device on the thread it lives on, when it signals data,
+ * into a buffer for the decoder thread. Over its budget it leaves the data in
+ * the device, till the decoder thread has taken enough.
+ */
+class QIODevicePump : public QObject
+{
+private:
+    QIODevice      *_device;
+    QMutex          _mutex;         // protects the members below
+    QWaitCondition  _cond;          // data, end of the device, abort
+    QByteArray      _buffer;
+    int             _taken;         // bytes at the front of _buffer that have been read
+    bool            _finished;      // the device doesn't get more data
+    bool            _pull_pending;
+    bool            _abort;
+
+public:
+    explicit QIODevicePump(QIODevice *device);
+
+public:
+    // Decoder thread, waits for data. 0 at the end of the device, -1 when aborted
+    int take(char *data, int size);
+    void abort();
+
+private:
+    void pull();
+    void finish();
+};
+
+QIODevicePump::QIODevicePump(QIODevice *device)
+{
+    _device = device;
+    _taken = 0;
+    _finished = false;
+    _pull_pending = true;
+    _abort = false;
+
+    moveToThread(device->thread());
+    connect(device, &QIODevice::readyRead, this, [this] { pull(); });
+    connect(device, &QIODevice::readChannelFinished, this, [this] { finish(); });
+    connect(device, &QIODevice::aboutToClose, this, [this] { finish(); });
+
+    // Data that arrived before we were connected
+    QMetaObject::invokeMethod(this, [this] { pull(); }, Qt::QueuedConnection);
+}
+
+// Thread of the device
+void QIODevicePump::pull()
+{
+    _mutex.lock();
+    _pull_pending = false;
+    qint64 room = AVIO_PUMP_MAX_BYTES - (_buffer.size() - _taken);
+    _mutex.unlock();
+
+    qint64 n = qMin(room, _device->bytesAvailable());
+    QByteArray data = (n > 0) ? _device->read(n) : QByteArray();
+    bool at_end = !_device->isOpen();
+
+    _mutex.lock();
+    if (!data.isEmpty()) {
+        if (_taken > 0) {
+            _buffer.remove(0, _taken);
+            _taken = 0;
+        }
+        _buffer.append(data);
+    }
+    _finished = _finished || at_end;
+    _cond.wakeAll();
+    _mutex.unlock();
+}
+
+// Thread of the device
+void QIODevicePump::finish()
+{
+    pull();     // what's left in the device
+
+    _mutex.lock();
+    _finished = true;
+    _cond.wakeAll();
+    _mutex.unlock();
+}
+
+int QIODevicePump::take(char *data, int size)
+{
+    _mutex.lock();
+    while(_buffer.size() == _taken && !_finished && !_abort) {
+        _cond.wait(&_mutex);
+    }
+
+    int n = qMin(size, _buffer.size() - _taken);
+    if (n > 0) {
+        memcpy(data, _buffer.constData() + _taken, static_cast<size_t>(n));
+        _taken += n;
+    }
+    if (_abort) {
+        n = -1;
+    }
+
+    // Room for what the device holds back
+    bool pull = (!_pull_pending && !_finished && (_buffer.size() - _taken) < AVIO_PUMP_MAX_BYTES / 2);
+    if (pull) {
+        _pull_pending = true;
+    }
+    _mutex.unlock();
+
+    if (pull) {
+        QMetaObject::invokeMethod(this, [this] { this->pull(); }, Qt::QueuedConnection);
+    }
+
+    return n;
+}
+
+void QIODevicePump::abort()
+{
+    _mutex.lock();
+    _abort = true;
+    _cond.wakeAll();
+    _mutex.unlock();
+}
+
+QIODeviceAVIO::QIODeviceAVIO(QIODevice *device)
+{
+    _device = device;
+    _ctx = nullptr;
+    _data = nullptr;
+    _start = 0;
+    _size = -1;
+    _pos = 0;
+    _pump = nullptr;
+    _abort = 0;
+
+    if (!_device->isOpen() && !_device->open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QBuffer *buffer = qobject_cast<QBuffer *>(_device);
+    if (buffer != nullptr) {
+        const QByteArray &data = buffer->data();
+        _data = data.constData();
+        _start = buffer->pos();
+        _size = data.size() - _start;
+    } else if (!_device->isSequential()) {
+        _start = _device->pos();
+        _size = _device->size() - _start;
+    } else {
+        _pump = new QIODevicePump(_device);
+    }
+
+    int buffer_size = (isMemory()) ? AVIO_MEMORY_BUFFER_SIZE : AVIO_DEVICE_BUFFER_SIZE;
+    unsigned char *avio_buffer = static_cast<unsigned char *>(av_malloc(buffer_size));
+    if (avio_buffer == nullptr) {
+        return;
+    }
+
+    bool seekable = (_pump == nullptr);
+    _ctx = avio_alloc_context(avio_buffer, buffer_size, 0, this, read, nullptr, (seekable) ? seek : nullptr);
+    if (_ctx == nullptr) {
+        av_free(avio_buffer);
+        return;
+    }
+    _ctx->seekable = (seekable) ? AVIO_SEEKABLE_NORMAL : 0;
+}
+
+QIODeviceAVIO::~QIODeviceAVIO()
+{
+    if (_ctx != nullptr) {
+        av_freep(&_ctx->buffer);     // may have been replaced by ffmpeg
+        avio_context_free(&_ctx);
+    }
+    if (_pump != nullptr) {
+        _pump->deleteLater();       // on the thread of the device
+    }
+}
+
+AVIOContext *QIODeviceAVIO::context() const
+{
+    return _ctx;
+}
+
+bool QIODeviceAVIO::isMemory() const
+{
+    return _data != nullptr;
+}
+
+void QIODeviceAVIO::abort()
+{
+    _abort = 1;
+    if (_pump != nullptr) {
+        _pump->abort();
+    }
+}
+
+bool QIODeviceAVIO::rewind()
+{
+    if (isMemory()) {
+        _pos = 0;
+        return true;
+    }
+    return _pump == nullptr && _device->isOpen() && _device->seek(_start);
+}
+
+int QIODeviceAVIO::read(void *opaque, uint8_t *buf, int size)
+{
+    QIODeviceAVIO *me = static_cast<QIODeviceAVIO *>(opaque);
+
+    if (me->_abort) {
+        return AVERROR_EXIT;
+    }
+
+    if (me->isMemory()) {
+        qint64 n = qMin(static_cast<qint64>(size), me->_size - me->_pos);
+        if (n <= 0) {
+            return AVERROR_EOF;
+        }
+        memcpy(buf, me->_data + me->_start + me->_pos, static_cast<size_t>(n));
+        me->_pos += n;
+        return static_cast<int>(n);
+    }
+
+    if (me->_pump != nullptr) {
+        int n = me->_pump->take(reinterpret_cast<char *>(buf), size);
+        return (n > 0) ? n : (n < 0) ? AVERROR_EXIT : AVERROR_EOF;
+    }
+
+    qint64 n = me->_device->read(reinterpret_cast<char *>(buf), size);
+    return (n > 0) ? static_cast<int>(n) : AVERROR_EOF;
+}
+
+int64_t QIODeviceAVIO::seek(void *opaque, int64_t offset, int whence)
+{
+    QIODeviceAVIO *me = static_cast<QIODeviceAVIO *>(opaque);
+
+    if (whence & AVSEEK_SIZE) {
+        return me->_size;
+    }
+
+    qint64 pos = (me->isMemory()) ? me->_pos : me->_device->pos() - me->_start;
+    switch(whence & ~AVSEEK_FORCE) {
+        case SEEK_SET: pos = offset;
+        break;
+        case SEEK_CUR: pos += offset;
+        break;
+        case SEEK_END: if (me->_size < 0) { return -1; }
+                       pos = me->_size + offset;
+        break;
+        default: return -1;
+    }
+
+    if (pos < 0 || (me->_size >= 0 && pos > me->_size)) {
+        return -1;
+    }
+
+    if (me->isMemory()) {
+        me->_pos = pos;
+    } else if (!me->_device->seek(me->_start + pos)) {
+        return -1;
+    }
+
+    return pos;
+}
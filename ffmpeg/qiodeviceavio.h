@@ -0,0 +1,63 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * An AVIOContext that reads from a QIODevice, for QMediaPlayer::setMedia()
+ * with a stream.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef QIODEVICEAVIO_H
+#define QIODEVICEAVIO_H
+
+#include <QIODevice>
+#include <QAtomicInt>
+#include <stdint.h>
+
+struct AVIOContext;
+class QIODevicePump;
+
+/*
+ * The stream starts at the position of the device when it's set, so it must
+ * not be used by anyone else while it plays. In-memory devices (QBuffer) are
+ * read straight from their data, with a small AVIO buffer: packets larger than
+ * the buffer are copied once, directly from the data into the packet. Other
+ * random access devices are read by the decoder thread, with a large buffer,
+ * so they're read in big chunks. Sequential devices (sockets, network replies,
+ * processes) are filled by the event loop of their own thread, so they're read
+ * on that thread, into a buffer the decoder thread waits on.
+ */
+class QIODeviceAVIO
+{
+private:
+    QIODevice      *_device;
+    AVIOContext    *_ctx;
+    const char     *_data;      // contents of an in-memory device, nullptr otherwise
+    qint64          _start;     // device position at offset 0 of the stream
+    qint64          _size;      // of the stream, -1 when unknown
+    qint64          _pos;       // in the stream, in-memory devices
+    QIODevicePump  *_pump;      // sequential devices, nullptr otherwise
+    QAtomicInt      _abort;
+
+public:
+    explicit QIODeviceAVIO(QIODevice *device);
+   ~QIODeviceAVIO();
+
+public:
+    AVIOContext *context() const;
+    bool isMemory() const;
+
+    // Ends a read that waits for data of a sequential device
+    void abort();
+
+    // Puts the device back at the start of the stream, false for sequential devices
+    bool rewind();
+
+private:
+    static int read(void *opaque, uint8_t *buf, int size);
+    static int64_t seek(void *opaque, int64_t offset, int whence);
+};
+
+#endif // QIODEVICEAVIO_H
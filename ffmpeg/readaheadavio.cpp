@@ -0,0 +1,409 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Read-ahead buffer between a network protocol and the demuxer, so a slow
+ * read doesn't stall the demuxer while there's data buffered.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "readaheadavio.h"
+#include "mediacache.h"
+
+#include <QElapsedTimer>
+#include <string.h>
+#include <stdio.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+#include <libavutil/opt.h>
+}
+
+#define READ_AHEAD_CHUNK (64 * 1024)            // per network read
+#define READ_AHEAD_MIN_BYTES (1024 * 1024)
+#define READ_AHEAD_KEEP_FRACTION 4              // 1/4 of the ring keeps data behind the demuxer
+#define READ_AHEAD_SEEK_GAP (256 * 1024)        // seeks this far past the buffered data wait for it
+#define READ_AHEAD_WAIT_MS 50                   // a waiting read checks the interrupt flag
+#define AVIO_BUFFER_SIZE (32 * 1024)
+
+ReadAheadAVIO::ReadAheadAVIO(const QString &url, qint64 budget_bytes, QAtomicInt *interrupt)
+{
+    _url = url;
+    _src = nullptr;
+    _ctx = nullptr;
+    _interrupt = interrupt;
+    _abort = 0;
+    _size = -1;
+    _seekable = false;
+    _cache = nullptr;
+
+    qint64 capacity = qMax(budget_bytes, static_cast<qint64>(READ_AHEAD_MIN_BYTES));
+    _ring.resize(static_cast<int>(capacity));
+    _limit = capacity - capacity / READ_AHEAD_KEEP_FRACTION;
+    _start = 0;
+    _end = 0;
+    _pos = 0;
+    _seek_to = -1;
+    _eof = false;
+    _error = 0;
+    _waiting = false;
+}
+
+ReadAheadAVIO::~ReadAheadAVIO()
+{
+    stop();
+    if (_ctx != nullptr) {
+        av_freep(&_ctx->buffer);     // may have been replaced by ffmpeg
+        avio_context_free(&_ctx);
+    }
+    if (_src != nullptr) {
+        avio_closep(&_src);
+    }
+    delete _cache;
+}
+
+bool ReadAheadAVIO::open()
+{
+    AVIOInterruptCB cb = { interrupt, this };
+    if (avio_open2(&_src, _url.toUtf8().constData(), AVIO_FLAG_READ, &cb, nullptr) < 0) {
+        _src = nullptr;
+        return false;
+    }
+
+    _size = avio_size(_src);
+    if (_size < 0) {
+        _size = -1;
+    }
+    _seekable = (_src->seekable & AVIO_SEEKABLE_NORMAL) != 0;
+
+    // Media of a known size can be cached on disk. The http protocol doesn't give the
+    // ETag or Last-Modified headers, the size and the content type validate the entry.
+    qint64 cache_bytes = MediaCache::maxBytes();
+    if (cache_bytes > 0 && _size > 0 && _seekable) {
+        uint8_t *mime = nullptr;
+        av_opt_get(_src, "mime_type", AV_OPT_SEARCH_CHILDREN, &mime);
+        QString validator = QString::number(_size) + "|" + QString::fromUtf8(reinterpret_cast<const char *>(mime));
+        av_free(mime);
+
+        _cache = new MediaCache(_url, validator, cache_bytes);
+        if (!_cache->open()) {
+            delete _cache;
+            _cache = nullptr;
+        }
+    }
+
+    unsigned char *avio_buffer = static_cast<unsigned char *>(av_malloc(AVIO_BUFFER_SIZE));
+    if (avio_buffer == nullptr) {
+        return false;
+    }
+
+    // Seeks within the ring also work when the protocol can't seek
+    _ctx = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 0, this, read, nullptr, seek);
+    if (_ctx == nullptr) {
+        av_free(avio_buffer);
+        return false;
+    }
+    _ctx->seekable = (_seekable) ? AVIO_SEEKABLE_NORMAL : 0;
+
+    start();
+    return true;
+}
+
+AVIOContext *ReadAheadAVIO::context() const
+{
+    return _ctx;
+}
+
+void ReadAheadAVIO::abort()
+{
+    _abort = 1;
+    _mutex.lock();
+    _space_cond.wakeAll();
+    _data_cond.wakeAll();
+    _mutex.unlock();
+}
+
+void ReadAheadAVIO::stop()
+{
+    abort();
+    wait();
+}
+
+void ReadAheadAVIO::setByteRate(qint64 bytes_per_s, qint64 budget_ms)
+{
+    _mutex.lock();
+    qint64 capacity = _ring.size();
+    _limit = capacity - capacity / READ_AHEAD_KEEP_FRACTION;
+    if (bytes_per_s > 0 && budget_ms > 0) {
+        _limit = qBound(static_cast<qint64>(READ_AHEAD_CHUNK), bytes_per_s * budget_ms / 1000, _limit);
+    }
+    _space_cond.wakeAll();
+    _mutex.unlock();
+}
+
+void ReadAheadAVIO::wake()
+{
+    _mutex.lock();
+    _data_cond.wakeAll();
+    _mutex.unlock();
+}
+
+int ReadAheadAVIO::fill() const
+{
+    _mutex.lock();
+    qint64 ahead = qMax(static_cast<qint64>(0), _end - _pos);
+    int percent = (_eof) ? 100 : static_cast<int>(qMin(static_cast<qint64>(100), ahead * 100 / _limit));
+    _mutex.unlock();
+    return percent;
+}
+
+qint64 ReadAheadAVIO::aheadBytes() const
+{
+    _mutex.lock();
+    qint64 ahead = qMax(static_cast<qint64>(0), _end - _pos);
+    _mutex.unlock();
+    return ahead;
+}
+
+bool ReadAheadAVIO::atEnd() const
+{
+    _mutex.lock();
+    bool at_end = _eof;
+    _mutex.unlock();
+    return at_end;
+}
+
+bool ReadAheadAVIO::waiting() const
+{
+    _mutex.lock();
+    bool waiting = _waiting;
+    _mutex.unlock();
+    return waiting;
+}
+
+qint64 ReadAheadAVIO::size() const
+{
+    return _size;
+}
+
+ReadAheadAVIO::Range ReadAheadAVIO::range() const
+{
+    _mutex.lock();
+    Range r = { _start, _end };
+    _mutex.unlock();
+    return r;
+}
+
+QVariantMap ReadAheadAVIO::statistics() const
+{
+    QVariantMap m;
+    _mutex.lock();
+    m["budget_bytes"] = _ring.size();
+    m["limit_bytes"] = _limit;
+    m["ahead_bytes"] = qMax(static_cast<qint64>(0), _end - _pos);
+    m["behind_bytes"] = qMax(static_cast<qint64>(0), qMin(_pos, _end) - _start);
+    m["bytes_read"] = _bytes_read;
+    m["ring_seeks"] = _ring_seeks;
+    m["repositions"] = _repositions;
+    m["waits"] = _waits;
+    m["wait_ms"] = _wait_ms;
+    m["at_end"] = _eof;
+    _mutex.unlock();
+    if (_cache != nullptr) {
+        m["cache"] = _cache->statistics();
+    }
+    return m;
+}
+
+void ReadAheadAVIO::run()
+{
+    QByteArray chunk(READ_AHEAD_CHUNK, 0);
+    qint64 capacity = _ring.size();
+    qint64 src_pos = 0;     // of the protocol, it's only repositioned when it has to be read
+
+    _mutex.lock();
+
+    while(!_abort) {
+        if (_seek_to >= 0) {
+            _seek_to = -1;
+            _repositions += 1;
+            continue;
+        }
+
+        if (_eof || _error != 0 || (_end - _pos) >= _limit) {
+            // Woken when the demuxer reads or seeks
+            _space_cond.wait(&_mutex);
+            continue;
+        }
+
+        qint64 at = _end;
+        _mutex.unlock();
+
+        int n = 0;
+        bool cached = false;
+        if (_size >= 0 && at >= _size) {
+            n = AVERROR_EOF;
+        } else if (_cache != nullptr && (n = _cache->read(at, chunk.data(), chunk.size())) > 0) {
+            cached = true;
+        } else {
+            if (src_pos != at) {
+                int64_t res = avio_seek(_src, at, SEEK_SET);
+                n = (res < 0) ? static_cast<int>(res) : 0;
+                src_pos = (res < 0) ? -1 : at;
+            }
+            if (n == 0) {
+                n = avio_read_partial(_src, reinterpret_cast<unsigned char *>(chunk.data()), chunk.size());
+                if (n > 0) {
+                    src_pos += n;
+                    if (_cache != nullptr) {
+                        _cache->write(at, chunk.constData(), n);
+                    }
+                }
+            }
+        }
+
+        _mutex.lock();
+
+        if (at != _end) {
+            continue;               // repositioned meanwhile, the data is stale
+        }
+
+        if (n > 0) {
+            copyIn(_end, chunk.constData(), n);
+            _end += n;
+            _start = qMax(_start, _end - capacity);
+            if (!cached) {
+                _bytes_read += n;
+            }
+        } else if (n == 0 || n == AVERROR_EOF) {
+            _eof = true;
+        } else {
+            _error = n;
+        }
+        _data_cond.wakeAll();
+    }
+
+    _data_cond.wakeAll();
+    _mutex.unlock();
+}
+
+void ReadAheadAVIO::copyIn(qint64 at, const char *data, int n)
+{
+    int capacity = _ring.size();
+    int offset = static_cast<int>(at % capacity);
+    int n1 = qMin(n, capacity - offset);
+    memcpy(_ring.data() + offset, data, static_cast<size_t>(n1));
+    if (n1 < n) {
+        memcpy(_ring.data(), data + n1, static_cast<size_t>(n - n1));
+    }
+}
+
+void ReadAheadAVIO::copyOut(qint64 at, char *data, int n) const
+{
+    int capacity = _ring.size();
+    int offset = static_cast<int>(at % capacity);
+    int n1 = qMin(n, capacity - offset);
+    memcpy(data, _ring.constData() + offset, static_cast<size_t>(n1));
+    if (n1 < n) {
+        memcpy(data + n1, _ring.constData(), static_cast<size_t>(n - n1));
+    }
+}
+
+// The demuxer thread
+int ReadAheadAVIO::read(void *opaque, uint8_t *buf, int size)
+{
+    ReadAheadAVIO *me = static_cast<ReadAheadAVIO *>(opaque);
+    int result = 0;
+
+    me->_mutex.lock();
+
+    if (me->_pos >= me->_end && !me->_eof && me->_error == 0) {
+        QElapsedTimer waited;
+        waited.start();
+        me->_waiting = true;
+        me->_waits += 1;
+
+        while(me->_pos >= me->_end && !me->_eof && me->_error == 0 && !me->_abort) {
+            if (me->_interrupt != nullptr && me->_interrupt->loadAcquire()) {
+                break;
+            }
+            me->_data_cond.wait(&me->_mutex, READ_AHEAD_WAIT_MS);
+        }
+
+        me->_waiting = false;
+        me->_wait_ms += waited.elapsed();
+    }
+
+    if (me->_pos < me->_end) {
+        int n = static_cast<int>(qMin(static_cast<qint64>(size), me->_end - me->_pos));
+        me->copyOut(me->_pos, reinterpret_cast<char *>(buf), n);
+        me->_pos += n;
+        me->_space_cond.wakeAll();
+        result = n;
+    } else if (me->_error != 0) {
+        result = me->_error;
+    } else if (me->_eof) {
+        result = AVERROR_EOF;
+    } else {
+        result = AVERROR_EXIT;      // aborted or interrupted
+    }
+
+    me->_mutex.unlock();
+
+    return result;
+}
+
+// The demuxer thread
+int64_t ReadAheadAVIO::seek(void *opaque, int64_t offset, int whence)
+{
+    ReadAheadAVIO *me = static_cast<ReadAheadAVIO *>(opaque);
+
+    if (whence & AVSEEK_SIZE) {
+        return me->_size;
+    }
+
+    me->_mutex.lock();
+
+    qint64 pos = me->_pos;
+    switch(whence & ~AVSEEK_FORCE) {
+        case SEEK_SET: pos = offset;
+        break;
+        case SEEK_CUR: pos += offset;
+        break;
+        case SEEK_END: pos = (me->_size < 0) ? -1 : me->_size + offset;
+        break;
+        default: pos = -1;
+    }
+
+    bool in_ring = (pos >= me->_start && pos <= me->_end + READ_AHEAD_SEEK_GAP);
+    if (pos < 0 || (me->_size >= 0 && pos > me->_size) || (!in_ring && !me->_seekable)) {
+        me->_mutex.unlock();
+        return -1;
+    }
+
+    if (in_ring) {
+        me->_ring_seeks += 1;
+    } else {
+        me->_start = pos;
+        me->_end = pos;
+        me->_seek_to = pos;
+        me->_eof = false;
+        me->_error = 0;
+    }
+    me->_pos = pos;
+    me->_space_cond.wakeAll();
+
+    me->_mutex.unlock();
+
+    return pos;
+}
+
+int ReadAheadAVIO::interrupt(void *opaque)
+{
+    ReadAheadAVIO *me = static_cast<ReadAheadAVIO *>(opaque);
+    return me->_abort.loadAcquire();
+}
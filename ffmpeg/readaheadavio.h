@@ -0,0 +1,115 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Read-ahead buffer between a network protocol and the demuxer, so a slow
+ * read doesn't stall the demuxer while there's data buffered.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef READAHEADAVIO_H
+#define READAHEADAVIO_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QByteArray>
+#include <QVariantMap>
+#include <QAtomicInt>
+#include <stdint.h>
+
+struct AVIOContext;
+class MediaCache;
+
+/*
+ * A thread reads the url ahead of the demuxer into a ring buffer, till the byte
+ * budget or the time budget is full. The demuxer reads from the ring through
+ * context(). Data behind the read position is kept as long as it fits, so short
+ * seeks back are served from the ring. Other seeks reposition the network read.
+ * With a disk cache, cached ranges are read from disk and the network is only
+ * read, and repositioned, for the ranges that are missing.
+ */
+class ReadAheadAVIO : public QThread
+{
+public:
+    struct Range
+    {
+        qint64 start;       // bytes [start, end)
+        qint64 end;
+    };
+
+private:
+    QString         _url;
+    AVIOContext    *_src;           // the protocol, read by this thread
+    AVIOContext    *_ctx;           // the demuxer side
+    QAtomicInt     *_interrupt;     // set by the owner to end a waiting read, e.g. a pending seek
+    QAtomicInt      _abort;
+    qint64          _size;          // -1 when unknown
+    bool            _seekable;
+    MediaCache     *_cache;         // nullptr when not cached
+
+    mutable QMutex  _mutex;         // protects the members below
+    QWaitCondition  _data_cond;     // data, end of stream or repositioned
+    QWaitCondition  _space_cond;    // the demuxer read or seeked, stop
+    QByteArray      _ring;
+    qint64          _limit;         // bytes read ahead of _pos
+    qint64          _start;         // absolute byte offsets, [_start, _end) is in the ring
+    qint64          _end;
+    qint64          _pos;           // of the demuxer, may be a little past _end after a seek
+    qint64          _seek_to;       // reposition request for the thread, -1 = none
+    bool            _eof;
+    int             _error;
+    bool            _waiting;       // the demuxer waits for data
+
+    qint64          _bytes_read = 0;        // from the network
+    qint64          _ring_seeks = 0;        // served from the ring
+    qint64          _repositions = 0;       // the network read was repositioned
+    qint64          _waits = 0;
+    qint64          _wait_ms = 0;
+
+public:
+    // interrupt may be nullptr
+    ReadAheadAVIO(const QString &url, qint64 budget_bytes, QAtomicInt *interrupt);
+   ~ReadAheadAVIO();
+
+public:
+    // Opens the url and starts reading ahead, false when it can't be opened
+    bool open();
+    AVIOContext *context() const;
+    void stop();
+
+    // Ends the network reads and the waiting reads of the demuxer, also while
+    // open() connects. Doesn't wait for the thread.
+    void abort();
+
+    // Limits the read ahead to budget_ms once the byte rate of the media is known
+    void setByteRate(qint64 bytes_per_s, qint64 budget_ms);
+
+    // Lets a waiting read check the interrupt flag
+    void wake();
+
+public:
+    int fill() const;               // buffered part of the read ahead budget, 0 - 100
+    qint64 aheadBytes() const;
+    bool atEnd() const;             // everything up to the end of the stream is buffered
+    bool waiting() const;
+    qint64 size() const;
+    Range range() const;
+    QVariantMap statistics() const;
+
+protected:
+    virtual void run() override;
+
+private:
+    void copyIn(qint64 at, const char *data, int n);
+    void copyOut(qint64 at, char *data, int n) const;
+
+private:
+    static int read(void *opaque, uint8_t *buf, int size);
+    static int64_t seek(void *opaque, int64_t offset, int whence);
+    static int interrupt(void *opaque);
+};
+
+#endif // READAHEADAVIO_H
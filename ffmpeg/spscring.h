@@ -0,0 +1,211 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Lock-free single producer / single consumer rings, used to hand off
+ * decoded frames and audio chunks between the decoder stages and the
+ * GUI thread, and audio bytes to the audio callback, without holding a lock.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <QAtomicInt>
+#include <string.h>
+
+template <typename T>
+class SpscRing
+{
+private:
+    T          *_slots;
+    quint32     _mask;
+    // free running counters, unsigned so they wrap around safely
+    QAtomicInteger<quint32> _head;      // next slot to read, owned by the consumer
+    QAtomicInteger<quint32> _tail;      // next slot to write, owned by the producer
+
+public:
+    // capacity is rounded up to a power of 2
+    explicit SpscRing(int capacity = 64)
+    {
+        int c = 1;
+        while(c < capacity) { c <<= 1; }
+        _slots = new T[c];
+        _mask = static_cast<quint32>(c - 1);
+    }
+
+   ~SpscRing()
+    {
+        delete [] _slots;
+    }
+
+    Q_DISABLE_COPY(SpscRing)
+
+public:
+    // Producer side
+    bool push(const T &v)
+    {
+        quint32 tail = _tail.loadRelaxed();
+        if (tail - _head.loadAcquire() > _mask) {
+            return false;
+        }
+        _slots[tail & _mask] = v;
+        _tail.storeRelease(tail + 1);
+        return true;
+    }
+
+    // Consumer side, the returned element stays valid until pop()
+    T *front()
+    {
+        quint32 head = _head.loadRelaxed();
+        if (head == _tail.loadAcquire()) {
+            return nullptr;
+        }
+        return &_slots[head & _mask];
+    }
+
+    // Consumer side, the i-th element from the front or nullptr, valid until pop()
+    T *at(int i)
+    {
+        quint32 head = _head.loadRelaxed();
+        if (static_cast<quint32>(i) >= _tail.loadAcquire() - head) {
+            return nullptr;
+        }
+        return &_slots[(head + static_cast<quint32>(i)) & _mask];
+    }
+
+    // Consumer side, the slot is reset so its resources are released right away
+    void pop()
+    {
+        quint32 head = _head.loadRelaxed();
+        if (head != _tail.loadAcquire()) {
+            _slots[head & _mask] = T();
+            _head.storeRelease(head + 1);
+        }
+    }
+
+    // Only when the producer is not running
+    void clear()
+    {
+        while(front() != nullptr) { pop(); }
+    }
+
+public:
+    // Approximate when called from a third thread
+    int size() const { return static_cast<int>(_tail.loadAcquire() - _head.loadAcquire()); }
+    bool isEmpty() const { return size() == 0; }
+    bool isFull() const { return static_cast<quint32>(size()) > _mask; }
+    int capacity() const { return static_cast<int>(_mask + 1); }
+};
+
+/*
+ * A byte ring for a realtime consumer, e.g. an audio callback. The consumer
+ * reads straight from the ring memory and never allocates or blocks.
+ */
+class SpscByteRing
+{
+private:
+    char       *_data;
+    quint32     _mask;
+    QAtomicInteger<quint32> _head;      // owned by the consumer
+    QAtomicInteger<quint32> _tail;      // owned by the producer
+    QAtomicInteger<quint32> _clear_to;
+    QAtomicInt  _clear_pending;
+
+public:
+    // capacity is rounded up to a power of 2
+    explicit SpscByteRing(int capacity)
+    {
+        int c = 1;
+        while(c < capacity) { c <<= 1; }
+        _data = new char[c];
+        _mask = static_cast<quint32>(c - 1);
+    }
+
+   ~SpscByteRing()
+    {
+        delete [] _data;
+    }
+
+    Q_DISABLE_COPY(SpscByteRing)
+
+public:
+    // Only when neither side is running, the contents are dropped
+    void resize(int capacity)
+    {
+        int c = 1;
+        while(c < capacity) { c <<= 1; }
+        delete [] _data;
+        _data = new char[c];
+        _mask = static_cast<quint32>(c - 1);
+        _head.storeRelaxed(0);
+        _tail.storeRelaxed(0);
+        _clear_pending.storeRelaxed(0);
+    }
+
+public:
+    // Producer side, returns the number of bytes written
+    int write(const char *src, int len)
+    {
+        quint32 tail = _tail.loadRelaxed();
+        int free = static_cast<int>(_mask + 1 - (tail - _head.loadAcquire()));
+        int n = (len < free) ? len : free;
+        int first = static_cast<int>(_mask + 1 - (tail & _mask));
+        if (first > n) { first = n; }
+        memcpy(_data + (tail & _mask), src, first);
+        memcpy(_data, src + first, n - first);
+        _tail.storeRelease(tail + n);
+        return n;
+    }
+
+    // Producer side, everything written so far is dropped by the consumer
+    void clear()
+    {
+        _clear_to.storeRelaxed(_tail.loadRelaxed());
+        _clear_pending.storeRelease(1);
+    }
+
+    // Consumer side, the readable bytes as (at most) two contiguous parts
+    int peek(int max, const char *&p1, int &n1, const char *&p2, int &n2)
+    {
+        quint32 head = _head.loadRelaxed();
+        quint32 tail = _tail.loadAcquire();
+
+        if (_clear_pending.testAndSetAcquire(1, 0)) {
+            quint32 to = _clear_to.loadRelaxed();
+            if (to - head <= tail - head) {
+                head = to;
+                _head.storeRelease(head);
+            }
+        }
+
+        int avail = static_cast<int>(tail - head);
+        int n = (max < avail) ? max : avail;
+        n1 = static_cast<int>(_mask + 1 - (head & _mask));
+        if (n1 > n) { n1 = n; }
+        n2 = n - n1;
+        p1 = _data + (head & _mask);
+        p2 = _data;
+        return n;
+    }
+
+    // Consumer side
+    void consume(int n)
+    {
+        _head.storeRelease(_head.loadRelaxed() + static_cast<quint32>(n));
+    }
+
+public:
+    // Approximate when called from the producer
+    int size() const
+    {
+        quint32 tail = _tail.loadAcquire();
+        quint32 from = (_clear_pending.loadAcquire()) ? _clear_to.loadRelaxed() : _head.loadAcquire();
+        return static_cast<int>(tail - from);
+    }
+    int capacity() const { return static_cast<int>(_mask + 1); }
+};
+
+#endif // SPSCRING_H
@@ -0,0 +1,194 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Parallel colour conversion and scaling of decoded frames to RGB images,
+ * in horizontal bands.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "swsbandconverter.h"
+
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#define MAX_SWS_BANDS 16
+#define MIN_SWS_BAND_HEIGHT 64
+#define SWS_BAND_PIXELS (1024 * 1024)       // auto: one band per megapixel
+
+class SwsBandJob : public QRunnable
+{
+private:
+    SwsBandConverter    *_converter;
+    int                  _band;
+    QSemaphore          *_done;
+
+public:
+    SwsBandJob(SwsBandConverter *c, int band, QSemaphore *done) : _converter(c), _band(band), _done(done) {}
+
+public:
+    virtual void run() override
+    {
+        _converter->convertBand(_band);
+        _done->release();
+    }
+};
+
+SwsBandConverter::SwsBandConverter()
+{
+    _frame = nullptr;
+    _dst = nullptr;
+    _dst_linesize = 0;
+    _dst_w = 0;
+    _dst_h = 0;
+    _dst_format = AV_PIX_FMT_RGB32;
+    _chroma_shift = 0;
+    _band_h = 0;
+    _bands = 1;
+}
+
+SwsBandConverter::~SwsBandConverter()
+{
+    for(SwsContext *sws : _sws) {
+        if (sws) { sws_freeContext(sws); }
+    }
+}
+
+QThreadPool *SwsBandConverter::pool()
+{
+    static QThreadPool *p = nullptr;
+    static QMutex m;
+    m.lock();
+    if (p == nullptr) {
+        p = new QThreadPool();
+        p->setMaxThreadCount(QThread::idealThreadCount());
+    }
+    m.unlock();
+    return p;
+}
+
+// FFMPEG_PLUGIN_SWS_BANDS = auto | <n>
+int SwsBandConverter::configuredBands(int w, int h)
+{
+    static int configured = -1;
+    if (configured < 0) {
+        bool ok = false;
+        int n = qEnvironmentVariable("FFMPEG_PLUGIN_SWS_BANDS").toInt(&ok);
+        configured = (ok && n > 0) ? n : 0;
+    }
+
+    int bands = configured;
+    if (bands == 0) {
+        bands = qMin((w * h + SWS_BAND_PIXELS / 2) / SWS_BAND_PIXELS, QThread::idealThreadCount());
+    }
+    bands = qMin(bands, h / MIN_SWS_BAND_HEIGHT);
+    return qBound(1, bands, MAX_SWS_BANDS);
+}
+
+int SwsBandConverter::bands() const
+{
+    return _bands;
+}
+
+bool SwsBandConverter::convert(const AVFrame *frame, QImage &img)
+{
+    int w = frame->width;
+    int h = frame->height;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    if (desc == nullptr) {
+        return false;
+    }
+
+    _dst_w = img.width();
+    _dst_h = img.height();
+    _dst_format = (img.format() == QImage::Format_RGB888) ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_RGB32;
+
+    _bands = qMin(configuredBands(w, h), qMax(1, _dst_h / MIN_SWS_BAND_HEIGHT));
+    if (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)) {
+        _bands = 1;     // these can't be addressed by row
+    }
+    if (_dst_h != h) {
+        _bands = 1;     // the vertical filter of a band would miss the rows of its neighbours
+    }
+
+    // Band boundaries must fall on a chroma row of the source, see sourceRow()
+    _chroma_shift = desc->log2_chroma_h;
+    int align = qMax(16, 1 << _chroma_shift);
+    _band_h = (((_dst_h + _bands - 1) / _bands) + align - 1) & ~(align - 1);
+    _bands = (_dst_h + _band_h - 1) / _band_h;
+
+    if (_sws.size() < _bands) {
+        _sws.resize(_bands);
+    }
+
+    _frame = frame;
+    _dst = img.bits();
+    _dst_linesize = img.bytesPerLine();
+    _failed.storeRelaxed(0);
+
+    int band;
+    for(band = 1; band < _bands; band++) {
+        pool()->start(new SwsBandJob(this, band, &_done));
+    }
+    convertBand(0);
+    _done.acquire(_bands - 1);
+
+    _frame = nullptr;
+    return _failed.loadRelaxed() == 0;
+}
+
+// First source row of the band that starts at dst_row
+int SwsBandConverter::sourceRow(int dst_row)
+{
+    int y = static_cast<int>(static_cast<qint64>(dst_row) * _frame->height / _dst_h);
+    return y & ~((1 << _chroma_shift) - 1);
+}
+
+void SwsBandConverter::convertBand(int band)
+{
+    int w = _frame->width;
+    int dy = band * _band_h;
+    int dbh = qMin(_band_h, _dst_h - dy);
+    if (dbh <= 0) {
+        return;
+    }
+
+    int y = sourceRow(dy);
+    int bh = ((dy + dbh) >= _dst_h ? _frame->height : sourceRow(dy + dbh)) - y;
+    if (bh <= 0) {
+        return;
+    }
+
+    AVPixelFormat fmt = static_cast<AVPixelFormat>(_frame->format);
+    int flags = SWS_BILINEAR; // SWS_POINT;  // SWS_FAST_BILINEAR;      // SWS_BILINEAR
+
+    _sws[band] = sws_getCachedContext(_sws[band], w, bh, fmt, _dst_w, dbh, static_cast<AVPixelFormat>(_dst_format), flags, NULL, NULL, NULL);
+    if (_sws[band] == nullptr) {
+        _failed.storeRelaxed(1);
+        return;
+    }
+
+    const uint8_t *src[4] = { nullptr };
+    int i;
+    for(i = 0; i < 4; i++) {
+        if (_frame->data[i] != nullptr) {
+            int shift = (i == 1 || i == 2) ? _chroma_shift : 0;
+            src[i] = _frame->data[i] + (y >> shift) * _frame->linesize[i];
+        }
+    }
+
+    uint8_t *dst[4] = { _dst + dy * _dst_linesize, nullptr, nullptr, nullptr };
+    int dst_linesize[4] = { _dst_linesize, 0, 0, 0 };
+
+    sws_scale(_sws[band], src, _frame->linesize, 0, bh, dst, dst_linesize);
+}
@@ -0,0 +1,66 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Parallel colour conversion and scaling of decoded frames to RGB images,
+ * in horizontal bands.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef SWSBANDCONVERTER_H
+#define SWSBANDCONVERTER_H
+
+#include <QVector>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QImage>
+
+struct AVFrame;
+struct SwsContext;
+class QThreadPool;
+
+/*
+ * Converts a decoded frame to the RGB32 or RGB888 destination image in horizontal bands, which are converted
+ * in parallel on a worker pool that is shared by all players. Every band has
+ * its own cached SwsContext, because a SwsContext can't be used by two threads.
+ * The frame is scaled to the size of the destination image. Only horizontal
+ * scaling is done in bands, a frame that's scaled vertically is done in one.
+ */
+class SwsBandConverter
+{
+private:
+    QVector<SwsContext *> _sws;         // one per band
+    QSemaphore           _done;
+    QAtomicInt           _failed;
+    const AVFrame       *_frame;
+    uchar               *_dst;
+    int                  _dst_linesize;
+    int                  _dst_w;
+    int                  _dst_h;
+    int                  _dst_format;   // AVPixelFormat of the destination image
+    int                  _chroma_shift;
+    int                  _band_h;       // in destination rows
+    int                  _bands;
+
+public:
+    SwsBandConverter();
+   ~SwsBandConverter();
+
+public:
+    bool convert(const AVFrame *frame, QImage &img);
+    int  bands() const;
+
+public:
+    void convertBand(int band);
+
+private:
+    int  sourceRow(int dst_row);
+
+private:
+    static QThreadPool *pool();
+    static int configuredBands(int w, int h);
+};
+
+#endif // SWSBANDCONVERTER_H
@@ -0,0 +1,233 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Pitch preserving time stretching of interleaved PCM audio, using WSOLA
+ * (waveform similarity overlap-add).
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "timestretch.h"
+
+#include <QtGlobal>
+#include <QtMath>
+#include <string.h>
+
+#define SEGMENT_MS 20
+#define SEARCH_MS 8
+#define SEARCH_DECIMATION 2     // every n-th frame is used for the similarity search
+
+void TimeStretch::configure(int sample_rate, int channels, SampleType type)
+{
+    _channels = qMax(1, channels);
+    _type = type;
+    _segment = qMax(32, (sample_rate * SEGMENT_MS / 1000) & ~1);
+    _hop = _segment / 2;
+    _search = qMax(8, sample_rate * SEARCH_MS / 1000);
+
+    _fade.resize(_hop);
+    for(int i = 0; i < _hop; i++) {
+        double s = sin(M_PI * i / _segment);
+        _fade[i] = static_cast<float>(s * s);
+    }
+
+    _tail.resize(_hop * _channels);
+    _scratch.resize(_hop * _channels);
+
+    reset();
+}
+
+void TimeStretch::reset()
+{
+    _in.clear();
+    _mono.clear();
+    _in_frames = 0;
+    _in_pos = 0.0;
+    _natural = -1;
+}
+
+bool TimeStretch::isIdle() const
+{
+    return _natural < 0 && _in_frames == 0;
+}
+
+int TimeStretch::bufferedFrames() const
+{
+    return (_natural < 0) ? _in_frames : (_in_frames - _natural);
+}
+
+int TimeStretch::frameBytes() const
+{
+    return _channels * ((_type == Int16) ? 2 : 4);
+}
+
+void TimeStretch::process(const char *data, int bytes, double rate, QByteArray &out)
+{
+    int frames = bytes / frameBytes();
+    if (frames <= 0 || _segment == 0) {
+        return;
+    }
+
+    if (rate == 1.0 && isIdle()) {
+        out.append(data, frames * frameBytes());
+        return;
+    }
+
+    append(data, frames);
+
+    if (rate == 1.0) {
+        // The faded out tail of the previous segment and the faded in input at its
+        // natural continuation add up to the input itself, so the rest is passed on as is.
+        int from = qMax(0, _natural);
+        write(_in.constData() + from * _channels, _in_frames - from, out);
+        reset();
+        return;
+    }
+
+    while(true) {
+        bool first = (_natural < 0);
+        int nominal = static_cast<int>(_in_pos + 0.5);
+        int from = (first) ? nominal : qMax(0, nominal - _search);
+        int to = (first) ? nominal : (nominal + _search);
+        int needed = qMax(to, _natural) + _segment;
+        if (_in_frames < needed) {
+            break;
+        }
+
+        int start = (first) ? nominal : bestSegment(from, to);
+        const float *src = _in.constData() + start * _channels;
+
+        // First half: overlap-add with the tail of the previous segment
+        float *dst = _scratch.data();
+        for(int i = 0; i < _hop; i++) {
+            float w = (first) ? 1.0f : _fade[i];
+            for(int c = 0; c < _channels; c++) {
+                int k = i * _channels + c;
+                dst[k] = src[k] * w + ((first) ? 0.0f : _tail[k]);
+            }
+        }
+        write(dst, _hop, out);
+
+        // Second half: faded out, it's added to the next segment
+        const float *src2 = src + _hop * _channels;
+        for(int i = 0; i < _hop; i++) {
+            float w = 1.0f - _fade[i];
+            for(int c = 0; c < _channels; c++) {
+                int k = i * _channels + c;
+                _tail[k] = src2[k] * w;
+            }
+        }
+
+        _natural = start + _hop;
+        _in_pos += _hop * rate;
+    }
+
+    // Input before the next search range and before the natural continuation isn't needed anymore
+    if (_natural >= 0) {
+        int keep_from = qMin(_natural, qMax(0, static_cast<int>(_in_pos + 0.5) - _search));
+        discard(keep_from);
+    }
+}
+
+// The segment start in [from, to] that continues the previous segment best,
+// by normalized cross correlation of the mono downmix.
+int TimeStretch::bestSegment(int from, int to) const
+{
+    const float *ref = _mono.constData() + _natural;
+    int best = from;
+    double best_score = -1e30;
+
+    for(int s = from; s <= to; s++) {
+        const float *cand = _mono.constData() + s;
+        double corr = 0.0;
+        double energy = 1e-9;
+        for(int i = 0; i < _hop; i += SEARCH_DECIMATION) {
+            corr += cand[i] * ref[i];
+            energy += cand[i] * cand[i];
+        }
+        double score = corr / sqrt(energy);
+        if (score > best_score) {
+            best_score = score;
+            best = s;
+        }
+    }
+
+    return best;
+}
+
+void TimeStretch::append(const char *data, int frames)
+{
+    int samples = frames * _channels;
+    int in_offset = _in.size();
+    int mono_offset = _mono.size();
+    _in.resize(in_offset + samples);
+    _mono.resize(mono_offset + frames);
+
+    float *dst = _in.data() + in_offset;
+    switch(_type) {
+        case Int16: {
+            const qint16 *src = reinterpret_cast<const qint16 *>(data);
+            for(int i = 0; i < samples; i++) { dst[i] = src[i] / 32768.0f; }
+        }
+        break;
+        case Int32: {
+            const qint32 *src = reinterpret_cast<const qint32 *>(data);
+            for(int i = 0; i < samples; i++) { dst[i] = static_cast<float>(src[i] / 2147483648.0); }
+        }
+        break;
+        case Float32: memcpy(dst, data, samples * sizeof(float));
+        break;
+    }
+
+    float *mono = _mono.data() + mono_offset;
+    for(int f = 0; f < frames; f++) {
+        float sum = 0.0f;
+        for(int c = 0; c < _channels; c++) {
+            sum += dst[f * _channels + c];
+        }
+        mono[f] = sum;
+    }
+
+    _in_frames += frames;
+}
+
+void TimeStretch::write(const float *src, int frames, QByteArray &out) const
+{
+    int samples = frames * _channels;
+    int offset = out.size();
+    out.resize(offset + frames * frameBytes());
+
+    switch(_type) {
+        case Int16: {
+            qint16 *dst = reinterpret_cast<qint16 *>(out.data() + offset);
+            for(int i = 0; i < samples; i++) {
+                dst[i] = static_cast<qint16>(qBound(-32768.0f, src[i] * 32768.0f, 32767.0f));
+            }
+        }
+        break;
+        case Int32: {
+            qint32 *dst = reinterpret_cast<qint32 *>(out.data() + offset);
+            for(int i = 0; i < samples; i++) {
+                dst[i] = static_cast<qint32>(qBound(-2147483648.0, src[i] * 2147483648.0, 2147483647.0));
+            }
+        }
+        break;
+        case Float32: memcpy(out.data() + offset, src, samples * sizeof(float));
+        break;
+    }
+}
+
+void TimeStretch::discard(int frames)
+{
+    if (frames <= 0) {
+        return;
+    }
+
+    _in.remove(0, frames * _channels);
+    _mono.remove(0, frames);
+    _in_frames -= frames;
+    _in_pos -= frames;
+    _natural -= frames;
+}
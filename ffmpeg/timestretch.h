@@ -0,0 +1,67 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * Pitch preserving time stretching of interleaved PCM audio, using WSOLA
+ * (waveform similarity overlap-add).
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef TIMESTRETCH_H
+#define TIMESTRETCH_H
+
+#include <QByteArray>
+#include <QVector>
+
+/*
+ * The output is built from segments of the input that overlap by half a
+ * segment. The input position of each segment advances by rate times the
+ * output hop. Around that nominal position the segment that continues the
+ * previous one best (by cross correlation) is taken, so the waveform stays
+ * continuous and the pitch is kept.
+ *
+ * At rate 1.0 the input is passed through unchanged.
+ */
+class TimeStretch
+{
+public:
+    enum SampleType { Int16, Int32, Float32 };
+
+private:
+    int            _channels = 2;
+    SampleType     _type = Int16;
+    int            _segment = 0;        // frames
+    int            _hop = 0;            // output hop, half a segment
+    int            _search = 0;         // frames searched around the nominal position
+
+    QVector<float> _in;                 // interleaved input that may still be used
+    QVector<float> _mono;               // downmix of _in, for the similarity search
+    int            _in_frames = 0;
+    double         _in_pos = 0.0;       // nominal input position of the next segment
+    int            _natural = -1;       // natural continuation of the previous segment, -1 when idle
+    QVector<float> _tail;               // faded out second half of the previous segment
+    QVector<float> _fade;               // fade in over _hop frames, the fade out is 1 - _fade
+    QVector<float> _scratch;
+
+public:
+    void configure(int sample_rate, int channels, SampleType type);
+    void reset();
+
+    // Appends the stretched audio to out
+    void process(const char *data, int bytes, double rate, QByteArray &out);
+
+    bool isIdle() const;
+    // Input frames that have been taken, but are not in the output yet
+    int bufferedFrames() const;
+
+private:
+    int frameBytes() const;
+    void append(const char *data, int frames);
+    void write(const float *src, int frames, QByteArray &out) const;
+    int bestSegment(int from, int to) const;
+    void discard(int frames);
+};
+
+#endif // TIMESTRETCH_H
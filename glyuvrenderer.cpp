@@ -0,0 +1,496 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * OpenGL renderer for planar YUV, NV12 and RGB32 video frames.
+ *
+ * The shaders are GLSL 1.00/1.10, so they run on OpenGL 2, OpenGL ES 2 and
+ * on software rasterizers like Mesa llvmpipe. A desktop core profile gets
+ * the same shaders with a #version 150 prefix.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#include "glyuvrenderer.h"
+
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+#include <QMatrix3x3>
+#include <QVector3D>
+#include <QDebug>
+
+#define LINE_WARN  qWarning() << __FUNCTION__ << __LINE__
+
+#define ATTR_POSITION 0
+#define ATTR_TEXCOORD 1
+
+// x, y, s, t as a triangle strip, t = 0 is the top row of the frame
+static const GLfloat quad[] = {
+    -1.0f, -1.0f,   0.0f, 1.0f,
+     1.0f, -1.0f,   1.0f, 1.0f,
+    -1.0f,  1.0f,   0.0f, 0.0f,
+     1.0f,  1.0f,   1.0f, 0.0f
+};
+
+// ATTRIBUTE, VARYING_OUT, VARYING_IN, TEXTURE and FRAG_COLOR are defined per profile, see program()
+static const char *vertex_shader =
+        "ATTRIBUTE vec4 position;\n"
+        "ATTRIBUTE vec2 texcoord;\n"
+        "VARYING_OUT vec2 v_texcoord;\n"
+        "void main() {\n"
+        "    gl_Position = position;\n"
+        "    v_texcoord = texcoord;\n"
+        "}\n";
+
+static const char *fragment_shader =
+        "#ifdef GL_ES\n"
+        "#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+        "precision highp float;\n"
+        "#else\n"
+        "precision mediump float;\n"
+        "#endif\n"
+        "#endif\n"
+        "uniform sampler2D tex_y;\n"
+        "uniform sampler2D tex_u;\n"
+        "uniform sampler2D tex_v;\n"
+        "uniform mat3 colour_matrix;\n"
+        "uniform vec3 colour_offset;\n"
+        "VARYING_IN vec2 v_texcoord;\n"
+        "void main() {\n"
+        "#if defined(FMT_RGB)\n"
+        "    FRAG_COLOR = vec4(TEXTURE(tex_y, v_texcoord).bgr, 1.0);\n"
+        "#else\n"
+        "    vec3 yuv;\n"
+        "    yuv.x = TEXTURE(tex_y, v_texcoord).r;\n"
+        "#if defined(FMT_NV12)\n"
+        "    yuv.yz = TEXTURE(tex_u, v_texcoord).UV;\n"
+        "#elif defined(FMT_NV21)\n"
+        "    yuv.zy = TEXTURE(tex_u, v_texcoord).UV;\n"
+        "#else\n"
+        "    yuv.y = TEXTURE(tex_u, v_texcoord).r;\n"
+        "    yuv.z = TEXTURE(tex_v, v_texcoord).r;\n"
+        "#endif\n"
+        "    FRAG_COLOR = vec4(colour_matrix * (yuv - colour_offset), 1.0);\n"
+        "#endif\n"
+        "}\n";
+
+// Row major YUV -> RGB matrices
+static const float bt601[9] = {
+    1.164383f,  0.000000f,  1.596027f,
+    1.164383f, -0.391762f, -0.812968f,
+    1.164383f,  2.017232f,  0.000000f
+};
+
+static const float bt709[9] = {
+    1.164383f,  0.000000f,  1.792741f,
+    1.164383f, -0.213249f, -0.532909f,
+    1.164383f,  2.112402f,  0.000000f
+};
+
+static const float jpeg[9] = {
+    1.000000f,  0.000000f,  1.402000f,
+    1.000000f, -0.344136f, -0.714136f,
+    1.000000f,  1.772000f,  0.000000f
+};
+
+GLYuvRenderer::GLYuvRenderer()
+    : _vbo(QOpenGLBuffer::VertexBuffer)
+{
+    int i, j;
+    for(i = 0; i < PboSets; i++) {
+        for(j = 0; j < MaxPlanes; j++) {
+            _pbos[i][j] = nullptr;
+        }
+    }
+}
+
+GLYuvRenderer::~GLYuvRenderer()
+{
+    // GL resources are released by cleanup(), which needs a current context
+}
+
+bool GLYuvRenderer::initialize()
+{
+    QOpenGLContext *ctx = QOpenGLContext::currentContext();
+    if (ctx == nullptr) {
+        return false;
+    }
+
+    initializeOpenGLFunctions();
+
+    QSurfaceFormat f = ctx->format();
+    int version = f.majorVersion() * 10 + f.minorVersion();
+
+    _es = ctx->isOpenGLES();
+    _core = !_es && f.profile() == QSurfaceFormat::CoreProfile;
+    if (_es) {
+        _use_pbo = (version >= 30);
+        _map_range = _use_pbo;
+        _row_length = (version >= 30) || ctx->hasExtension("GL_EXT_unpack_subimage");
+    } else {
+        _use_pbo = (version >= 21) || ctx->hasExtension("GL_ARB_pixel_buffer_object");
+        _map_range = (version >= 30);
+        _row_length = true;
+    }
+
+    glGenTextures(MaxPlanes, _textures);
+    int i, j;
+    for(i = 0; i < MaxPlanes; i++) {
+        glBindTexture(GL_TEXTURE_2D, _textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        _texture_sizes[i] = QSize();
+        _texture_formats[i] = 0;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    if (_use_pbo) {
+        for(i = 0; i < PboSets; i++) {
+            for(j = 0; j < MaxPlanes; j++) {
+                _pbos[i][j] = new QOpenGLBuffer(QOpenGLBuffer::PixelUnpackBuffer);
+                _pbos[i][j]->setUsagePattern(QOpenGLBuffer::StreamDraw);
+                _pbos[i][j]->create();
+            }
+        }
+    }
+
+    if (_core) {
+        _vao.create();
+        _vao.bind();
+    }
+    _vbo.create();
+    _vbo.bind();
+    _vbo.allocate(quad, sizeof(quad));
+    _vbo.release();
+    if (_core) {
+        _vao.release();
+    }
+
+    _format = QVideoFrame::Format_Invalid;
+    _initialized = true;
+
+    return true;
+}
+
+void GLYuvRenderer::cleanup()
+{
+    if (!_initialized) {
+        return;
+    }
+
+    for(QOpenGLShaderProgram *p : _programs) {
+        delete p;
+    }
+    _programs.clear();
+
+    glDeleteTextures(MaxPlanes, _textures);
+
+    int i, j;
+    for(i = 0; i < PboSets; i++) {
+        for(j = 0; j < MaxPlanes; j++) {
+            if (_pbos[i][j] != nullptr) {
+                _pbos[i][j]->destroy();
+                delete _pbos[i][j];
+                _pbos[i][j] = nullptr;
+            }
+        }
+    }
+
+    _vbo.destroy();
+    if (_vao.isCreated()) {
+        _vao.destroy();
+    }
+
+    _format = QVideoFrame::Format_Invalid;
+    _initialized = false;
+}
+
+bool GLYuvRenderer::isInitialized() const
+{
+    return _initialized;
+}
+
+QList<QVideoFrame::PixelFormat> GLYuvRenderer::supportedPixelFormats() const
+{
+    // RGB32 is also rendered, but that's what the provider falls back to
+    return { QVideoFrame::Format_YUV420P, QVideoFrame::Format_YUV422P, QVideoFrame::Format_NV12, QVideoFrame::Format_NV21 };
+}
+
+bool GLYuvRenderer::hasFrame() const
+{
+    return _format != QVideoFrame::Format_Invalid;
+}
+
+QOpenGLShaderProgram *GLYuvRenderer::program(QVideoFrame::PixelFormat fmt)
+{
+    auto it = _programs.find(fmt);
+    if (it != _programs.end()) {
+        return it.value();
+    }
+
+    QByteArray vs_prefix;
+    QByteArray fs_prefix;
+
+    if (_core) {
+        vs_prefix = "#version 150\n#define ATTRIBUTE in\n#define VARYING_OUT out\n";
+        fs_prefix = "#version 150\n#define VARYING_IN in\n#define TEXTURE texture\n"
+                    "out vec4 frag_color;\n#define FRAG_COLOR frag_color\n";
+    } else {
+        vs_prefix = "#define ATTRIBUTE attribute\n#define VARYING_OUT varying\n";
+        fs_prefix = "#define VARYING_IN varying\n#define TEXTURE texture2D\n#define FRAG_COLOR gl_FragColor\n";
+    }
+
+    fs_prefix += (_core) ? "#define UV rg\n" : "#define UV ra\n";
+
+    switch(fmt) {
+    case QVideoFrame::Format_NV12:  fs_prefix += "#define FMT_NV12\n"; break;
+    case QVideoFrame::Format_NV21:  fs_prefix += "#define FMT_NV21\n"; break;
+    case QVideoFrame::Format_RGB32:
+    case QVideoFrame::Format_ARGB32: fs_prefix += "#define FMT_RGB\n"; break;
+    default: break;
+    }
+
+    vs_prefix += vertex_shader;
+    fs_prefix += fragment_shader;
+
+    QOpenGLShaderProgram *p = new QOpenGLShaderProgram();
+    bool ok = p->addShaderFromSourceCode(QOpenGLShader::Vertex, vs_prefix) &&
+              p->addShaderFromSourceCode(QOpenGLShader::Fragment, fs_prefix);
+    if (ok) {
+        p->bindAttributeLocation("position", ATTR_POSITION);
+        p->bindAttributeLocation("texcoord", ATTR_TEXCOORD);
+        ok = p->link();
+    }
+
+    if (!ok) {
+        LINE_WARN << "Cannot build shader for pixel format" << fmt << p->log();
+        delete p;
+        p = nullptr;
+    }
+
+    _programs.insert(fmt, p);   // also a failure, so we don't try again
+    return p;
+}
+
+void GLYuvRenderer::formatFor(int bytes_per_pixel, GLint &internal, GLenum &format) const
+{
+    switch(bytes_per_pixel) {
+    case 1:
+        internal = (_core) ? GL_R8 : GL_LUMINANCE;
+        format = (_core) ? GL_RED : GL_LUMINANCE;
+        break;
+    case 2:
+        internal = (_core) ? GL_RG8 : GL_LUMINANCE_ALPHA;
+        format = (_core) ? GL_RG : GL_LUMINANCE_ALPHA;
+        break;
+    default:
+        internal = GL_RGBA;
+        format = GL_RGBA;
+        break;
+    }
+}
+
+void GLYuvRenderer::uploadPlane(int plane, int w, int h, int bytes_per_pixel, const uchar *data, int linesize)
+{
+    GLint internal;
+    GLenum format;
+    formatFor(bytes_per_pixel, internal, format);
+
+    glActiveTexture(GL_TEXTURE0 + plane);
+    glBindTexture(GL_TEXTURE_2D, _textures[plane]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    // A plane can change its size and its bytes per pixel (YUV420P to NV12 or RGB32)
+    if (_texture_sizes[plane] != QSize(w, h) || _texture_formats[plane] != internal) {
+        glTexImage2D(GL_TEXTURE_2D, 0, internal, w, h, 0, format, GL_UNSIGNED_BYTE, nullptr);
+        _texture_sizes[plane] = QSize(w, h);
+        _texture_formats[plane] = internal;
+    }
+
+    int row = w * bytes_per_pixel;
+    int y;
+
+    if (_use_pbo) {
+        // Streaming upload: the previous storage of the buffer is orphaned by allocate(), so we
+        // don't wait for the GPU to finish the upload of the frame before.
+        QOpenGLBuffer *pbo = _pbos[_pbo_set][plane];
+        pbo->bind();
+        pbo->allocate(row * h);
+
+        uchar *dst;
+        if (_map_range) {
+            dst = static_cast<uchar *>(pbo->mapRange(0, row * h, QOpenGLBuffer::RangeWrite | QOpenGLBuffer::RangeInvalidateBuffer));
+        } else {
+            dst = static_cast<uchar *>(pbo->map(QOpenGLBuffer::WriteOnly));
+        }
+
+        if (dst != nullptr) {
+            if (linesize == row) {
+                memcpy(dst, data, row * h);
+            } else {
+                for(y = 0; y < h; y++) {
+                    memcpy(dst + y * row, data + y * linesize, row);
+                }
+            }
+            pbo->unmap();
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, format, GL_UNSIGNED_BYTE, nullptr);
+            pbo->release();
+            return;
+        }
+
+        LINE_WARN << "Cannot map pixel buffer object, uploading directly";
+        pbo->release();
+        _use_pbo = false;
+    }
+
+    if (linesize == row) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, format, GL_UNSIGNED_BYTE, data);
+    } else if (_row_length) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize / bytes_per_pixel);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, format, GL_UNSIGNED_BYTE, data);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    } else {
+        _repack.resize(row * h);
+        uchar *dst = reinterpret_cast<uchar *>(_repack.data());
+        for(y = 0; y < h; y++) {
+            memcpy(dst + y * row, data + y * linesize, row);
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, format, GL_UNSIGNED_BYTE, dst);
+    }
+}
+
+bool GLYuvRenderer::upload(QVideoFrame &frame, const QVideoSurfaceFormat &format)
+{
+    if (!_initialized) {
+        return false;
+    }
+
+    QVideoFrame::PixelFormat fmt = frame.pixelFormat();
+    if (program(fmt) == nullptr) {
+        return false;
+    }
+
+    if (!frame.map(QAbstractVideoBuffer::ReadOnly)) {
+        return false;
+    }
+
+    int w = frame.width();
+    int h = frame.height();
+    int cw = (w + 1) / 2;
+    int ch = (h + 1) / 2;
+    bool ok = true;
+
+    switch(fmt) {
+    case QVideoFrame::Format_YUV420P:
+        uploadPlane(0, w, h, 1, frame.bits(0), frame.bytesPerLine(0));
+        uploadPlane(1, cw, ch, 1, frame.bits(1), frame.bytesPerLine(1));
+        uploadPlane(2, cw, ch, 1, frame.bits(2), frame.bytesPerLine(2));
+        break;
+    case QVideoFrame::Format_YUV422P:
+        uploadPlane(0, w, h, 1, frame.bits(0), frame.bytesPerLine(0));
+        uploadPlane(1, cw, h, 1, frame.bits(1), frame.bytesPerLine(1));
+        uploadPlane(2, cw, h, 1, frame.bits(2), frame.bytesPerLine(2));
+        break;
+    case QVideoFrame::Format_NV12:
+    case QVideoFrame::Format_NV21:
+        uploadPlane(0, w, h, 1, frame.bits(0), frame.bytesPerLine(0));
+        uploadPlane(1, cw, ch, 2, frame.bits(1), frame.bytesPerLine(1));
+        break;
+    case QVideoFrame::Format_RGB32:
+    case QVideoFrame::Format_ARGB32:
+        uploadPlane(0, w, h, 4, frame.bits(0), frame.bytesPerLine(0));
+        break;
+    default:
+        ok = false;
+        break;
+    }
+
+    frame.unmap();
+    glActiveTexture(GL_TEXTURE0);
+
+    if (ok) {
+        _pbo_set = (_pbo_set + 1) % PboSets;
+        _format = fmt;
+        _frame_size = QSize(w, h);
+        _color_space = format.yCbCrColorSpace();
+    }
+
+    return ok;
+}
+
+void GLYuvRenderer::render(const QSize &target, Qt::AspectRatioMode mode)
+{
+    if (!_initialized || _format == QVideoFrame::Format_Invalid || target.isEmpty()) {
+        return;
+    }
+
+    QOpenGLShaderProgram *p = program(_format);
+    if (p == nullptr) {
+        return;
+    }
+
+    // Aspect ratio handling is done by the viewport, KeepAspectRatioByExpanding
+    // makes it larger than the target, so the frame is cropped.
+    QSize s = (mode == Qt::IgnoreAspectRatio) ? target : _frame_size.scaled(target, mode);
+    glViewport((target.width() - s.width()) / 2, (target.height() - s.height()) / 2, s.width(), s.height());
+
+    const float *m;
+    QVector3D offset;
+    switch(_color_space) {
+    case QVideoSurfaceFormat::YCbCr_JPEG:
+        m = jpeg;
+        offset = QVector3D(0.0f, 128.0f / 255.0f, 128.0f / 255.0f);
+        break;
+    case QVideoSurfaceFormat::YCbCr_BT709:
+    case QVideoSurfaceFormat::YCbCr_xvYCC709:
+        m = bt709;
+        offset = QVector3D(16.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f);
+        break;
+    default:
+        m = bt601;
+        offset = QVector3D(16.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f);
+        break;
+    }
+
+    p->bind();
+    p->setUniformValue(p->uniformLocation("tex_y"), 0);
+    p->setUniformValue(p->uniformLocation("tex_u"), 1);
+    p->setUniformValue(p->uniformLocation("tex_v"), 2);
+    p->setUniformValue(p->uniformLocation("colour_matrix"), QMatrix3x3(m));
+    p->setUniformValue(p->uniformLocation("colour_offset"), offset);
+
+    int i;
+    for(i = 0; i < MaxPlanes; i++) {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, _textures[i]);
+    }
+
+    if (_core) {
+        _vao.bind();
+    }
+    _vbo.bind();
+    p->enableAttributeArray(ATTR_POSITION);
+    p->enableAttributeArray(ATTR_TEXCOORD);
+    p->setAttributeBuffer(ATTR_POSITION, GL_FLOAT, 0, 2, 4 * sizeof(GLfloat));
+    p->setAttributeBuffer(ATTR_TEXCOORD, GL_FLOAT, 2 * sizeof(GLfloat), 2, 4 * sizeof(GLfloat));
+
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    p->disableAttributeArray(ATTR_POSITION);
+    p->disableAttributeArray(ATTR_TEXCOORD);
+    _vbo.release();
+    if (_core) {
+        _vao.release();
+    }
+
+    for(i = MaxPlanes - 1; i >= 0; i--) {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    p->release();
+
+    glViewport(0, 0, target.width(), target.height());
+}
@@ -0,0 +1,79 @@
+/*
+ * ffmpeg-plugin - a Qt MultiMedia plugin for playback of video/audio using
+ * the ffmpeg library for decoding.
+ *
+ * OpenGL renderer for planar YUV, NV12 and RGB32 video frames. The planes are
+ * uploaded as textures (through pixel buffer objects when available), colour
+ * conversion, scaling and aspect ratio are done by the GPU.
+ *
+ * Copyright (C) 2021 Hans Dijkema, License: LGPLv3
+ * https://github.com/hdijkema/qmultimedia-plugin-ffmpeg
+ */
+
+#ifndef __GLYuvRenderer_H
+#define __GLYuvRenderer_H
+
+#include <QOpenGLFunctions>
+#include <QOpenGLBuffer>
+#include <QOpenGLVertexArrayObject>
+#include <QVideoFrame>
+#include <QVideoSurfaceFormat>
+#include <QHash>
+#include <QSize>
+
+class QOpenGLShaderProgram;
+
+class GLYuvRenderer : protected QOpenGLFunctions
+{
+public:
+    enum { MaxPlanes = 3, PboSets = 2 };
+
+private:
+    bool                     _initialized = false;
+    bool                     _core = false;         // desktop core profile, no luminance textures
+    bool                     _es = false;
+    bool                     _use_pbo = false;
+    bool                     _map_range = false;    // map PBOs with glMapBufferRange
+    bool                     _row_length = false;   // GL_UNPACK_ROW_LENGTH is available
+
+    QHash<int, QOpenGLShaderProgram *> _programs;   // per pixel format
+    QOpenGLBuffer            _vbo;
+    QOpenGLVertexArrayObject _vao;                  // core profile only
+
+    GLuint                   _textures[MaxPlanes] = { 0, 0, 0 };
+    QSize                    _texture_sizes[MaxPlanes];
+    GLint                    _texture_formats[MaxPlanes] = { 0, 0, 0 };    // internal format, 0 before allocation
+    QOpenGLBuffer           *_pbos[PboSets][MaxPlanes];
+    int                      _pbo_set = 0;
+    QByteArray               _repack;               // no PBO and no row length: planes are packed here
+
+    QVideoFrame::PixelFormat _format = QVideoFrame::Format_Invalid;
+    QVideoSurfaceFormat::YCbCrColorSpace _color_space = QVideoSurfaceFormat::YCbCr_BT601;
+    QSize                    _frame_size;
+
+public:
+    GLYuvRenderer();
+   ~GLYuvRenderer();
+
+public:
+    // With a current context
+    bool initialize();
+    void cleanup();
+
+    bool isInitialized() const;
+    QList<QVideoFrame::PixelFormat> supportedPixelFormats() const;
+    bool hasFrame() const;
+
+    // Uploads the planes of frame to the textures, the frame is not referenced afterwards.
+    bool upload(QVideoFrame &frame, const QVideoSurfaceFormat &format);
+
+    // Draws the last uploaded frame into a target of the given size (in device pixels).
+    void render(const QSize &target, Qt::AspectRatioMode mode);
+
+private:
+    QOpenGLShaderProgram *program(QVideoFrame::PixelFormat fmt);
+    void uploadPlane(int plane, int w, int h, int bytes_per_pixel, const uchar *data, int linesize);
+    void formatFor(int bytes_per_pixel, GLint &internal, GLenum &format) const;
+};
+
+#endif
@@ -17,6 +17,9 @@
 
 #define test_flag(a) ((a) != 0)
 
+#define SCRUB_INTERVAL_MS 250       // position changes closer together than this are scrubbing
+#define SCRUB_SETTLE_MS 200         // no position change for this long ends scrubbing
+
 static QMediaPlayer::State toQt(FFmpegProvider::State value) {
     switch (value) {
         case FFmpegProvider::Playing: return QMediaPlayer::PlayingState;
@@ -69,6 +72,29 @@ MediaPlayerControl::MediaPlayerControl(QObject* parent)
 #endif
                                  "CUDA", "FFmpeg"}); // no display for 2nd video
 
+    // e.g. FFMPEG_PLUGIN_VIDEO_DECODERS="FFmpeg:threads=4:thread_type=slice"
+    QString decoders = qEnvironmentVariable("FFMPEG_PLUGIN_VIDEO_DECODERS");
+    if (!decoders.isEmpty()) {
+        _provider->setVideoDecoders(decoders.split(',', Qt::SkipEmptyParts));
+    }
+
+    // FFMPEG_PLUGIN_SEEK="keyframe" or "precise"
+    if (qEnvironmentVariable("FFMPEG_PLUGIN_SEEK") == "keyframe") {
+        _seek_mode = FFmpegProvider::KeyframeSeek;
+    }
+
+    // FFMPEG_PLUGIN_SCRUB="0" turns off taking quick position changes as scrubbing
+    _auto_scrub = (qEnvironmentVariable("FFMPEG_PLUGIN_SCRUB") != "0");
+
+    _scrub_timer = new QTimer(this);
+    _scrub_timer->setSingleShot(true);
+    _scrub_timer->setInterval(SCRUB_SETTLE_MS);
+    connect(_scrub_timer, &QTimer::timeout, this, [this]() {
+        if (!_scrubbing) {
+            endScrub();
+        }
+    });
+
     _provider->onStateChanged([this](FFmpegProvider::State value){
         this->onStateChange(value);
     });
@@ -81,6 +107,11 @@ MediaPlayerControl::MediaPlayerControl(QObject* parent)
         this->onEvent(e);
     });
 
+    _provider->onBufferStatusChanged([this](int percent){
+        emit bufferStatusChanged(percent);
+        emit availablePlaybackRangesChanged(availablePlaybackRanges());
+    });
+
     _provider->setRenderCallback([this](void*){
         this->onRender();
     });
@@ -110,7 +141,18 @@ qint64 MediaPlayerControl::position() const
 
 void MediaPlayerControl::setPosition(qint64 position)
 {
-    _provider->seek(position);
+    bool rapid = _auto_scrub && _last_position_change.isValid() && _last_position_change.elapsed() < SCRUB_INTERVAL_MS;
+    _last_position_change.start();
+
+    if (_scrubbing || rapid) {
+        _scrub_position = position;
+        _provider->seek(position, FFmpegProvider::ScrubSeek);
+        _scrub_timer->start();
+    } else {
+        _scrub_timer->stop();
+        _scrub_position = -1;
+        _provider->seek(position, _seek_mode);
+    }
 }
 
 int MediaPlayerControl::volume() const
@@ -137,7 +179,7 @@ void MediaPlayerControl::setMuted(bool muted)
 
 int MediaPlayerControl::bufferStatus() const
 {
-    return 0;
+    return _provider->bufferStatus();
 }
 
 bool MediaPlayerControl::isAudioAvailable() const
@@ -157,7 +199,11 @@ bool MediaPlayerControl::isSeekable() const
 
 QMediaTimeRange MediaPlayerControl::availablePlaybackRanges() const
 {
-    return QMediaTimeRange();
+    QMediaTimeRange ranges;
+    for(const auto &r : _provider->bufferedRanges()) {
+        ranges.addInterval(r.first, r.second);
+    }
+    return ranges;
 }
 
 qreal MediaPlayerControl::playbackRate() const
@@ -180,19 +226,23 @@ void MediaPlayerControl::setPlaybackRate(qreal rate)
 
 QMediaContent MediaPlayerControl::media() const
 {
-    return QMediaContent();
+    return _media;
 }
 
 const QIODevice* MediaPlayerControl::mediaStream() const
 {
-    return nullptr;
+    return _stream;
 }
 
 void MediaPlayerControl::setMedia(const QMediaContent& media, QIODevice* io)
 {
     stop();
+    _scrub_timer->stop();
+    _scrub_position = -1;
+    _media = media;
+    _stream = io;
     if (io) {
-        _provider->setMedia(QString("qio:%1").arg(qintptr(io)));
+        _provider->setMedia(io);
     } else {
         QUrl u(media.request().url());
         if (u.isLocalFile())
@@ -268,3 +318,50 @@ FFmpegProvider *MediaPlayerControl::provider()
     return _provider;
 }
 
+QVariantMap MediaPlayerControl::statistics() const
+{
+    return _provider->statistics();
+}
+
+void MediaPlayerControl::setPreciseSeeking(bool yes)
+{
+    _seek_mode = (yes) ? FFmpegProvider::PreciseSeek : FFmpegProvider::KeyframeSeek;
+}
+
+bool MediaPlayerControl::preciseSeeking() const
+{
+    return _seek_mode == FFmpegProvider::PreciseSeek;
+}
+
+void MediaPlayerControl::setScrubbing(bool yes)
+{
+    _scrubbing = yes;
+    if (!yes) {
+        _scrub_timer->stop();
+        endScrub();
+    }
+}
+
+bool MediaPlayerControl::scrubbing() const
+{
+    return _scrubbing || _scrub_position >= 0;
+}
+
+// Shows the exact frame (or keyframe) at the last scrub position and continues from there
+void MediaPlayerControl::endScrub()
+{
+    if (_scrub_position >= 0) {
+        _provider->seek(_scrub_position, _seek_mode);
+        _scrub_position = -1;
+    }
+}
+
+void MediaPlayerControl::stepForward()
+{
+    _provider->stepFrame(1);
+}
+
+void MediaPlayerControl::stepBackward()
+{
+    _provider->stepFrame(-1);
+}
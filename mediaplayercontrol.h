@@ -14,6 +14,8 @@
 
 #include <QMediaPlayerControl>
 #include <QSize>
+#include <QTimer>
+#include <QElapsedTimer>
 #include "ffmpegprovider.h"
 
 class MediaPlayerControl : public QMediaPlayerControl
@@ -31,6 +33,16 @@ private:
     bool    _muted     = false;
     int     _volume    = 100;
     qint64  _duration  = 0;
+    QMediaContent _media;
+    QIODevice    *_stream = nullptr;
+    FFmpegProvider::SeekMode _seek_mode = FFmpegProvider::PreciseSeek;
+
+private:
+    QTimer        *_scrub_timer;            // the end of a drag, when position changes stop coming
+    QElapsedTimer  _last_position_change;
+    qint64         _scrub_position = -1;    // the last scrub target, -1 when not scrubbing
+    bool           _scrubbing = false;      // set by setScrubbing()
+    bool           _auto_scrub = true;
 
 public:
     QMediaPlayer::State state() const override;
@@ -74,6 +86,28 @@ public:
 public:
     FFmpegProvider *provider();
 
+    // Playback statistics of the plugin, e.g. the conversion time per resolution
+    Q_INVOKABLE QVariantMap statistics() const;
+
+    // Precise seeking (default) shows the frame at the position, otherwise
+    // the nearest keyframe is shown, which is faster, e.g. for scrubbing.
+    Q_INVOKABLE void setPreciseSeeking(bool yes);
+    Q_INVOKABLE bool preciseSeeking() const;
+
+    // While scrubbing, position changes only show the nearest keyframe and stale targets are
+    // dropped. Ending it seeks to the last position. Position changes that follow each other
+    // quickly, e.g. from a dragged slider, are taken as scrubbing without this.
+    Q_INVOKABLE void setScrubbing(bool yes);
+    Q_INVOKABLE bool scrubbing() const;
+
+    // Shows the next or previous frame and pauses. Recently shown frames and the GOP before
+    // them are kept decoded, so stepping back doesn't seek for every frame.
+    Q_INVOKABLE void stepForward();
+    Q_INVOKABLE void stepBackward();
+
+private:
+    void endScrub();
+
 signals:
     void frameAvailable();
 
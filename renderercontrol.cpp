@@ -52,9 +52,12 @@ void RendererControl::setSurface(QAbstractVideoSurface* surface)
 
     if (!surface) {
         provider->setRenderCallback(nullptr); // surfcace is set to null before destroy, avoid invokeMethod() on invalid this
+        _pixel_formats.clear();
         return;
     }
 
+    _pixel_formats = surface->supportedPixelFormats(QAbstractVideoBuffer::NoHandle);
+
     const QSize r = surface->nativeResolution(); // may be (-1, -1)
     // mdk player needs a vo. add before delivering a video frame
 
@@ -95,17 +98,27 @@ void RendererControl::onFrameAvailable()
 
     FFmpegProvider *provider = _ffmpeg->provider();
     bool gotIt;
-    QImage *img = provider->getImage(gotIt);
+    QVideoSurfaceFormat format;
+    QVideoFrame frame = provider->getVideoFrame(_pixel_formats, format, gotIt);
 
     if (gotIt) {
-        QVideoFrame frame(*img);
+        if (_surface->isActive() && _surface->surfaceFormat() != format) {
+            _surface->stop();
+        }
 
-        if (!_surface->isActive()) { // || surfaceFormat()!=
-            QVideoSurfaceFormat format(QSize(video_w_, video_h_), QVideoFrame::Format_RGB32, QAbstractVideoBuffer::NoHandle);
-            _surface->start(format);
+        // Not accepted after all: the format is removed and the same image is taken
+        // again, in another format or converted to RGB32
+        while(!_surface->isActive() && !_surface->start(format) && _pixel_formats.removeAll(format.pixelFormat()) > 0) {
+            LINE_DEBUG << "Surface doesn't accept pixel format" << format.pixelFormat();
+            frame = provider->getVideoFrame(_pixel_formats, format, gotIt);
+            if (!gotIt) {
+                return;
+            }
         }
 
-        _surface->present(frame); // main thread
+        if (_surface->isActive()) {
+            _surface->present(frame); // main thread
+        }
 
         provider->popImage();
     }
@@ -13,6 +13,7 @@
 #define __RenderControl_H
 
 #include <QVideoRendererControl>
+#include <QVideoFrame>
 
 
 class MediaPlayerControl;
@@ -38,6 +39,9 @@ private:
     MediaPlayerControl       *_ffmpeg = nullptr;
     QOpenGLFramebufferObject *_fbo = nullptr;
 
+    // Formats the surface renders itself, frames in these formats are not converted
+    QList<QVideoFrame::PixelFormat> _pixel_formats;
+
     // video_w/h_ is from MediaInfo, which may be incorrect.
     // A better value is from VideoFrame but it's not a public class now.
 
@@ -11,6 +11,7 @@
 
 #include "videowidgetcontrol.h"
 #include "mediaplayercontrol.h"
+#include "glyuvrenderer.h"
 
 #include <QOpenGLWidget>
 #include <QCoreApplication>
@@ -18,15 +19,25 @@
 #include <QOpenGLContext>
 #include <QOpenGLFunctions>
 #include <QPainter>
+#include <QElapsedTimer>
 #include <QDebug>
 
 #define LINE_DEBUG qDebug() << __FUNCTION__ << __LINE__;
 
+// FFMPEG_PLUGIN_GL_RENDERER=0 renders with QPainter, e.g. to compare both paths
+static bool glRendererEnabled()
+{
+    return qEnvironmentVariable("FFMPEG_PLUGIN_GL_RENDERER", "1") != "0";
+}
+
 class VideoWidget : public QOpenGLWidget, protected QOpenGLFunctions
 {
 private:
-    FFmpegProvider *_provider = nullptr;
-    bool            _first_time;
+    FFmpegProvider     *_provider = nullptr;
+    bool                _first_time;
+    GLYuvRenderer       _renderer;
+    bool                _use_gl = false;
+    Qt::AspectRatioMode _am = Qt::KeepAspectRatio;
 
 public:
     VideoWidget(QWidget *parent = nullptr) : QOpenGLWidget(parent) {}
@@ -36,18 +47,25 @@ public:
         _first_time = true;
     }
 
+    void setAspectRatioMode(Qt::AspectRatioMode mode) {
+        _am = mode;
+        update();
+    }
+
 protected:
     void initializeGL() override {
         initializeOpenGLFunctions();
         auto ctx = context();
-        connect(context(), &QOpenGLContext::aboutToBeDestroyed, [ctx]{
+        connect(context(), &QOpenGLContext::aboutToBeDestroyed, [this, ctx]{
             QOffscreenSurface s;
             s.create();
             ctx->makeCurrent(&s);
+            _renderer.cleanup();
             FFmpegProvider::foreignGLContextDestroyed();
             ctx->doneCurrent();
         });
         _first_time = true;
+        _use_gl = glRendererEnabled() && _renderer.initialize();
     }
 
     void resizeGL(int w, int h) override {
@@ -58,6 +76,10 @@ protected:
 
     void paintGL() override {
         if (!_provider) return;
+        if (_use_gl) {
+            paintYuv();
+            return;
+        }
         if (_first_time) {
             glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
@@ -65,6 +87,43 @@ protected:
         QPainter p(this);
         _provider->renderVideo(&p);
     }
+
+    // Uploads the next frame in its native format, the GPU converts and scales it
+    void paintYuv() {
+        QElapsedTimer timer;
+        timer.start();
+
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        bool gotIt;
+        QVideoSurfaceFormat format;
+        QVideoFrame frame = _provider->getVideoFrame(_renderer.supportedPixelFormats(), format, gotIt);
+        qint64 upload_ns = 0;
+
+        if (gotIt) {
+            QElapsedTimer upload_timer;
+            upload_timer.start();
+            bool ok = _renderer.upload(frame, format);
+            upload_ns = upload_timer.nsecsElapsed();
+
+            // The frame stays queued, so the QPainter fallback shows it
+            if (!ok) {
+                qDebug() << __FUNCTION__ << __LINE__ << "Cannot render" << frame.pixelFormat() << "with OpenGL, falling back to QPainter";
+                _use_gl = false;
+                update();
+                return;
+            }
+            _provider->popImage();
+        }
+
+        qreal dpr = devicePixelRatioF();
+        _renderer.render(QSize(qRound(width() * dpr), qRound(height() * dpr)), _am);
+
+        if (gotIt) {
+            _provider->recordRenderStats("gl", timer.nsecsElapsed(), upload_ns);
+        }
+    }
 };
 
 VideoWidgetControl::VideoWidgetControl(MediaPlayerControl* player, QObject* parent)
@@ -111,6 +170,7 @@ static FFmpegProvider::Ratio fromQt(Qt::AspectRatioMode value)
 void VideoWidgetControl::setAspectRatioMode(Qt::AspectRatioMode mode)
 {
     _am = mode;
+    _video_widget->setAspectRatioMode(mode);
     _ffmpeg->provider()->setAspectRatio(fromQt(mode));
 }
 